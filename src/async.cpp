@@ -0,0 +1,134 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <chrono>
+#include "io.h"
+#include "async.h"
+
+namespace IPS {
+
+/** Default constructor. **/
+ApplyJob::ApplyJob()
+    : _cancel(false)
+    , _options()
+    , _result()
+{}
+/** Destructor. Cancels the job and waits for its completion. **/
+ApplyJob::~ApplyJob()
+{
+    if(_result.valid())
+    {
+        cancel();
+        _result.wait();
+    }
+}
+/**
+ * Start applying the patch.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] options Apply options (the cancel flag is ignored).
+ * @return @b false if a job is already running.
+ */
+bool ApplyJob::start(std::string const& in, std::string const& out, Patch const& patch, ApplyOptions const& options)
+{
+    if(_result.valid() && !finished())
+    {
+        return false;
+    }
+    _cancel = false;
+    _options = options;
+    _options.cancel = &_cancel;
+    Patch const* p = &patch;
+    ApplyOptions const* o = &_options;
+    _result = std::async(std::launch::async, [in, out, p, o]() {
+        return apply(in.c_str(), out.c_str(), *p, *o);
+    });
+    return true;
+}
+/**
+ * Parse a patch file and apply it, both on the worker thread.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch filename.
+ * @param [in] options Apply options (the cancel flag is ignored).
+ * @return @b false if a job is already running.
+ */
+bool ApplyJob::start(std::string const& in, std::string const& out, std::string const& patch, ApplyOptions const& options)
+{
+    if(_result.valid() && !finished())
+    {
+        return false;
+    }
+    _cancel = false;
+    _options = options;
+    _options.cancel = &_cancel;
+    ApplyOptions const* o = &_options;
+    std::atomic<bool> const* cancel = &_cancel;
+    _result = std::async(std::launch::async, [in, out, patch, o, cancel]() {
+        IO io;
+        Patch parsed;
+        Status status = io.read(patch, parsed);
+        if(!status)
+        {
+            return status;
+        }
+        if(cancel->load())
+        {
+            return Status(IPS_ERROR);
+        }
+        return apply(in.c_str(), out.c_str(), parsed, *o);
+    });
+    return true;
+}
+/**
+ * Request cancellation. The output file is removed.
+ */
+void ApplyJob::cancel()
+{
+    _cancel = true;
+}
+/**
+ * Check if the job is finished.
+ */
+bool ApplyJob::finished() const
+{
+    return !_result.valid() || (std::future_status::ready == _result.wait_for(std::chrono::seconds(0)));
+}
+/**
+ * Wait for the job to finish.
+ * @return Apply status.
+ */
+Status ApplyJob::wait()
+{
+    if(false == _result.valid())
+    {
+        return Status(IPS_ERROR);
+    }
+    return _result.get();
+}
+/** Constructor. **/
+ApplyJob::ApplyJob(ApplyJob const&)
+    : _cancel(false)
+    , _options()
+    , _result()
+{}
+/** Copy operator. **/
+ApplyJob& ApplyJob::operator= (ApplyJob const&)
+{
+    return *this;
+}
+
+} // namespace IPS
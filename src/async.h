@@ -0,0 +1,89 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_ASYNC_H_
+#define _IPS_ASYNC_H_
+
+#include <atomic>
+#include <future>
+#include <string>
+#include "ips.h"
+#include "utils.h"
+
+namespace IPS {
+
+/**
+ * Asynchronous patch application.
+ * The patch is applied on a worker thread. Progress is reported through
+ * the callback of the apply options, from the worker thread.
+ */
+class ApplyJob
+{
+    public:
+        /** Default constructor. **/
+        ApplyJob();
+        /** Destructor. Cancels the job and waits for its completion. **/
+        ~ApplyJob();
+        /**
+         * Start applying the patch.
+         * The patch must stay alive until the job is finished.
+         * @param [in] in      Input filename.
+         * @param [in] out     Output filename.
+         * @param [in] patch   IPS patch.
+         * @param [in] options Apply options (the cancel flag is ignored).
+         * @return @b false if a job is already running.
+         */
+        bool start(std::string const& in, std::string const& out, Patch const& patch, ApplyOptions const& options);
+        /**
+         * Parse a patch file and apply it, both on the worker thread.
+         * @param [in] in      Input filename.
+         * @param [in] out     Output filename.
+         * @param [in] patch   IPS patch filename.
+         * @param [in] options Apply options (the cancel flag is ignored).
+         * @return @b false if a job is already running.
+         */
+        bool start(std::string const& in, std::string const& out, std::string const& patch, ApplyOptions const& options);
+        /**
+         * Request cancellation. The output file is removed.
+         */
+        void cancel();
+        /**
+         * Check if the job is finished.
+         */
+        bool finished() const;
+        /**
+         * Wait for the job to finish.
+         * @return Apply status.
+         */
+        Status wait();
+
+    private:
+        /** Constructor. **/
+        ApplyJob(ApplyJob const&);
+        /** Copy operator. **/
+        ApplyJob& operator= (ApplyJob const&);
+
+    private:
+        /** Cancellation flag. **/
+        std::atomic<bool> _cancel;
+        /** Job options. **/
+        ApplyOptions _options;
+        /** Job result. **/
+        std::future<Status> _result;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_ASYNC_H_ */
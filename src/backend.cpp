@@ -0,0 +1,96 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include "backend.h"
+
+namespace IPS {
+
+const size_t Backend::SmallFile;
+const size_t Backend::LargeFile;
+
+/**
+ * Backend name.
+ */
+const char* Backend::name(Value v)
+{
+    static const char* names[Backend::Count] =
+    {
+        "auto", "stdio", "read", "mmap", "direct", "copy-range"
+    };
+    return (v < Backend::Count) ? names[v] : "unknown";
+}
+/**
+ * Get a backend from its name.
+ * @param [in]  name  Backend name.
+ * @param [out] value Backend.
+ * @return @b false if the name is unknown.
+ */
+bool Backend::parse(const char* name, Value& value)
+{
+    for(int i=0; i<Backend::Count; i++)
+    {
+        if(0 == strcmp(name, Backend::name(static_cast<Value>(i))))
+        {
+            value = static_cast<Value>(i);
+            return true;
+        }
+    }
+    return false;
+}
+/**
+ * Pick the backend of a source copy.
+ * @param [in] in       Source filename.
+ * @param [in] out      Output filename (it may not exist yet).
+ * @param [in] needData The source data is read by the copy.
+ * @return Backend (never @b Auto).
+ */
+Backend::Value Backend::select(const char* in, const char* out, bool needData)
+{
+    struct stat source;
+    if((0 != stat(in, &source)) || !S_ISREG(source.st_mode))
+    {
+        return Read;
+    }
+    size_t size = static_cast<size_t>(source.st_size);
+    if(size <= SmallFile)
+    {
+        return Stdio;
+    }
+    if(false == needData)
+    {
+        // The output is created in the directory if it does not exist.
+        std::string directory(out);
+        struct stat output;
+        if(0 != stat(out, &output))
+        {
+            size_t slash = directory.rfind('/');
+            directory = (std::string::npos == slash) ? "." : directory.substr(0, slash + 1);
+            if(0 != stat(directory.c_str(), &output))
+            {
+                output.st_dev = ~source.st_dev;
+            }
+        }
+        if(output.st_dev == source.st_dev)
+        {
+            return CopyRange;
+        }
+    }
+    return (size >= LargeFile) ? Direct : Read;
+}
+
+} // namespace IPS
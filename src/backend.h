@@ -0,0 +1,69 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_BACKEND_H_
+#define _IPS_BACKEND_H_
+
+#include <cstddef>
+
+namespace IPS {
+/**
+ * Source copy backends.
+ */
+struct Backend
+{
+    /** Backend values. **/
+    enum Value
+    {
+        Auto = 0,   /**< Picked from the source size and the filesystems. **/
+        Stdio,      /**< Buffered stdio streams. **/
+        Read,       /**< read() into staging buffers and batched writes. **/
+        Map,        /**< Batched writes straight from a window mapping the source. **/
+        Direct,     /**< O_DIRECT reads into the aligned staging buffers. **/
+        CopyRange,  /**< In-kernel copy (copy_file_range). **/
+        Count
+    };
+    /** Sources up to this size go through stdio. **/
+    static const size_t SmallFile = 64 * 1024;
+    /** Sources at least this large bypass the page cache. **/
+    static const size_t LargeFile = 1024 * 1024 * 1024;
+    /**
+     * Backend name.
+     */
+    static const char* name(Value v);
+    /**
+     * Get a backend from its name.
+     * @param [in]  name  Backend name.
+     * @param [out] value Backend.
+     * @return @b false if the name is unknown.
+     */
+    static bool parse(const char* name, Value& value);
+    /**
+     * Pick the backend of a source copy.
+     * Small sources go through stdio. The copy is offloaded to the kernel
+     * when source and output are on the same filesystem, unless the
+     * source data is needed (CRC32 check). Large sources are read with
+     * O_DIRECT so that they do not evict the page cache.
+     * @param [in] in       Source filename.
+     * @param [in] out      Output filename (it may not exist yet).
+     * @param [in] needData The source data is read by the copy.
+     * @return Backend (never @b Auto).
+     */
+    static Value select(const char* in, const char* out, bool needData);
+};
+
+} // namespace IPS
+
+#endif /* _IPS_BACKEND_H_ */
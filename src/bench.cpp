@@ -0,0 +1,409 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+#include "log.h"
+#include "ips.h"
+#include "io.h"
+#include "utils.h"
+
+/**
+ * Allocation counters.
+ * The replacement operators are kept out of line so that the compiler does not
+ * pair inlined new/free calls.
+ */
+static std::atomic<size_t> g_allocations(0);
+static std::atomic<size_t> g_allocatedBytes(0);
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    g_allocations++;
+    g_allocatedBytes += size;
+    void *ptr = malloc(size ? size : 1);
+    if(nullptr == ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+/**
+ * Deterministic pseudo random number generator (xorshift64*).
+ */
+class Random
+{
+    public:
+        Random(uint64_t seed) : _state(seed ? seed : 0x9e3779b97f4a7c15ULL) {}
+        uint64_t next()
+        {
+            _state ^= _state >> 12;
+            _state ^= _state << 25;
+            _state ^= _state >> 27;
+            return _state * 0x2545f4914f6cdd1dULL;
+        }
+        uint32_t range(uint32_t lo, uint32_t hi)
+        {
+            return lo + static_cast<uint32_t>(next() % (hi - lo + 1));
+        }
+    private:
+        uint64_t _state;
+};
+
+/**
+ * Synthetic patch description.
+ */
+struct Scenario
+{
+    const char *name;       /**< Scenario name. **/
+    size_t sourceSize;      /**< Source ROM size. **/
+    size_t records;         /**< Number of records. **/
+    uint32_t firstOffset;   /**< Offset of the first record. **/
+    uint32_t minSize;       /**< Minimum record size. **/
+    uint32_t maxSize;       /**< Maximum record size. **/
+    uint32_t maxGap;        /**< Maximum gap between two records. **/
+    unsigned rlePercent;    /**< Percentage of RLE records. **/
+};
+
+static void put24(std::vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >>  8) & 0xff);
+    out.push_back( value        & 0xff);
+}
+static void put16(std::vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back((value >> 8) & 0xff);
+    out.push_back( value       & 0xff);
+}
+
+/**
+ * Generate the source ROM and the patch of a scenario.
+ * @return Number of generated records.
+ */
+static size_t generate(Scenario const& scenario, uint64_t seed, std::string const& sourceName, std::string const& patchName)
+{
+    Random random(seed);
+
+    std::vector<uint8_t> source(scenario.sourceSize);
+    for(size_t i=0; i<source.size(); i++)
+    {
+        source[i] = static_cast<uint8_t>(random.next());
+    }
+    FILE *stream = fopen(sourceName.c_str(), "wb");
+    if(nullptr == stream)
+    {
+        return 0;
+    }
+    fwrite(source.data(), 1, source.size(), stream);
+    fclose(stream);
+
+    std::vector<uint8_t> patch;
+    patch.insert(patch.end(), IPS::IO::Header, IPS::IO::Header + IPS::IO::HeaderSize);
+    uint64_t offset = scenario.firstOffset;
+    size_t count = 0;
+    for(; count<scenario.records; count++)
+    {
+        uint32_t size = random.range(scenario.minSize, scenario.maxSize);
+        if((offset + size) > 0xffffff)
+        {
+            break;
+        }
+        // Skip the "EOF" marker offset.
+        if((offset <= 0x454f46) && ((offset + size) > 0x454f46))
+        {
+            offset = 0x454f47;
+        }
+        put24(patch, static_cast<uint32_t>(offset));
+        if(random.range(0, 99) < scenario.rlePercent)
+        {
+            put16(patch, 0);
+            put16(patch, size);
+            patch.push_back(static_cast<uint8_t>(random.next()));
+        }
+        else
+        {
+            put16(patch, size);
+            for(uint32_t i=0; i<size; i++)
+            {
+                patch.push_back(static_cast<uint8_t>(random.next()));
+            }
+        }
+        offset += size + random.range(0, scenario.maxGap);
+    }
+    patch.insert(patch.end(), IPS::IO::Footer, IPS::IO::Footer + IPS::IO::FooterSize);
+
+    stream = fopen(patchName.c_str(), "wb");
+    if(nullptr == stream)
+    {
+        return 0;
+    }
+    fwrite(patch.data(), 1, patch.size(), stream);
+    fclose(stream);
+    return count;
+}
+
+/**
+ * Phase measurement.
+ */
+struct Measure
+{
+    double seconds;
+    size_t allocations;
+    size_t allocatedBytes;
+};
+
+/**
+ * Run a phase several times and keep the fastest run.
+ */
+static Measure run(unsigned iterations, std::function<void()> setup, std::function<bool()> phase, bool& ok)
+{
+    Measure best = { 0.0, 0, 0 };
+    ok = true;
+    for(unsigned i=0; i<iterations; i++)
+    {
+        setup();
+        size_t allocations = g_allocations.load();
+        size_t allocatedBytes = g_allocatedBytes.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ok = phase() && ok;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if((0 == i) || (elapsed.count() < best.seconds))
+        {
+            best.seconds = elapsed.count();
+            best.allocations = g_allocations.load() - allocations;
+            best.allocatedBytes = g_allocatedBytes.load() - allocatedBytes;
+        }
+    }
+    return best;
+}
+
+/**
+ * Print a measurement as a JSON line.
+ */
+static void report(const char* scenario, const char* phase, Measure const& measure, size_t bytes, size_t records, bool ok)
+{
+    double seconds = (measure.seconds > 0.0) ? measure.seconds : 1e-9;
+    printf("{\"scenario\":\"%s\",\"phase\":\"%s\",\"ok\":%s,\"seconds\":%.6f,"
+           "\"bytes\":%zu,\"records\":%zu,\"mb_per_s\":%.2f,\"records_per_s\":%.0f,"
+           "\"allocations\":%zu,\"allocated_bytes\":%zu}\n",
+           scenario, phase, ok ? "true" : "false", measure.seconds,
+           bytes, records, (bytes / (1024.0 * 1024.0)) / seconds, records / seconds,
+           measure.allocations, measure.allocatedBytes);
+    fflush(stdout);
+}
+
+/**
+ * Print usage.
+ */
+void usage()
+{
+    std::cerr << "usage: ips-patcher-bench [options]" << std::endl;
+    std::cerr << "       Time patch reading, record insertion, source copy and apply" << std::endl;
+    std::cerr << "       on synthetic patches. Results are printed as JSON lines." << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -d, --dir <dir>         Working directory (default: /tmp)." << std::endl;
+    std::cerr << "  -i, --iterations <n>    Number of runs per phase (default: 3)." << std::endl;
+    std::cerr << "  -s, --seed <n>          Generator seed (default: 1)." << std::endl;
+}
+
+/**
+ * Main entry point.
+ */
+int main(int argc, char** argv)
+{
+    static const struct option longOptions[] =
+    {
+        { "dir",        required_argument, nullptr, 'd' },
+        { "iterations", required_argument, nullptr, 'i' },
+        { "seed",       required_argument, nullptr, 's' },
+        { "help",       no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    std::string directory = "/tmp";
+    unsigned iterations = 3;
+    uint64_t seed = 1;
+    int c;
+    while(-1 != (c = getopt_long(argc, argv, "d:i:s:h", longOptions, nullptr)))
+    {
+        switch(c)
+        {
+            case 'd':
+                directory = optarg;
+                break;
+            case 'i':
+                iterations = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            case 's':
+                seed = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage();
+                return 0;
+        }
+    }
+    if(0 == iterations)
+    {
+        iterations = 1;
+    }
+
+    static const Scenario scenarios[] =
+    {
+        // name             source      records  first     min    max    gap    rle
+        { "small_records",  4 << 20,    150000,  0,        1,     16,    8,     10  },
+        { "rle_fills",      4 << 20,    256,     0,        32768, 65535, 0,     100 },
+        { "padding_growth", 64 << 10,   2000,    1 << 20,  64,    1024,  4096,  20  },
+        { "large_records",  8 << 20,    4000,    0,        4096,  65535, 64,    0   },
+        { "near_16mb",      1 << 20,    20000,   0xf00000, 16,    64,    16,    10  },
+    };
+
+    Log::Logger& logger = Log::Logger::instance();
+    Log::Output output;
+    logger.begin(&output);
+    logger.setLevel(Log::Type::Warning);
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "%d", static_cast<int>(getpid()));
+    std::string sourceName = directory + "/ips-bench-" + suffix + ".rom";
+    std::string patchName  = directory + "/ips-bench-" + suffix + ".ips";
+    std::string outputName = directory + "/ips-bench-" + suffix + ".out";
+
+    int ret = 0;
+    for(size_t s=0; s<sizeof(scenarios)/sizeof(scenarios[0]); s++)
+    {
+        Scenario const& scenario = scenarios[s];
+        size_t count = generate(scenario, seed + s, sourceName, patchName);
+        if(0 == count)
+        {
+            Error("Failed to generate scenario %s", scenario.name);
+            ret = 1;
+            continue;
+        }
+
+        bool ok;
+        size_t patchSize = 0;
+        {
+            FILE *stream = fopen(patchName.c_str(), "rb");
+            if(nullptr != stream)
+            {
+                fseek(stream, 0, SEEK_END);
+                patchSize = ftell(stream);
+                fclose(stream);
+            }
+        }
+
+        // IO::read
+        IPS::Patch *patch = nullptr;
+        Measure measure = run(iterations,
+            [&patch]() { delete patch; patch = new IPS::Patch(); },
+            [&patch, &patchName]() { IPS::IO io; return io.read(patchName, *patch); },
+            ok);
+        report(scenario.name, "read", measure, patchSize, count, ok);
+        ret |= ok ? 0 : 1;
+
+        // Patch::add with overlap check, from already decoded records.
+        std::vector<IPS::Record> records;
+        for(size_t i=0; i<patch->count(); i++)
+        {
+            records.push_back((*patch)[i]);
+        }
+        IPS::Patch *added = nullptr;
+        measure = run(iterations,
+            [&added]() { delete added; added = new IPS::Patch(); },
+            [&added, &records]() {
+                for(size_t i=0; i<records.size(); i++)
+                {
+                    if(false == added->add(records[i]))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            },
+            ok);
+        report(scenario.name, "add", measure, 0, records.size(), ok);
+        ret |= ok ? 0 : 1;
+        delete added;
+
+        // copyFile
+        measure = run(iterations,
+            []() {},
+            [&sourceName, &outputName]() {
+                FILE *stream = IPS::copyFile(sourceName, outputName);
+                if(nullptr == stream)
+                {
+                    return false;
+                }
+                fclose(stream);
+                return true;
+            },
+            ok);
+        report(scenario.name, "copy", measure, scenario.sourceSize, 0, ok);
+        ret |= ok ? 0 : 1;
+
+        // apply
+        size_t written = scenario.sourceSize;
+        for(size_t i=0; i<patch->count(); i++)
+        {
+            written += (*patch)[i].size;
+        }
+        measure = run(iterations,
+            []() {},
+            [&sourceName, &outputName, &patch]() { return IPS::apply(sourceName.c_str(), outputName.c_str(), *patch, false); },
+            ok);
+        report(scenario.name, "apply", measure, written, patch->count(), ok);
+        ret |= ok ? 0 : 1;
+
+        delete patch;
+    }
+
+    remove(sourceName.c_str());
+    remove(patchName.c_str());
+    remove(outputName.c_str());
+
+    logger.end();
+    return ret;
+}
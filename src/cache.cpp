@@ -0,0 +1,274 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "mapping.h"
+#include "cache.h"
+
+namespace IPS {
+
+const char* Cache::Magic = "IPSIDX02";
+const size_t Cache::MagicSize = 8;
+
+/**
+ * Index file header. It is followed by the offset (uint32_t), payload
+ * offset (uint32_t), size (uint16_t) and RLE flag (uint8_t) arrays.
+ * For RLE records the payload offset holds the data byte.
+ */
+struct IndexHeader
+{
+    char     magic[8];  /**< Index magic. **/
+    uint64_t key;       /**< Patch content hash. **/
+    uint64_t patchSize; /**< Patch file size. **/
+    uint64_t count;     /**< Record count. **/
+    uint64_t truncation; /**< Truncation size (UINT64_MAX if none). **/
+};
+
+/** Size of the index for @b count records. **/
+static size_t indexSize(size_t count)
+{
+    return sizeof(IndexHeader) + count * (sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t));
+}
+
+/** Default constructor. **/
+Cache::Cache()
+    : _directory()
+{}
+/** Destructor. **/
+Cache::~Cache()
+{}
+/**
+ * Set cache directory. It is created if it does not exist.
+ * @param [in] directory Cache directory.
+ * @return @b true on success.
+ */
+bool Cache::setDirectory(std::string const& directory)
+{
+    _directory = directory;
+    for(size_t i=1; i<=directory.size(); i++)
+    {
+        if((i == directory.size()) || ('/' == directory[i]))
+        {
+            std::string current = directory.substr(0, i);
+            if((mkdir(current.c_str(), 0755) < 0) && (EEXIST != errno))
+            {
+                Error("Failed to create %s: %s", current.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+/**
+ * Default cache directory ($XDG_CACHE_HOME/ips-patcher or
+ * $HOME/.cache/ips-patcher).
+ */
+std::string Cache::defaultDirectory()
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if((nullptr != xdg) && (0 != xdg[0]))
+    {
+        return std::string(xdg) + "/ips-patcher";
+    }
+    const char *home = getenv("HOME");
+    if((nullptr != home) && (0 != home[0]))
+    {
+        return std::string(home) + "/.cache/ips-patcher";
+    }
+    return "/tmp/ips-patcher";
+}
+/** Index filename. **/
+std::string Cache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.idx", static_cast<unsigned long long>(key));
+    return _directory + name;
+}
+/**
+ * Load patch index.
+ * @param [in]  key   Patch content hash.
+ * @param [in]  data  Patch file content.
+ * @param [in]  size  Patch file size.
+ * @param [out] patch IPS patch. Record data points to @b data.
+ *                   The index is not kept mapped.
+ * @return @b false if there is no valid entry for this patch.
+ */
+bool Cache::load(uint64_t key, const uint8_t* data, size_t size, Patch& patch)
+{
+    std::string filename = path(key);
+    if(0 != access(filename.c_str(), R_OK))
+    {
+        return false;
+    }
+    MappedFile index;
+    if(false == index.open(filename))
+    {
+        return false;
+    }
+    if(index.size() < sizeof(IndexHeader))
+    {
+        Warning("Invalid cache entry %s", filename.c_str());
+        return false;
+    }
+    IndexHeader header;
+    memcpy(&header, index.data(), sizeof(IndexHeader));
+    if(memcmp(header.magic, Cache::Magic, Cache::MagicSize) ||
+       (header.key != key) || (header.patchSize != size) ||
+       (index.size() != indexSize(header.count)))
+    {
+        Warning("Invalid cache entry %s", filename.c_str());
+        return false;
+    }
+
+    size_t count = header.count;
+    const uint8_t *ptr = index.data() + sizeof(IndexHeader);
+    const uint32_t *offsets  = reinterpret_cast<const uint32_t*>(ptr);
+    const uint32_t *payloads = offsets + count;
+    const uint16_t *sizes    = reinterpret_cast<const uint16_t*>(payloads + count);
+    const uint8_t  *flags    = reinterpret_cast<const uint8_t*>(sizes + count);
+
+    // The index is checked before the patch is touched, so that a corrupt
+    // or colliding entry falls back to a parse. The columns are copied:
+    // Patch owns its columns, and payloads are stored as pointers.
+    std::vector<uint32_t> recordOffsets(offsets, offsets + count);
+    std::vector<uint16_t> recordSizes(sizes, sizes + count);
+    std::vector<uint8_t> recordRle(count);
+    std::vector<uintptr_t> recordPayloads(count);
+    for(size_t i=0; i<count; i++)
+    {
+        recordRle[i] = (0 != flags[i]);
+        if(recordRle[i])
+        {
+            recordPayloads[i] = static_cast<uintptr_t>(payloads[i] & 0xff);
+        }
+        else
+        {
+            if((static_cast<size_t>(payloads[i]) + sizes[i]) > size)
+            {
+                Warning("Invalid cache entry %s", filename.c_str());
+                return false;
+            }
+            recordPayloads[i] = reinterpret_cast<uintptr_t>(data + payloads[i]);
+        }
+        // Records are stored sorted and do not overlap.
+        if(i && ((offsets[i] < offsets[i-1]) || ((static_cast<size_t>(offsets[i-1]) + sizes[i-1]) > offsets[i])))
+        {
+            Warning("Invalid cache entry %s", filename.c_str());
+            return false;
+        }
+    }
+    patch.assign(std::move(recordOffsets), std::move(recordSizes), std::move(recordRle), std::move(recordPayloads));
+    patch.setTruncation((UINT64_MAX == header.truncation) ? Patch::NoTruncation : static_cast<size_t>(header.truncation));
+    return true;
+}
+/**
+ * Store patch index.
+ * @param [in] key   Patch content hash.
+ * @param [in] data  Patch file content.
+ * @param [in] size  Patch file size.
+ * @param [in] patch IPS patch. Record data must point to @b data.
+ * @return @b true on success.
+ */
+bool Cache::store(uint64_t key, const uint8_t* data, size_t size, Patch const& patch)
+{
+    size_t count = patch.count();
+    std::vector<uint8_t> buffer(indexSize(count));
+
+    IndexHeader header;
+    memcpy(header.magic, Cache::Magic, Cache::MagicSize);
+    header.key       = key;
+    header.patchSize = size;
+    header.count     = count;
+    header.truncation = patch.truncated() ? patch.truncation() : UINT64_MAX;
+    memcpy(&buffer[0], &header, sizeof(IndexHeader));
+
+    uint8_t  *ptr      = &buffer[0] + sizeof(IndexHeader);
+    uint32_t *offsets  = reinterpret_cast<uint32_t*>(ptr);
+    uint32_t *payloads = offsets + count;
+    uint16_t *sizes    = reinterpret_cast<uint16_t*>(payloads + count);
+    uint8_t  *flags    = reinterpret_cast<uint8_t*>(sizes + count);
+    // The index uses the column layout of the patch records.
+    if(count)
+    {
+        memcpy(offsets, patch.offsets(), count * sizeof(uint32_t));
+        memcpy(sizes, patch.sizes(), count * sizeof(uint16_t));
+        memcpy(flags, patch.rle(), count * sizeof(uint8_t));
+    }
+    const uintptr_t *records = patch.payloads();
+    for(size_t i=0; i<count; i++)
+    {
+        if(flags[i])
+        {
+            payloads[i] = static_cast<uint32_t>(records[i] & 0xff);
+        }
+        else
+        {
+            const uint8_t *payload = reinterpret_cast<const uint8_t*>(records[i]);
+            if((payload < data) || ((payload + sizes[i]) > (data + size)))
+            {
+                Error("Record #%zu data does not belong to the patch file", i);
+                return false;
+            }
+            payloads[i] = static_cast<uint32_t>(payload - data);
+        }
+    }
+
+    // Write to a temporary file first so that concurrent readers never
+    // see a partial index. Its name is unique, several threads or
+    // processes may store the same entry.
+    std::string filename = path(key);
+    std::string tmpFilename = filename + ".XXXXXX";
+    int fd = mkstemp(&tmpFilename[0]);
+    FILE *stream = (fd < 0) ? nullptr : fdopen(fd, "wb");
+    if(nullptr == stream)
+    {
+        Error("Failed to open %s: %s", tmpFilename.c_str(), strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+            remove(tmpFilename.c_str());
+        }
+        return false;
+    }
+    size_t nWritten = fwrite(&buffer[0], 1, buffer.size(), stream);
+    bool ok = (buffer.size() == nWritten);
+    if(0 != fclose(stream))
+    {
+        ok = false;
+    }
+    if(false == ok)
+    {
+        Error("Failed to write %s: %s", tmpFilename.c_str(), strerror(errno));
+        remove(tmpFilename.c_str());
+        return false;
+    }
+    if(rename(tmpFilename.c_str(), filename.c_str()) < 0)
+    {
+        Error("Failed to rename %s: %s", tmpFilename.c_str(), strerror(errno));
+        remove(tmpFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace IPS
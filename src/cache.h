@@ -0,0 +1,86 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_CACHE_H_
+#define _IPS_CACHE_H_
+
+#include <string>
+#include "ips.h"
+
+namespace IPS {
+
+/**
+ * On-disk cache of parsed patches.
+ * Each entry is a binary index of the patch records (sorted offsets,
+ * sizes, RLE flags and payload offsets) stored in a file named after
+ * the hash of the patch content. Loading a cached patch involves no
+ * parsing. The index is mapped and checked, then its columns are copied
+ * into the patch. The payload offsets are turned into pointers to the
+ * patch data, which is mapped at a different address on each run.
+ */
+class Cache
+{
+    public:
+        static const char* Magic;
+        static const size_t MagicSize;
+
+    public:
+        /** Default constructor. **/
+        Cache();
+        /** Destructor. **/
+        ~Cache();
+        /**
+         * Set cache directory. It is created if it does not exist.
+         * @param [in] directory Cache directory.
+         * @return @b true on success.
+         */
+        bool setDirectory(std::string const& directory);
+        /**
+         * Default cache directory ($XDG_CACHE_HOME/ips-patcher or
+         * $HOME/.cache/ips-patcher).
+         */
+        static std::string defaultDirectory();
+        /**
+         * Load patch index.
+         * @param [in]  key   Patch content hash.
+         * @param [in]  data  Patch file content.
+         * @param [in]  size  Patch file size.
+         * @param [out] patch IPS patch. Record data points to @b data.
+         *                   The index is not kept mapped.
+         * @return @b false if there is no valid entry for this patch.
+         */
+        bool load(uint64_t key, const uint8_t* data, size_t size, Patch& patch);
+        /**
+         * Store patch index.
+         * @param [in] key   Patch content hash.
+         * @param [in] data  Patch file content.
+         * @param [in] size  Patch file size.
+         * @param [in] patch IPS patch. Record data must point to @b data.
+         * @return @b true on success.
+         */
+        bool store(uint64_t key, const uint8_t* data, size_t size, Patch const& patch);
+
+    private:
+        /** Index filename. **/
+        std::string path(uint64_t key) const;
+
+    private:
+        /** Cache directory. **/
+        std::string _directory;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_CACHE_H_ */
@@ -15,18 +15,165 @@
  */
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <getopt.h>
+#include <unistd.h>
 #include "log.h"
 #include "ips.h"
 #include "io.h"
 #include "utils.h"
+#include "cache.h"
+#include "protocol.h"
+#include "stats.h"
 
 /**
  * Print usage.
  */
 void usage()
 {
-    std::cerr << "usage: ips-patcher-cli source patch destination" << std::endl;
+    std::cerr << "usage: ips-patcher-cli [options] source patch destination" << std::endl;
     std::cerr << "       Apply IPS patch to \"source\" file and write output to \"destination\"." << std::endl;
+    std::cerr << "       ips-patcher-cli --validate patch..." << std::endl;
+    std::cerr << "       Check IPS patches without applying them." << std::endl;
+    std::cerr << "       ips-patcher-cli --diff source target patch" << std::endl;
+    std::cerr << "       Create an IPS patch turning \"source\" into \"target\"." << std::endl;
+    std::cerr << "       ips-patcher-cli --minimize source patch output" << std::endl;
+    std::cerr << "       Rewrite \"patch\" into the smallest equivalent patch for \"source\"." << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -c, --crc <crc32>  Abort if the source CRC32 does not match." << std::endl;
+    std::cerr << "  -v, --validate     Only validate the patches." << std::endl;
+    std::cerr << "  -d, --diff         Create a patch from two files." << std::endl;
+    std::cerr << "  -m, --minimize     Minimize a patch against its source." << std::endl;
+    std::cerr << "  -s, --socket <path> Send the request to the ips-patcherd daemon." << std::endl;
+    std::cerr << "  -q, --quiet        Only output warnings and errors." << std::endl;
+    std::cerr << "  -k, --cache        Use the parsed patch cache." << std::endl;
+    std::cerr << "  --cache-dir <dir>  Parsed patch cache directory (implies --cache)." << std::endl;
+    std::cerr << "  --stats            Print per-phase timings and I/O counters as JSON." << std::endl;
+    std::cerr << "  --fused            Copy the source and apply the records in a single pass." << std::endl;
+    std::cerr << "  --parse-threads <n> Parse patches larger than 32MB on n threads (0: one per core)." << std::endl;
+    std::cerr << "  --memory <MB>      Maximum size of the files mapped at once (default 64)." << std::endl;
+    std::cerr << "  --io <backend>     Source copy backend: auto, stdio, read, mmap, direct or copy-range." << std::endl;
+}
+
+/**
+ * Validate patches and print a report for each one.
+ */
+int validate(int count, char** filenames)
+{
+    IPS::IO io;
+    // Failures are printed from the report.
+    io.setLogging(false);
+    int ret = 0;
+    for(int i=0; i<count; i++)
+    {
+        IPS::Validation report;
+        if(io.validate(filenames[i], report))
+        {
+            std::cout << filenames[i] << ": ok records=" << report.records
+                      << " rle=" << report.rleRecords
+                      << " max_output_size=" << report.maxOutputSize;
+            if(IPS::Patch::NoTruncation != report.truncation)
+            {
+                std::cout << " truncation=" << report.truncation;
+            }
+            std::cout << std::endl;
+        }
+        else
+        {
+            std::cout << filenames[i] << ": error=" << report.result
+                      << " offset=" << report.errorOffset;
+            if(IPS::Status::NoRecord != report.errorRecord)
+            {
+                std::cout << " record=" << report.errorRecord;
+            }
+            std::cout << " (" << IPS::Status(report.result).message() << ")" << std::endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Minimize a patch against its source.
+ */
+int minimize(const char* sourceFilename, const char* patchFilename, const char* destFilename, size_t memoryBudget)
+{
+    IPS::IO io;
+    IPS::Patch patch;
+    if(false == io.read(patchFilename, patch))
+    {
+        Error("Failed to read %s", patchFilename);
+        return 1;
+    }
+    return IPS::minimize(sourceFilename, patch, destFilename, memoryBudget) ? 0 : 1;
+}
+
+/**
+ * Make a path absolute as the daemon does not share our working directory.
+ */
+std::string absolutePath(const char* path)
+{
+    if('/' == path[0])
+    {
+        return path;
+    }
+    char cwd[4096];
+    if(nullptr == getcwd(cwd, sizeof(cwd)))
+    {
+        return path;
+    }
+    return std::string(cwd) + "/" + path;
+}
+
+/**
+ * Forward requests to the patch daemon.
+ * @param [in] socketPath Daemon socket.
+ * @param [in] command    Request command.
+ * @param [in] count      Number of filenames.
+ * @param [in] filenames  Request filenames.
+ * @param [in] extra      Extra argument (empty if none).
+ * @param [in] batch      Send one request per filename.
+ */
+int forward(const char* socketPath, const char* command, int count, char** filenames, std::string const& extra, bool batch)
+{
+    int fd = IPS::connect(socketPath);
+    if(fd < 0)
+    {
+        return 1;
+    }
+    int ret = 0;
+    int step = batch ? 1 : count;
+    for(int i=0; i<count; i+=step)
+    {
+        IPS::Request request;
+        request.command = command;
+        for(int j=0; j<step; j++)
+        {
+            request.args.push_back(absolutePath(filenames[i+j]));
+        }
+        if(false == extra.empty())
+        {
+            request.args.push_back(extra);
+        }
+        IPS::Result result;
+        if((false == IPS::writeRequest(fd, request)) || (false == IPS::readResponse(fd, result)))
+        {
+            Error("Lost connection to %s", socketPath);
+            ret = 1;
+            break;
+        }
+        if(IPS::IPS_OK != result)
+        {
+            Error("%s %s failed: %d", command, filenames[i], result);
+            ret = 1;
+        }
+        else if(batch)
+        {
+            std::cout << filenames[i] << ": ok" << std::endl;
+        }
+    }
+    close(fd);
+    return ret;
 }
 
 /**
@@ -34,34 +181,204 @@ void usage()
  */
 int main(int argc, char** argv)
 {
-    if(argc < 3)
+    static const struct option longOptions[] =
+    {
+        { "crc",      required_argument, nullptr, 'c' },
+        { "validate", no_argument,       nullptr, 'v' },
+        { "diff",     no_argument,       nullptr, 'd' },
+        { "minimize", no_argument,       nullptr, 'm' },
+        { "socket",   required_argument, nullptr, 's' },
+        { "quiet",    no_argument,       nullptr, 'q' },
+        { "cache",    no_argument,       nullptr, 'k' },
+        { "cache-dir",required_argument, nullptr, 'K' },
+        { "stats",    no_argument,       nullptr, 'S' },
+        { "fused",    no_argument,       nullptr, 'F' },
+        { "parse-threads", required_argument, nullptr, 'P' },
+        { "memory",   required_argument, nullptr, 'M' },
+        { "io",       required_argument, nullptr, 'I' },
+        { "help",     no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    bool checkCrc = false;
+    bool validateOnly = false;
+    bool diffOnly = false;
+    bool minimizeOnly = false;
+    const char *socketPath = nullptr;
+    bool useCache = false;
+    bool printStats = false;
+    bool fused = false;
+    unsigned int parseThreads = 1;
+    size_t memoryBudget = IPS::MappedWindow::DefaultBudget;
+    IPS::Backend::Value backend = IPS::Backend::Auto;
+    std::string cacheDirectory = IPS::Cache::defaultDirectory();
+    uint32_t expectedCrc = 0;
+    int c;
+    while(-1 != (c = getopt_long(argc, argv, "c:vdms:qkh", longOptions, nullptr)))
+    {
+        switch(c)
+        {
+            case 'c':
+            {
+                char *end;
+                expectedCrc = static_cast<uint32_t>(strtoul(optarg, &end, 16));
+                if((end == optarg) || (*end != '\0'))
+                {
+                    std::cerr << "invalid CRC32: " << optarg << std::endl;
+                    return 1;
+                }
+                checkCrc = true;
+                break;
+            }
+            case 'v':
+                validateOnly = true;
+                break;
+            case 'd':
+                diffOnly = true;
+                break;
+            case 'm':
+                minimizeOnly = true;
+                break;
+            case 's':
+                socketPath = optarg;
+                break;
+            case 'q':
+                Log::Logger::instance().setLevel(Log::Type::Warning);
+                break;
+            case 'K':
+                cacheDirectory = optarg;
+                // fall through
+            case 'k':
+                useCache = true;
+                break;
+            case 'S':
+                printStats = true;
+                break;
+            case 'F':
+                fused = true;
+                break;
+            case 'P':
+                parseThreads = static_cast<unsigned int>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'M':
+                memoryBudget = strtoul(optarg, nullptr, 10) * 1024 * 1024;
+                if(0 == memoryBudget)
+                {
+                    std::cerr << "invalid memory budget: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'I':
+                if(false == IPS::Backend::parse(optarg, backend))
+                {
+                    std::cerr << "invalid I/O backend: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 0;
+        }
+    }
+
+    int count = argc - optind;
+    if((validateOnly && (count < 1)) || (!validateOnly && (count < 3)))
     {
         usage();
         return 0;
     }
 
+    if(printStats)
+    {
+        IPS::Stats::instance().enable();
+    }
+
+    if(validateOnly || diffOnly || minimizeOnly || (nullptr != socketPath))
+    {
+        Log::Logger& logger = Log::Logger::instance();
+        Log::Output output;
+        logger.begin(&output);
+        int ret;
+        if(nullptr != socketPath)
+        {
+            char crc[16];
+            snprintf(crc, sizeof(crc), "%08x", expectedCrc);
+            if(validateOnly)
+            {
+                ret = forward(socketPath, "validate", count, argv + optind, "", true);
+            }
+            else
+            {
+                const char *command = diffOnly ? "diff" : (minimizeOnly ? "minimize" : "apply");
+                ret = forward(socketPath, command, 3, argv + optind, (checkCrc && !diffOnly && !minimizeOnly) ? crc : "", false);
+            }
+        }
+        else if(validateOnly)
+        {
+            ret = validate(count, argv + optind);
+        }
+        else if(minimizeOnly)
+        {
+            ret = minimize(argv[optind], argv[optind+1], argv[optind+2], memoryBudget);
+        }
+        else
+        {
+            ret = IPS::diff(argv[optind], argv[optind+1], argv[optind+2], memoryBudget) ? 0 : 1;
+        }
+        logger.end();
+        if(printStats)
+        {
+            IPS::Stats::instance().print(stdout);
+        }
+        return ret;
+    }
+    const char *sourceFilename = argv[optind];
+    const char *patchFilename  = argv[optind+1];
+    const char *destFilename   = argv[optind+2];
+
     Log::Logger& logger = Log::Logger::instance();
     Log::Output* output = new Log::Output();
     
     IPS::Patch  patch;
     IPS::IO     io;
+    IPS::Cache  cache;
     bool ret;
     
-    logger.begin(output);
+    logger.beginAsync(output, 4096, Log::Policy::Block);
+    io.setParallelParse(parseThreads);
     
-    ret = io.read(argv[2], patch);
+    if(useCache && cache.setDirectory(cacheDirectory))
+    {
+        ret = io.map(patchFilename, patch, &cache);
+    }
+    else
+    {
+        ret = io.read(patchFilename, patch);
+    }
     if(false == ret)
     {
-        Error("Failed to read %s", argv[2]);
+        Error("Failed to read %s", patchFilename);
     }
     else
     {
-        apply(argv[1], argv[3], patch, true);
+        IPS::ApplyOptions options;
+        options.verbose = true;
+        options.checkCrc = checkCrc;
+        options.expectedCrc = expectedCrc;
+        options.fused = fused;
+        options.memoryBudget = memoryBudget;
+        options.backend = backend;
+        ret = apply(sourceFilename, destFilename, patch, options);
     }
     
     logger.end();
 
-    free(output);
+    delete output;
+
+    if(printStats)
+    {
+        IPS::Stats::instance().print(stdout);
+    }
 
-    return 0;
+    return ret ? 0 : 1;
 }
@@ -0,0 +1,606 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "log.h"
+#include "ips.h"
+#include "io.h"
+#include "mapping.h"
+#include "protocol.h"
+#include "utils.h"
+
+/**
+ * Print usage.
+ */
+void usage()
+{
+    std::cerr << "usage: ips-patcherd [options] socket" << std::endl;
+    std::cerr << "       Serve apply/validate/diff requests on a Unix domain socket." << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -j, --jobs <n>     Number of worker threads." << std::endl;
+    std::cerr << "  -n, --entries <n>  Number of cached patches." << std::endl;
+    std::cerr << "  -m, --memory <MB>  Maximum size of the files mapped at once by a diff or a minimization." << std::endl;
+}
+
+/**
+ * Identifies a file version (path, size, modification time and inode).
+ */
+struct FileKey
+{
+    std::string path;
+    off_t  size;
+    time_t mtime;
+    long   mtimeNsec;
+    ino_t  inode;
+
+    bool operator== (FileKey const& other) const
+    {
+        return (path == other.path) && (size == other.size) &&
+               (mtime == other.mtime) && (mtimeNsec == other.mtimeNsec) &&
+               (inode == other.inode);
+    }
+};
+
+struct FileKeyHash
+{
+    size_t operator() (FileKey const& key) const
+    {
+        return std::hash<std::string>()(key.path) ^ (static_cast<size_t>(key.mtime) * 31) ^ static_cast<size_t>(key.size);
+    }
+};
+
+/**
+ * Stat a file and build its key.
+ */
+static bool fileKey(std::string const& path, FileKey& key)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) < 0)
+    {
+        Error("Failed to stat %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    key.path      = path;
+    key.size      = st.st_size;
+    key.mtime     = st.st_mtim.tv_sec;
+    key.mtimeNsec = st.st_mtim.tv_nsec;
+    key.inode     = st.st_ino;
+    return true;
+}
+
+/**
+ * Thread safe least recently used cache.
+ * Values are shared so that an evicted entry stays alive as long as a
+ * request is using it.
+ */
+template <typename T>
+class LRUCache
+{
+    public:
+        typedef std::shared_ptr<T> Value;
+
+        LRUCache(size_t capacity)
+            : _capacity(capacity)
+        {}
+
+        Value get(FileKey const& key)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            typename Map::iterator it = _map.find(key);
+            if(it == _map.end())
+            {
+                return Value();
+            }
+            _list.splice(_list.begin(), _list, it->second);
+            return it->second->second;
+        }
+
+        void put(FileKey const& key, Value value)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            typename Map::iterator it = _map.find(key);
+            if(it != _map.end())
+            {
+                _list.erase(it->second);
+                _map.erase(it);
+            }
+            _list.push_front(std::make_pair(key, value));
+            _map[key] = _list.begin();
+            while(_map.size() > _capacity)
+            {
+                _map.erase(_list.back().first);
+                _list.pop_back();
+            }
+        }
+
+    private:
+        typedef std::list<std::pair<FileKey, Value>> List;
+        typedef std::unordered_map<FileKey, typename List::iterator, FileKeyHash> Map;
+        size_t _capacity;
+        std::mutex _mutex;
+        List _list;
+        Map _map;
+};
+
+/**
+ * Cached patch. The records are decoded once, when the patch is mapped,
+ * and point to the mapping.
+ */
+struct PatchEntry
+{
+    IPS::MappedFile file;
+    /** Decoded records. **/
+    IPS::Patch patch;
+    /** Decoding status. **/
+    IPS::Status status;
+};
+
+/**
+ * Patch server.
+ * Idle connections are polled by the main thread. A connection with a
+ * pending request is queued, a worker serves that single request and
+ * hands the connection back to the main thread.
+ */
+class Server
+{
+    public:
+        /** Maximum time spent waiting for the rest of a request, in seconds. **/
+        static const int RequestTimeout = 10;
+
+        Server(size_t entries, size_t memoryBudget)
+            : _patches(entries)
+            , _memoryBudget(memoryBudget)
+            , _stop(false)
+        {
+            _wake[0] = _wake[1] = -1;
+        }
+
+        ~Server()
+        {
+            for(int i=0; i<2; i++)
+            {
+                if(_wake[i] >= 0)
+                {
+                    close(_wake[i]);
+                }
+            }
+        }
+
+        /**
+         * Create the pipe used to hand connections back to the main thread.
+         * @return @b false on error.
+         */
+        bool open()
+        {
+            return (0 == pipe2(_wake, O_CLOEXEC | O_NONBLOCK));
+        }
+
+        /** File descriptor readable when connections are handed back. **/
+        int wakeFd() const
+        {
+            return _wake[0];
+        }
+
+        /** Worker thread main loop. **/
+        void work()
+        {
+            for(;;)
+            {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _condition.wait(lock, [this] { return _stop || !_pending.empty(); });
+                    if(_stop)
+                    {
+                        return;
+                    }
+                    fd = _pending.front();
+                    _pending.pop_front();
+                    _active.insert(fd);
+                }
+                bool keep = serve(fd);
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _active.erase(fd);
+                    if(keep && !_stop)
+                    {
+                        _idle.push_back(fd);
+                        char byte = 0;
+                        if(write(_wake[1], &byte, 1) < 0)
+                        {
+                            // The pipe is full, the main thread is already woken up.
+                        }
+                        continue;
+                    }
+                }
+                close(fd);
+            }
+        }
+
+        /** Queue a connection with a pending request. **/
+        void push(int fd)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(fd);
+            _condition.notify_one();
+        }
+
+        /** Move the connections handed back by the workers to @b connections. **/
+        void reclaim(std::vector<int>& connections)
+        {
+            char buffer[64];
+            while(read(_wake[0], buffer, sizeof(buffer)) > 0)
+            {}
+            std::lock_guard<std::mutex> lock(_mutex);
+            connections.insert(connections.end(), _idle.begin(), _idle.end());
+            _idle.clear();
+        }
+
+        /** Stop workers and shut active connections down. **/
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+            for(std::set<int>::iterator it=_active.begin(); it!=_active.end(); ++it)
+            {
+                shutdown(*it, SHUT_RDWR);
+            }
+            for(std::list<int>::iterator it=_pending.begin(); it!=_pending.end(); ++it)
+            {
+                close(*it);
+            }
+            _pending.clear();
+            for(size_t i=0; i<_idle.size(); i++)
+            {
+                close(_idle[i]);
+            }
+            _idle.clear();
+            _condition.notify_all();
+        }
+
+    private:
+        /**
+         * Serve a single request.
+         * @return @b false if the client disconnected or the connection failed.
+         */
+        bool serve(int fd)
+        {
+            IPS::Request request;
+            if(false == IPS::readRequest(fd, request))
+            {
+                return false;
+            }
+            IPS::Result result = process(request);
+            return IPS::writeResponse(fd, result);
+        }
+
+        /** Get patch from cache or map and decode it. **/
+        LRUCache<PatchEntry>::Value patch(std::string const& filename)
+        {
+            FileKey key;
+            if(false == fileKey(filename, key))
+            {
+                return LRUCache<PatchEntry>::Value();
+            }
+            LRUCache<PatchEntry>::Value entry = _patches.get(key);
+            if(entry)
+            {
+                return entry;
+            }
+            entry = std::make_shared<PatchEntry>();
+            if(false == entry->file.open(filename))
+            {
+                return LRUCache<PatchEntry>::Value();
+            }
+            IPS::IO io;
+            entry->status = io.parse(entry->file.data(), entry->file.size(), entry->patch);
+            _patches.put(key, entry);
+            return entry;
+        }
+
+        /** Process a single request. **/
+        IPS::Result process(IPS::Request const& request)
+        {
+            std::vector<std::string> const& args = request.args;
+            if(("apply" == request.command) && ((3 == args.size()) || (4 == args.size())))
+            {
+                LRUCache<PatchEntry>::Value p = patch(args[1]);
+                if(!p)
+                {
+                    return IPS::IPS_ERROR_READ;
+                }
+                if(!p->status)
+                {
+                    return p->status.result;
+                }
+                // The source is copied through bounded buffers rather than
+                // kept mapped, the page cache serves repeated requests.
+                IPS::ApplyOptions options;
+                if(4 == args.size())
+                {
+                    options.checkCrc = true;
+                    options.expectedCrc = static_cast<uint32_t>(strtoul(args[3].c_str(), nullptr, 16));
+                }
+                IPS::Status status = IPS::apply(args[0].c_str(), args[2].c_str(), p->patch, options);
+                return status.result;
+            }
+            else if(("validate" == request.command) && (1 == args.size()))
+            {
+                IPS::IO io;
+                IPS::Validation report;
+                io.validate(args[0], report);
+                return report.result;
+            }
+            else if(("diff" == request.command) && (3 == args.size()))
+            {
+                if((0 != access(args[0].c_str(), R_OK)) || (0 != access(args[1].c_str(), R_OK)))
+                {
+                    return IPS::IPS_ERROR_OPEN;
+                }
+                return IPS::diff(args[0].c_str(), args[1].c_str(), args[2].c_str(), _memoryBudget) ? IPS::IPS_OK : IPS::IPS_ERROR_PROCESS;
+            }
+            else if(("minimize" == request.command) && (3 == args.size()))
+            {
+                if(0 != access(args[0].c_str(), R_OK))
+                {
+                    return IPS::IPS_ERROR_OPEN;
+                }
+                LRUCache<PatchEntry>::Value p = patch(args[1]);
+                if(!p)
+                {
+                    return IPS::IPS_ERROR_READ;
+                }
+                if(!p->status)
+                {
+                    return p->status.result;
+                }
+                return IPS::minimize(args[0].c_str(), p->patch, args[2].c_str(), _memoryBudget) ? IPS::IPS_OK : IPS::IPS_ERROR_PROCESS;
+            }
+            Error("Invalid request: %s", request.command.c_str());
+            return IPS::IPS_ERROR;
+        }
+
+    private:
+        LRUCache<PatchEntry>  _patches;
+        /** Maximum size of the files mapped at once by a diff or a minimization. **/
+        size_t _memoryBudget;
+        std::mutex _mutex;
+        std::condition_variable _condition;
+        std::list<int> _pending;
+        std::set<int> _active;
+        /** Connections handed back to the main thread. **/
+        std::vector<int> _idle;
+        /** Pipe waking the main thread up. **/
+        int _wake[2];
+        bool _stop;
+};
+
+static volatile sig_atomic_t g_quit = 0;
+
+static void onSignal(int)
+{
+    g_quit = 1;
+}
+
+/**
+ * Main entry point.
+ */
+int main(int argc, char** argv)
+{
+    static const struct option longOptions[] =
+    {
+        { "jobs",    required_argument, nullptr, 'j' },
+        { "entries", required_argument, nullptr, 'n' },
+        { "memory",  required_argument, nullptr, 'm' },
+        { "help",    no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    size_t jobs = std::thread::hardware_concurrency();
+    size_t entries = 64;
+    size_t memoryBudget = IPS::MappedWindow::DefaultBudget;
+    int c;
+    while(-1 != (c = getopt_long(argc, argv, "j:n:m:h", longOptions, nullptr)))
+    {
+        switch(c)
+        {
+            case 'j':
+                jobs = strtoul(optarg, nullptr, 10);
+                break;
+            case 'n':
+                entries = strtoul(optarg, nullptr, 10);
+                break;
+            case 'm':
+                memoryBudget = strtoul(optarg, nullptr, 10) * 1024 * 1024;
+                break;
+            default:
+                usage();
+                return 0;
+        }
+    }
+    if(optind >= argc)
+    {
+        usage();
+        return 0;
+    }
+    if(0 == jobs)
+    {
+        jobs = 1;
+    }
+    if(0 == entries)
+    {
+        entries = 1;
+    }
+    const char *socketPath = argv[optind];
+
+    Log::Logger& logger = Log::Logger::instance();
+    Log::Output output;
+    logger.beginAsync(&output, 4096, Log::Policy::Drop);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        Error("Socket path is too long: %s", socketPath);
+        logger.end();
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0)
+    {
+        Error("Failed to create socket: %s", strerror(errno));
+        logger.end();
+        return 1;
+    }
+    unlink(socketPath);
+    if((bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) ||
+       (listen(listenFd, 128) < 0))
+    {
+        Error("Failed to listen on %s: %s", socketPath, strerror(errno));
+        close(listenFd);
+        logger.end();
+        return 1;
+    }
+
+    // No SA_RESTART so that poll() is interrupted.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT,  &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(0 == memoryBudget)
+    {
+        memoryBudget = IPS::MappedWindow::DefaultBudget;
+    }
+    Server server(entries, memoryBudget);
+    if(false == server.open())
+    {
+        Error("Failed to create pipe: %s", strerror(errno));
+        close(listenFd);
+        logger.end();
+        return 1;
+    }
+    std::vector<std::thread> workers;
+    for(size_t i=0; i<jobs; i++)
+    {
+        workers.push_back(std::thread(&Server::work, &server));
+    }
+
+    Info("Listening on %s with %zu workers", socketPath, jobs);
+    // Idle connections, waiting for their next request.
+    std::vector<int> connections;
+    std::vector<struct pollfd> fds;
+    while(!g_quit)
+    {
+        fds.resize(2 + connections.size());
+        fds[0].fd = listenFd;
+        fds[1].fd = server.wakeFd();
+        for(size_t i=0; i<connections.size(); i++)
+        {
+            fds[2+i].fd = connections[i];
+        }
+        for(size_t i=0; i<fds.size(); i++)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if(poll(&fds[0], fds.size(), -1) < 0)
+        {
+            if(EINTR != errno)
+            {
+                Error("Failed to poll connections: %s", strerror(errno));
+            }
+            continue;
+        }
+        // Connections with a pending request (or closed by the client) are
+        // handed to the workers.
+        size_t j = 0;
+        for(size_t i=0; i<connections.size(); i++)
+        {
+            if(fds[2+i].revents)
+            {
+                server.push(connections[i]);
+            }
+            else
+            {
+                connections[j++] = connections[i];
+            }
+        }
+        connections.resize(j);
+        if(fds[1].revents)
+        {
+            server.reclaim(connections);
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if(fd < 0)
+            {
+                if(EINTR != errno)
+                {
+                    Error("Failed to accept connection: %s", strerror(errno));
+                }
+                continue;
+            }
+            // A client stalling in the middle of a request does not hold
+            // a worker for long.
+            struct timeval timeout;
+            timeout.tv_sec = Server::RequestTimeout;
+            timeout.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            connections.push_back(fd);
+        }
+    }
+
+    server.stop();
+    for(size_t i=0; i<workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    for(size_t i=0; i<connections.size(); i++)
+    {
+        close(connections[i]);
+    }
+    close(listenFd);
+    unlink(socketPath);
+
+    logger.end();
+    return 0;
+}
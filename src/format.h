@@ -0,0 +1,138 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_FORMAT_H_
+#define _IPS_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "ips.h"
+
+namespace IPS {
+/**
+ * Patch format variants.
+ */
+struct Format
+{
+    /** Format values. **/
+    enum Value
+    {
+        IPS = 0,    /**< "PATCH" header, 24 bits offsets, "EOF" footer. **/
+        IPS32,      /**< "IPS32" header, 32 bits offsets, "EEOF" footer. **/
+        Count
+    };
+    /**
+     * Format name.
+     */
+    static const char* name(Value v);
+    /**
+     * Find the format of a patch from its header.
+     * @param [in]  data   Patch data.
+     * @param [in]  size   Patch size.
+     * @param [out] format Patch format.
+     * @return @b false if the header is not recognized.
+     */
+    static bool detect(const uint8_t* data, size_t size, Value& format);
+};
+
+/**
+ * Format layout, specialized for each variant.
+ */
+template<Format::Value F> struct FormatTraits;
+
+template<> struct FormatTraits<Format::IPS>
+{
+    static const size_t HeaderSize = 5;
+    static const size_t FooterSize = 3;
+    /** Size of a record offset. **/
+    static const size_t OffsetSize = 3;
+    /** Size of the optional truncation size following the footer. **/
+    static const size_t TrailerSize = 3;
+    static const char* header() { return "PATCH"; }
+    static const char* footer() { return "EOF"; }
+};
+
+template<> struct FormatTraits<Format::IPS32>
+{
+    static const size_t HeaderSize = 5;
+    static const size_t FooterSize = 4;
+    /** Size of a record offset. **/
+    static const size_t OffsetSize = 4;
+    /** Size of the optional truncation size following the footer. **/
+    static const size_t TrailerSize = 4;
+    static const char* header() { return "IPS32"; }
+    static const char* footer() { return "EEOF"; }
+};
+
+/**
+ * Load a big endian value of a fixed width.
+ * @param [in] data Data.
+ */
+template<size_t N> inline uint32_t loadBigEndian(const uint8_t* data)
+{
+    return (loadBigEndian<N-1>(data) << 8) | data[N-1];
+}
+template<> inline uint32_t loadBigEndian<1>(const uint8_t* data)
+{
+    return data[0];
+}
+
+/**
+ * Decode a record.
+ * @param [in]  data      Record data.
+ * @param [in]  available Number of bytes left before the footer.
+ * @param [out] record    IPS record. Record data points to @b data.
+ * @return Record size in the patch, or 0 if the record is truncated.
+ */
+template<Format::Value F> inline size_t decodeRecord(const uint8_t* data, size_t available, Record& record)
+{
+    static const size_t head = FormatTraits<F>::OffsetSize + 2;
+    if(available < head)
+    {
+        return 0;
+    }
+    record.offset = loadBigEndian<FormatTraits<F>::OffsetSize>(data);
+    record.size = static_cast<uint16_t>(loadBigEndian<2>(data + FormatTraits<F>::OffsetSize));
+    if(record.size)
+    {
+        record.rle = false;
+        record.data = reinterpret_cast<uintptr_t>(data + head);
+        return ((available - head) >= record.size) ? (head + record.size) : 0;
+    }
+    // RLE record: 16 bits repeat count and the repeated byte.
+    if(available < (head + 3))
+    {
+        return 0;
+    }
+    record.rle = true;
+    record.size = static_cast<uint16_t>(loadBigEndian<2>(data + head));
+    record.data = static_cast<uintptr_t>(data[head + 2]);
+    return head + 3;
+}
+
+/**
+ * Check if the bytes at a record offset read as the footer.
+ * @param [in] data      Record data.
+ * @param [in] available Number of bytes left before the footer.
+ */
+template<Format::Value F> inline bool footerCollision(const uint8_t* data, size_t available)
+{
+    return (available >= FormatTraits<F>::FooterSize) && (0 == memcmp(data, FormatTraits<F>::footer(), FormatTraits<F>::FooterSize));
+}
+
+} // namespace IPS
+
+#endif /* _IPS_FORMAT_H_ */
@@ -1,84 +1,195 @@
 #include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <gtk/gtk.h>
 #include "log.h"
+#include "async.h"
 #include "ips.h"
 #include "io.h"
 #include "utils.h"
 
 #include "gui.inl"
 
+/**
+ * Log view.
+ * Messages are queued in a ring buffer from any thread and appended to a
+ * list store in batches by a main loop timer. The tree view only renders
+ * the visible rows.
+ */
 class GUILogOutput : public Log::Output
 {
     public:
         GUILogOutput();
         virtual ~GUILogOutput();
         virtual void out(Log::Type type, const char* format, va_list args);
-        void attach(GtkScrolledWindow *scrolledWindow, GtkBox *box);
+        void attach(GtkTreeView *view);
     private:
-        GtkBox *_box;
-        GtkScrolledWindow *_scrolledWindow;
+        static gboolean flush(gpointer userData);
+    private:
+        /** Number of messages waiting to be displayed. **/
+        static const size_t RingSize = 4096;
+        /** Maximum number of rows kept in the view. **/
+        static const size_t MaxRows = 10000;
+        /** Delay in ms between two view updates. **/
+        static const guint FlushInterval = 100;
+        /** Queued message. **/
+        struct Message
+        {
+            Log::Type type;
+            char      text[256];
+        };
+        std::mutex            _mutex;
+        std::vector<Message>  _ring;
+        size_t                _head;
+        size_t                _count;
+        size_t                _dropped;
+        GtkTreeView          *_view;
+        GtkListStore         *_store;
+        size_t                _rows;
+        guint                 _timer;
+};
+
+enum LogColumn
+{
+    LOG_COLUMN_ICON = 0,
+    LOG_COLUMN_TEXT,
+    LOG_COLUMN_COUNT
 };
 
 GUILogOutput::GUILogOutput()
     : Log::Output()
-    , _box(nullptr)
-    , _scrolledWindow(nullptr)
+    , _mutex()
+    , _ring(RingSize)
+    , _head(0)
+    , _count(0)
+    , _dropped(0)
+    , _view(nullptr)
+    , _store(nullptr)
+    , _rows(0)
+    , _timer(0)
 {}
 GUILogOutput::~GUILogOutput()
-{}
-void GUILogOutput::attach(GtkScrolledWindow *scrolledWindow, GtkBox *box)
 {
-    _scrolledWindow = scrolledWindow;
-    _box = box;
+    if(nullptr != _store)
+    {
+        g_object_unref(_store);
+    }
+}
+void GUILogOutput::attach(GtkTreeView *view)
+{
+    _view  = view;
+    _store = gtk_list_store_new(LOG_COLUMN_COUNT, G_TYPE_STRING, G_TYPE_STRING);
+    
+    gtk_tree_view_insert_column_with_attributes(_view, -1, nullptr, gtk_cell_renderer_pixbuf_new(), "icon-name", LOG_COLUMN_ICON, NULL);
+    gtk_tree_view_insert_column_with_attributes(_view, -1, nullptr, gtk_cell_renderer_text_new(), "text", LOG_COLUMN_TEXT, NULL);
+    // Rows all have the same height, so only the visible ones are measured.
+    gtk_tree_view_column_set_sizing(gtk_tree_view_get_column(_view, LOG_COLUMN_ICON), GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_sizing(gtk_tree_view_get_column(_view, LOG_COLUMN_TEXT), GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_set_fixed_height_mode(_view, TRUE);
+    gtk_tree_view_set_model(_view, GTK_TREE_MODEL(_store));
+    
+    _timer = g_timeout_add(FlushInterval, GUILogOutput::flush, this);
 }
+/**
+ * Queue a log message. This may be called from any thread.
+ */
 void GUILogOutput::out(Log::Type type, const char* format, va_list args)
 {
-    if(nullptr == _box)
+    if(nullptr == _view)
     {
         return;
     }
     
-    GtkWidget *entry;
-    char const* iconName = "gtk-apply";
-    
-    switch(type)
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(RingSize == _count)
     {
-        case Log::Type::Error:
-            iconName = "gtk-dialog-error";
-            break;
-        case Log::Type::Warning:
-            iconName = "gtk-dialog-warning";
-            break;
-        case Log::Type::Info:
-            iconName = "gtk-dialog-info";
-            break;
+        // Drop the oldest message.
+        _head = (_head + 1) % RingSize;
+        _count--;
+        _dropped++;
     }
+    Message& message = _ring[(_head + _count) % RingSize];
+    message.type = type;
+    vsnprintf(message.text, sizeof(message.text), format, args);
+    _count++;
+}
+/**
+ * Append queued messages to the view (main loop timer).
+ */
+gboolean GUILogOutput::flush(gpointer userData)
+{
+    GUILogOutput *output = static_cast<GUILogOutput*>(userData);
+    GtkTreeIter iter;
+    size_t appended = 0;
     
-    char *buffer = (char*)malloc(256);
-    vsnprintf(buffer, 256, format, args);
-    
-    GtkWidget *image = gtk_image_new_from_stock(iconName, GTK_ICON_SIZE_MENU);
-    GtkWidget *label = gtk_label_new ( buffer );
-    
-    entry = gtk_box_new ( GTK_ORIENTATION_HORIZONTAL, 0 );
-    gtk_widget_set_visible( entry, TRUE );
-    gtk_widget_set_can_focus( entry, FALSE );
-
-    gtk_box_pack_start ( GTK_BOX( entry ), image, FALSE, TRUE, 0 );
-    gtk_box_pack_start ( GTK_BOX( entry ), label, FALSE, TRUE, 2 );
-                         
-    gtk_widget_show(image);
-    gtk_widget_show(label);
-    gtk_widget_show(entry);
-    
-    gtk_box_pack_end ( _box, entry, FALSE, TRUE, 0 );
+    std::lock_guard<std::mutex> lock(output->_mutex);
+    if(output->_dropped)
+    {
+        gchar *text = g_strdup_printf("(%zu messages dropped)", output->_dropped);
+        gtk_list_store_append(output->_store, &iter);
+        gtk_list_store_set(output->_store, &iter, LOG_COLUMN_ICON, "dialog-warning", LOG_COLUMN_TEXT, text, -1);
+        g_free(text);
+        output->_dropped = 0;
+        appended++;
+    }
+    for(; output->_count; output->_count--)
+    {
+        Message const& message = output->_ring[output->_head];
+        char const* iconName = "dialog-information";
+        switch(message.type)
+        {
+            case Log::Type::Error:
+                iconName = "dialog-error";
+                break;
+            case Log::Type::Warning:
+                iconName = "dialog-warning";
+                break;
+            case Log::Type::Info:
+                iconName = "dialog-information";
+                break;
+        }
+        gtk_list_store_append(output->_store, &iter);
+        gtk_list_store_set(output->_store, &iter, LOG_COLUMN_ICON, iconName, LOG_COLUMN_TEXT, message.text, -1);
+        output->_head = (output->_head + 1) % RingSize;
+        appended++;
+    }
     
-    if(nullptr != _scrolledWindow)
+    if(appended)
     {
-        gtk_scrolled_window_set_placement( _scrolledWindow,  GTK_CORNER_BOTTOM_LEFT );
+        output->_rows += appended;
+        while(output->_rows > MaxRows)
+        {
+            GtkTreeIter first;
+            if(!gtk_tree_model_get_iter_first(GTK_TREE_MODEL(output->_store), &first))
+            {
+                break;
+            }
+            gtk_list_store_remove(output->_store, &first);
+            output->_rows--;
+        }
+        // Follow the last message.
+        GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(output->_store), &iter);
+        gtk_tree_view_scroll_to_cell(output->_view, path, nullptr, FALSE, 0.0f, 0.0f);
+        gtk_tree_path_free(path);
     }
+    return G_SOURCE_CONTINUE;
 }
 
+/** Delay in ms between two checks of the running patch job. **/
+static const guint ApplyPollInterval = 50;
+
+/**
+ * Patch job. The patch is parsed and applied by an ApplyJob, which is
+ * polled from a main loop timer.
+ */
+struct ApplyTask
+{
+    std::string    outputFilename;
+    IPS::ApplyJob  job;
+    bool           cancelled;
+};
+
 struct AppConfig
 {
     GtkFileChooser *inputFileChooser;
@@ -86,13 +197,77 @@ struct AppConfig
     GtkBox         *outputFileBox;
     GtkFileChooser *outputFileChooser;
     GtkEntry       *outputFileEntry;
+    GtkButton      *applyButton;
+    GtkProgressBar *progressBar;
+    ApplyTask      *task;
 };
 
+/**
+ * Progress update sent from the worker thread.
+ */
+struct ProgressUpdate
+{
+    AppConfig    *app;
+    IPS::Progress progress;
+};
+
+static gboolean onApplyProgress(gpointer userData)
+{
+    ProgressUpdate *update = static_cast<ProgressUpdate*>(userData);
+    IPS::Progress const& progress = update->progress;
+    
+    gdouble fraction = progress.totalBytes ? (gdouble)progress.bytes / (gdouble)progress.totalBytes : 1.0;
+    gchar *text = g_strdup_printf("%zu / %zu records", progress.records, progress.totalRecords);
+    gtk_progress_bar_set_fraction(update->app->progressBar, fraction);
+    gtk_progress_bar_set_text(update->app->progressBar, text);
+    g_free(text);
+    
+    delete update;
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Main loop timer: wait for the patch job to finish.
+ */
+static gboolean onApplyPoll(gpointer userData)
+{
+    AppConfig *app = static_cast<AppConfig*>(userData);
+    ApplyTask *task = app->task;
+    
+    if(false == task->job.finished())
+    {
+        return G_SOURCE_CONTINUE;
+    }
+    IPS::Status status = task->job.wait();
+    if(status)
+    {
+        Info("Patch applied to %s", task->outputFilename.c_str());
+    }
+    else if(task->cancelled)
+    {
+        gtk_progress_bar_set_fraction(app->progressBar, 0.0);
+        gtk_progress_bar_set_text(app->progressBar, "Cancelled");
+    }
+    
+    delete task;
+    app->task = nullptr;
+    gtk_button_set_label(app->applyButton, "gtk-apply");
+    return G_SOURCE_REMOVE;
+}
+
 static void onApplyButtonClicked (GtkWidget*, gpointer userData)
 {
     AppConfig *app = (AppConfig*)userData;
     bool ok = true;
     
+    // The button turns into a cancel button while a patch is applied.
+    if(nullptr != app->task)
+    {
+        app->task->cancelled = true;
+        app->task->job.cancel();
+        return;
+    }
+    
     gchar* inputFilename  = gtk_file_chooser_get_filename (app->inputFileChooser);
     gchar* patchFilename  = gtk_file_chooser_get_filename (app->patchFileChooser);
     const gchar* outputFilename = gtk_entry_get_text (app->outputFileEntry);
@@ -112,19 +287,32 @@ static void onApplyButtonClicked (GtkWidget*, gpointer userData)
         Error("Missing IPS patch filename.");
         ok = false;
     }
-    if(false == ok)
+    if(ok)
     {
-        return;
-    }
-    
-    IPS::Patch  patch;
-    IPS::IO     io;
-    bool ret;
-    
-    ret = io.read(patchFilename, patch);
-    if(true == ret)
-    {
-        IPS::apply(inputFilename, outputFilename, patch, true);
+        ApplyTask *task = new ApplyTask;
+        task->outputFilename = outputFilename;
+        task->cancelled = false;
+        
+        IPS::ApplyOptions options;
+        options.verbose = true;
+        options.progress = [app](IPS::Progress const& progress) {
+            ProgressUpdate *update = new ProgressUpdate;
+            update->app = app;
+            update->progress = progress;
+            g_idle_add(onApplyProgress, update);
+        };
+        if(task->job.start(inputFilename, task->outputFilename, patchFilename, options))
+        {
+            app->task = task;
+            gtk_button_set_label(app->applyButton, "gtk-cancel");
+            gtk_progress_bar_set_fraction(app->progressBar, 0.0);
+            gtk_progress_bar_set_text(app->progressBar, nullptr);
+            g_timeout_add(ApplyPollInterval, onApplyPoll, app);
+        }
+        else
+        {
+            delete task;
+        }
     }
     
     g_free(patchFilename);
@@ -153,6 +341,7 @@ int main(int argc, char **argv)
     GError     *error = NULL;
 
     AppConfig appConfig;
+    appConfig.task = nullptr;
 
     gtk_init( &argc, &argv );
 
@@ -181,6 +370,8 @@ int main(int argc, char **argv)
     
     appConfig.outputFileBox     = GTK_BOX   ( gtk_builder_get_object (builder, "outputFileBox" ) );
     appConfig.outputFileEntry   = GTK_ENTRY ( gtk_builder_get_object (builder, "outputFileEntry" ) );
+    appConfig.applyButton       = GTK_BUTTON( applyButton );
+    appConfig.progressBar       = GTK_PROGRESS_BAR( gtk_builder_get_object (builder, "progressBar" ) );
     
     appConfig.outputFileChooser = GTK_FILE_CHOOSER( gtk_file_chooser_dialog_new ("Save File",
                                       nullptr,
@@ -190,12 +381,11 @@ int main(int argc, char **argv)
                                       NULL ) );
     gtk_file_chooser_set_do_overwrite_confirmation (appConfig.outputFileChooser, TRUE);
     
-    GtkWidget *scrolledWindow = GTK_WIDGET( gtk_builder_get_object (builder, "logWindow") );
-    GtkWidget *logBox = GTK_WIDGET( gtk_builder_get_object (builder, "logBox") );
+    GtkWidget *logView = GTK_WIDGET( gtk_builder_get_object (builder, "logView") );
 
     Log::Logger& logger = Log::Logger::instance();
     GUILogOutput  output;
-    output.attach ( GTK_SCROLLED_WINDOW(scrolledWindow), GTK_BOX( logBox ) );
+    output.attach ( GTK_TREE_VIEW( logView ) );
     logger.begin ( &output );
 
     gtk_builder_connect_signals( builder, NULL );
@@ -204,6 +394,9 @@ int main(int argc, char **argv)
 
     gtk_main();
 
+    // The job is cancelled and waited for when the task is deleted.
+    delete appConfig.task;
+
     logger.end();
     return 0;
 }
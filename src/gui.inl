@@ -210,9 +210,12 @@ static const char* g_resources = R"(
           </packing>
         </child>
         <child>
-          <object class="GtkSeparator" id="statusSeparator">
+          <object class="GtkProgressBar" id="progressBar">
             <property name="visible">True</property>
             <property name="can_focus">False</property>
+            <property name="margin_left">4</property>
+            <property name="margin_right">4</property>
+            <property name="show_text">True</property>
           </object>
           <packing>
             <property name="expand">False</property>
@@ -220,37 +223,35 @@ static const char* g_resources = R"(
             <property name="position">2</property>
           </packing>
         </child>
+        <child>
+          <object class="GtkSeparator" id="statusSeparator">
+            <property name="visible">True</property>
+            <property name="can_focus">False</property>
+          </object>
+          <packing>
+            <property name="expand">False</property>
+            <property name="fill">True</property>
+            <property name="position">3</property>
+          </packing>
+        </child>
         <child>
           <object class="GtkScrolledWindow" id="logWindow">
             <property name="visible">True</property>
             <property name="can_focus">True</property>
             <property name="min_content_height">56</property>
             <child>
-              <object class="GtkViewport" id="logViewport">
+              <object class="GtkTreeView" id="logView">
                 <property name="visible">True</property>
                 <property name="can_focus">False</property>
-                <child>
-                  <object class="GtkBox" id="logBox">
-                    <property name="visible">True</property>
-                    <property name="can_focus">False</property>
-                    <property name="margin_left">4</property>
-                    <property name="margin_right">4</property>
-                    <property name="margin_top">4</property>
-                    <property name="margin_bottom">4</property>
-                    <property name="orientation">vertical</property>
-                    <property name="spacing">2</property>
-                    <child>
-                      <placeholder/>
-                    </child>
-                  </object>
-                </child>
+                <property name="headers_visible">False</property>
+                <property name="enable_search">False</property>
               </object>
             </child>
           </object>
           <packing>
             <property name="expand">False</property>
             <property name="fill">True</property>
-            <property name="position">3</property>
+            <property name="position">4</property>
           </packing>
         </child>
       </object>
@@ -13,10 +13,16 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library.
  */
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <thread>
 #include "log.h"
+#include "cache.h"
+#include "stats.h"
+#include "utils.h"
 #include "io.h"
 
 namespace IPS {
@@ -27,11 +33,195 @@ const off_t IO::HeaderSize = 5;
 const char* IO::Footer = "EOF";
 const off_t IO::FooterSize = 3;
 
+const size_t IO::ParallelThreshold = 32 * 1024 * 1024;
+
+/** Default constructor. **/
+Validation::Validation()
+    : result(IPS_ERROR)
+    , records(0)
+    , rleRecords(0)
+    , maxOutputSize(0)
+    , truncation(Patch::NoTruncation)
+    , errorOffset(0)
+    , errorRecord(Status::NoRecord)
+{}
+
+/**
+ * Format name.
+ */
+const char* Format::name(Value v)
+{
+    static const char* names[Format::Count] =
+    {
+        "ips", "ips32"
+    };
+    return (v < Format::Count) ? names[v] : "unknown";
+}
+/**
+ * Find the format of a patch from its header.
+ * @param [in]  data   Patch data.
+ * @param [in]  size   Patch size.
+ * @param [out] format Patch format.
+ * @return @b false if the header is not recognized.
+ */
+bool Format::detect(const uint8_t* data, size_t size, Value& format)
+{
+    if((size >= FormatTraits<IPS>::HeaderSize) && (0 == memcmp(data, FormatTraits<IPS>::header(), FormatTraits<IPS>::HeaderSize)))
+    {
+        format = IPS;
+        return true;
+    }
+    if((size >= FormatTraits<IPS32>::HeaderSize) && (0 == memcmp(data, FormatTraits<IPS32>::header(), FormatTraits<IPS32>::HeaderSize)))
+    {
+        format = IPS32;
+        return true;
+    }
+    return false;
+}
+
+/** Default constructor. **/
+RecordReader::RecordReader()
+    : _data(nullptr)
+    , _offset(0)
+    , _end(0)
+    , _index(0)
+    , _format(Format::IPS)
+    , _truncation(Patch::NoTruncation)
+{}
+/**
+ * Check if records starting at @b offset end exactly at @b position.
+ * @param [in] data     Patch data.
+ * @param [in] offset   Offset of the first record.
+ * @param [in] position Expected end of the records.
+ */
+template<Format::Value F> static bool recordBoundary(const uint8_t* data, size_t offset, size_t position)
+{
+    Record record;
+    while(offset < position)
+    {
+        size_t n = decodeRecord<F>(data + offset, position - offset, record);
+        if(0 == n)
+        {
+            return false;
+        }
+        offset += n;
+    }
+    return (offset == position);
+}
+/**
+ * Start decoding. The header and the footer are checked. The footer is
+ * either at the end of file or followed by the truncation size.
+ * @param [in] data Patch data, which must outlive the decoded records.
+ * @param [in] size Patch size.
+ * @return @b IPS_ERROR_FILE_TYPE if the header or the footer is invalid.
+ */
+Status RecordReader::begin(const uint8_t* data, size_t size)
+{
+    PhaseTimer timer(Phase::Header);
+    _data = data;
+    _offset = _end = _index = 0;
+    _truncation = Patch::NoTruncation;
+    if(false == Format::detect(data, size, _format))
+    {
+        return Status(IPS_ERROR_FILE_TYPE, 0);
+    }
+    size_t headerSize, footerSize, trailerSize;
+    const char *footer;
+    if(Format::IPS32 == _format)
+    {
+        headerSize = FormatTraits<Format::IPS32>::HeaderSize;
+        footerSize = FormatTraits<Format::IPS32>::FooterSize;
+        trailerSize = FormatTraits<Format::IPS32>::TrailerSize;
+        footer = FormatTraits<Format::IPS32>::footer();
+    }
+    else
+    {
+        headerSize = FormatTraits<Format::IPS>::HeaderSize;
+        footerSize = FormatTraits<Format::IPS>::FooterSize;
+        trailerSize = FormatTraits<Format::IPS>::TrailerSize;
+        footer = FormatTraits<Format::IPS>::footer();
+    }
+    // Look for the footer at the end of file and before the truncation
+    // size. A truncation size reading as the footer matches both, the
+    // footer is then the one found at a record boundary.
+    bool plain = (size >= (headerSize + footerSize)) && (0 == memcmp(footer, data + size - footerSize, footerSize));
+    bool trailed = (size >= (headerSize + footerSize + trailerSize)) && (0 == memcmp(footer, data + size - trailerSize - footerSize, footerSize));
+    if(plain && trailed)
+    {
+        size_t position = size - trailerSize - footerSize;
+        trailed = (Format::IPS32 == _format) ? recordBoundary<Format::IPS32>(data, headerSize, position)
+                                             : recordBoundary<Format::IPS>(data, headerSize, position);
+        plain = !trailed;
+    }
+    if(plain)
+    {
+        _end = size - footerSize;
+    }
+    else if(trailed)
+    {
+        _end = size - trailerSize - footerSize;
+        const uint8_t *trailer = data + size - trailerSize;
+        _truncation = (Format::IPS32 == _format) ? loadBigEndian<FormatTraits<Format::IPS32>::TrailerSize>(trailer)
+                                                 : loadBigEndian<FormatTraits<Format::IPS>::TrailerSize>(trailer);
+    }
+    else
+    {
+        return Status(IPS_ERROR_FILE_TYPE, (size > footerSize) ? (size - footerSize) : 0);
+    }
+    // Records lie between header and footer.
+    _offset = headerSize;
+    return Status();
+}
+/** Patch format. **/
+Format::Value RecordReader::format() const
+{
+    return _format;
+}
+/** Output size stored after the footer, or @b Patch::NoTruncation . **/
+size_t RecordReader::truncation() const
+{
+    return _truncation;
+}
+/**
+ * Decode the next record.
+ * @param [out] record IPS record.
+ * @return @b IPS_OK, @b IPS_PATCH_END after the last record or
+ *         @b IPS_ERROR_READ if the record is truncated.
+ */
+Status RecordReader::next(Record& record)
+{
+    return (Format::IPS32 == _format) ? next<Format::IPS32>(record) : next<Format::IPS>(record);
+}
+/** Patch offset of the next record. **/
+size_t RecordReader::offset() const
+{
+    return _offset;
+}
+/** Number of records decoded so far. **/
+size_t RecordReader::index() const
+{
+    return _index;
+}
+/** Check if the next record offset reads as the footer. **/
+bool RecordReader::eofCollision() const
+{
+    return (Format::IPS32 == _format) ? eofCollision<Format::IPS32>() : eofCollision<Format::IPS>();
+}
+
 /** Default constructor. **/
 IO::IO()
     : _stream(nullptr)
+    , _file()
+    , _data(nullptr)
+    , _size(0)
     , _filename("(none)")
     , _offset(0)
+    , _format(Format::IPS)
+    , _eofCollision(0)
+    , _eofCollisionRecord(Status::NoRecord)
+    , _logging(true)
+    , _threads(1)
+    , _parallelThreshold(ParallelThreshold)
 {}
 /** Destructor. **/
 IO::~IO()
@@ -42,267 +232,976 @@ IO::~IO()
     }
 }
 /**
- * Read header and check its validity.
+ * Map patch file.
+ * @param [in] filename IPS patch filename.
+ * @return @b true on success.
  */
-bool IO::readHeader()
+bool IO::open(std::string const& filename)
 {
-    uint8_t buffer[5];
-    size_t nRead;
-
-    nRead = fread(buffer, 1, IO::HeaderSize, _stream);
-    if(IO::HeaderSize != (off_t)nRead)
     {
-        Error("Failed to read header");
-        return false;
+        PhaseTimer timer(Phase::Open);
+        if(false == _file.open(filename))
+        {
+            _data = nullptr;
+            _size = 0;
+            return false;
+        }
     }
-    
-    if(memcmp(IO::Header, buffer, IO::HeaderSize))
+    _data = _file.data();
+    _size = _file.size();
+    _filename = filename;
+    Stats::instance().read(_size);
+    return true;
+}
+/**
+ * Release the mapped patch file.
+ */
+void IO::release()
+{
+    _file.close();
+    _data = nullptr;
+    _size = 0;
+}
+/**
+ * Log a failure if logging is enabled.
+ * @param [in] status Operation status.
+ * @return @b status.
+ */
+Status IO::report(Status const& status) const
+{
+    if(_logging && !status)
     {
-        Error("Invalid header");
-        return false;
+        if(Status::NoRecord == status.record)
+        {
+            Error("%s: %s at offset %zx%s%s", _filename.c_str(), status.message(), status.offset,
+                  status.error ? ": " : "", status.error ? strerror(status.error) : "");
+        }
+        else
+        {
+            Error("%s: %s at offset %zx (record #%zu)%s%s", _filename.c_str(), status.message(), status.offset, status.record,
+                  status.error ? ": " : "", status.error ? strerror(status.error) : "");
+        }
     }
-    
-    return true;
+    return status;
 }
 /**
- * Read footer and check its validity.
+ * Parse large patches on several threads.
+ * @param [in] threads   Number of threads (0 for one per core, 1
+ *                       disables parallel parsing).
+ * @param [in] threshold Minimum patch size.
  */
-bool IO::readFooter()
+void IO::setParallelParse(unsigned int threads, size_t threshold)
 {
-    char buffer[3];
-    size_t nRead;
-
-    // Jump to the end of file and look for the footer.
-    fseek(_stream, -IO::FooterSize, SEEK_END);
-    
-    nRead = fread(buffer, 1, IO::FooterSize, _stream);
-    if(IO::FooterSize != (off_t)nRead)
+    _threads = threads;
+    _parallelThreshold = threshold;
+}
+/**
+ * Enable or disable failure logging.
+ * Failures are still reported through the returned status.
+ * @param [in] enable Log failures.
+ */
+void IO::setLogging(bool enable)
+{
+    _logging = enable;
+}
+/**
+ * Internal implementation of IPS patch reading.
+ * The records are parsed by the functions specialized for the patch
+ * format.
+ * @param [out] patch  IPS patch.
+ * @param [in]  copy   If @b true the record data is copied.
+ * @return Read status. The offset is the start of the failing record.
+ */
+Status IO::readImpl(Patch& patch, bool copy)
+{
+    RecordReader reader;
+    Status status = reader.begin(_data, _size);
+    if(!status)
     {
-        Error("Failed to read footer: %s", strerror(errno));
-        return false;
+        return status;
     }
-    
-    if(memcmp(IO::Footer, buffer, IO::FooterSize))
+    patch.setTruncation(reader.truncation());
+    bool parallel = (1 != _threads) && (_size >= _parallelThreshold);
+    if(Format::IPS32 == reader.format())
     {
-        Error("Invalid footer");
-        return false;
+        return parallel ? readParallel<Format::IPS32>(reader, patch, copy) : readRecords<Format::IPS32>(reader, patch, copy);
     }
-    
-    return true;
+    return parallel ? readParallel<Format::IPS>(reader, patch, copy) : readRecords<Format::IPS>(reader, patch, copy);
 }
-/** 
- * Read record.
- * @param [out] record IPS record.
- * @return @b true on success.
+/**
+ * Record span used to sort decoded records.
  */
-bool IO::readRecord(Record& record)
+struct RecordSpan
 {
-    uint8_t buffer[5];
-    size_t nRead;
-    
-    // Read offset and size.
-    nRead = fread(buffer, 1, 5, _stream);
-    _offset += nRead;
-    if(5 != nRead)
+    /** Record offset. **/
+    uint32_t offset;
+    /** Record size. **/
+    uint16_t size;
+    /** Record index in the patch file. **/
+    size_t index;
+    /** Order by offset, then by file index. **/
+    bool operator< (RecordSpan const& other) const
     {
-        Error("Failed to read record offset and size: %s", strerror(errno));
-        return false;
+        return (offset < other.offset) || ((offset == other.offset) && (index < other.index));
     }
-    
-    record.offset = (buffer[0] << 16) | (buffer[1] << 8) | buffer[2];
-    record.size   = (buffer[3] <<  8) | buffer[4];
-    
-    // Check for RLE record.
-    if(0 == record.size)
+};
+/**
+ * Check if any of the first @b limit records (in file order) overlap.
+ * @param [in] spans Records sorted by offset.
+ * @param [in] limit Number of records to check.
+ * @return @b true if two of those records overlap.
+ */
+static bool overlapping(std::vector<RecordSpan> const& spans, size_t limit)
+{
+    size_t last = 0;
+    for(size_t i=0; i<spans.size(); i++)
     {
-        record.rle = true;
-        // Read rle size and byte
-        nRead = fread(buffer, 1, 3, _stream);
-        _offset += nRead;
-        if(3 != nRead)
+        if(spans[i].index >= limit)
         {
-            Error("Failed to read RLE data: %s", strerror(errno));
-            return false;
+            continue;
         }
-        record.size = (buffer[0] << 8) | buffer[1];
-        record.data = static_cast<uintptr_t>(buffer[2]);
+        if(spans[i].offset < last)
+        {
+            return true;
+        }
+        last = std::max(last, static_cast<size_t>(spans[i].offset) + spans[i].size);
     }
-    else
+    return false;
+}
+/**
+ * Find the first record, in file order, that overlaps an earlier one.
+ * @param [in] spans    Records sorted by offset.
+ * @param [in] existing Number of leading records known not to overlap.
+ * @return Index of the failing record, or the number of records if none
+ *         overlap.
+ */
+static size_t firstOverlap(std::vector<RecordSpan> const& spans, size_t existing)
+{
+    size_t total = spans.size();
+    if(false == overlapping(spans, total))
+    {
+        return total;
+    }
+    // Find the smallest number of records that overlap. The last of them
+    // is the failing one.
+    size_t low = existing + 1, high = total;
+    while(low < high)
     {
-        record.rle = false;
-        // Read data
-        uint8_t* data = new uint8_t[record.size];
-        if(nullptr == data)
+        size_t middle = low + (high - low) / 2;
+        if(overlapping(spans, middle))
         {
-            Error("Failed to allocate %ud bytes: %s", record.size, strerror(errno));
-            return false;
+            high = middle;
         }
-        nRead = fread(data, 1, record.size, _stream);
-        _offset += nRead;
-        if(record.size != nRead)
+        else
         {
-            Error("Failed to read data: %s", strerror(errno));
-            return false;
+            low = middle + 1;
         }
-        record.data = reinterpret_cast<uintptr_t>(data);
     }
-
-    return true;
+    return low - 1;
 }
 /**
- * Internal implementation of IPS patch reading.
+ * Sort record spans. Each thread sorts a range, then the sorted ranges
+ * are merged pairwise.
+ * @param [in,out] spans   Record spans.
+ * @param [in]     threads Number of threads.
  */
-bool IO::readImpl(Patch& patch)
+static void sortSpans(std::vector<RecordSpan>& spans, unsigned int threads)
 {
-    bool ret;
-    
-    ret = readHeader();
-    if(false == ret) { return ret; }
+    size_t count = spans.size();
+    if((threads < 2) || (count < (threads * 1024)))
+    {
+        std::sort(spans.begin(), spans.end());
+        return;
+    }
+    std::vector<size_t> bounds(threads + 1);
+    for(unsigned int t=0; t<=threads; t++)
+    {
+        bounds[t] = (count * t) / threads;
+    }
+    std::vector<std::thread> workers;
+    for(unsigned int t=0; t<threads; t++)
+    {
+        workers.push_back(std::thread([&spans, &bounds, t]()
+        {
+            std::sort(spans.begin() + bounds[t], spans.begin() + bounds[t+1]);
+        }));
+    }
+    for(size_t t=0; t<workers.size(); t++)
+    {
+        workers[t].join();
+    }
+    for(unsigned int width=1; width<threads; width*=2)
+    {
+        workers.clear();
+        for(unsigned int t=0; (t+width)<threads; t+=2*width)
+        {
+            size_t first  = bounds[t];
+            size_t middle = bounds[t + width];
+            size_t last   = bounds[std::min(t + 2*width, threads)];
+            workers.push_back(std::thread([&spans, first, middle, last]()
+            {
+                std::inplace_merge(spans.begin() + first, spans.begin() + middle, spans.begin() + last);
+            }));
+        }
+        for(size_t t=0; t<workers.size(); t++)
+        {
+            workers[t].join();
+        }
+    }
+}
+/**
+ * Store decoded records into a patch.
+ * The records are sorted once by offset and checked for overlaps in a
+ * single pass. On overlap, the failing record is the first one in file
+ * order that overlaps an earlier record, like when records are inserted
+ * one at a time, and the patch holds the records before it. Records
+ * already in the patch come before the decoded ones.
+ * @param [in]     offsets  Decoded record offsets.
+ * @param [in]     sizes    Decoded record sizes.
+ * @param [in]     rle      Decoded record RLE flags.
+ * @param [in]     payloads Decoded record data.
+ * @param [in]     starts   Position of each record in the patch file.
+ * @param [in]     status   Decoding status.
+ * @param [in]     threads  Number of sorting threads.
+ * @param [in]     copy     If @b true the record data was copied. The
+ *                          copies of the records left out are freed.
+ * @param [in,out] patch    IPS patch.
+ * @return Decoding status, or IPS_ERROR_INVALID if records overlap.
+ */
+static Status storeRecords(std::vector<uint32_t>& offsets, std::vector<uint16_t>& sizes, std::vector<uint8_t>& rle, std::vector<uintptr_t>& payloads, std::vector<size_t> const& starts, Status const& status, unsigned int threads, bool copy, Patch& patch)
+{
+    size_t existing = patch.count();
+    size_t count = offsets.size();
+    if(0 == existing)
+    {
+        size_t i;
+        for(i=1; (i<count) && ((static_cast<size_t>(offsets[i-1]) + sizes[i-1]) <= offsets[i]); i++)
+        {}
+        if(i >= count)
+        {
+            patch.assign(std::move(offsets), std::move(sizes), std::move(rle), std::move(payloads));
+            return status;
+        }
+    }
 
-    ret = readFooter();
-    if(false == ret) { return ret; }
+    PhaseTimer sortTimer(Phase::Sort);
+    size_t total = existing + count;
+    std::vector<RecordSpan> spans(total);
+    for(size_t i=0; i<total; i++)
+    {
+        spans[i].index = i;
+        if(i < existing)
+        {
+            Record record = patch[i];
+            spans[i].offset = record.offset;
+            spans[i].size = record.size;
+        }
+        else
+        {
+            spans[i].offset = offsets[i - existing];
+            spans[i].size = sizes[i - existing];
+        }
+    }
+    sortSpans(spans, threads);
 
-    // Compute data size
-    size_t len;
-    fseek(_stream, -IO::FooterSize, SEEK_END);
-    len  = ftell(_stream);
-    fseek(_stream,  IO::HeaderSize, SEEK_SET);
-    len -= ftell(_stream);
-    
-    for(_offset=0; ret && (_offset<len); )
+    Status result = status;
+    size_t limit = firstOverlap(spans, existing);
+    if(limit < total)
+    {
+        result = Status(IPS_ERROR_INVALID, starts[limit - existing], limit);
+    }
+
+    std::vector<uint32_t> sortedOffsets;
+    std::vector<uint16_t> sortedSizes;
+    std::vector<uint8_t> sortedRle;
+    std::vector<uintptr_t> sortedPayloads;
+    sortedOffsets.reserve(limit);
+    sortedSizes.reserve(limit);
+    sortedRle.reserve(limit);
+    sortedPayloads.reserve(limit);
+    for(size_t i=0; i<total; i++)
+    {
+        size_t index = spans[i].index;
+        if(index >= limit)
+        {
+            if(copy && !rle[index - existing])
+            {
+                delete [] reinterpret_cast<uint8_t*>(payloads[index - existing]);
+            }
+            continue;
+        }
+        sortedOffsets.push_back(spans[i].offset);
+        sortedSizes.push_back(spans[i].size);
+        if(index < existing)
+        {
+            Record record = patch[index];
+            sortedRle.push_back(record.rle ? 1 : 0);
+            sortedPayloads.push_back(record.data);
+        }
+        else
+        {
+            sortedRle.push_back(rle[index - existing]);
+            sortedPayloads.push_back(payloads[index - existing]);
+        }
+    }
+    patch.assign(std::move(sortedOffsets), std::move(sortedSizes), std::move(sortedRle), std::move(sortedPayloads));
+    return result;
+}
+/**
+ * Serial record parsing, specialized for a patch format.
+ * @param [in]  reader Record decoder, after the header.
+ * @param [out] patch  IPS patch.
+ * @param [in]  copy   If @b true the record data is copied.
+ * @return Read status. The offset is the start of the failing record.
+ */
+template<Format::Value F> Status IO::readRecords(RecordReader& reader, Patch& patch, bool copy)
+{
+    Stats& stats = Stats::instance();
+    PhaseTimer timer(Phase::Parse);
+    _eofCollision = 0;
+    _eofCollisionRecord = Status::NoRecord;
+    // Records are decoded first, then sorted and stored at once.
+    std::vector<uint32_t> offsets;
+    std::vector<uint16_t> sizes;
+    std::vector<uint8_t> rle;
+    std::vector<uintptr_t> payloads;
+    std::vector<size_t> starts;
+    Status status;
+    for(;;)
+    {
+        Record record;
+        size_t start = reader.offset();
+        if((0 == _eofCollision) && reader.eofCollision<F>())
+        {
+            _eofCollision = start;
+            _eofCollisionRecord = reader.index();
+        }
+        status = reader.next<F>(record);
+        if(IPS_PATCH_END == status.result)
+        {
+            status = Status();
+            break;
+        }
+        if(!status)
+        {
+            break;
+        }
+        if(copy && !record.rle)
+        {
+            uint8_t* data = new uint8_t[record.size];
+            memcpy(data, reinterpret_cast<const uint8_t*>(record.data), record.size);
+            record.data = reinterpret_cast<uintptr_t>(data);
+        }
+        stats.record(record.rle);
+        offsets.push_back(record.offset);
+        sizes.push_back(record.size);
+        rle.push_back(record.rle ? 1 : 0);
+        payloads.push_back(record.data);
+        starts.push_back(start);
+    }
+
+    // Records before a truncated one are kept.
+    return storeRecords(offsets, sizes, rle, payloads, starts, status, 1, copy, patch);
+}
+/**
+ * Parallel implementation of IPS patch reading.
+ * A serial scan finds the record boundaries. The record list is then
+ * split into ranges, one per thread. Each thread decodes its records and
+ * copies their data. Unsorted records are then sorted in parallel and
+ * checked for overlaps like the serial parser does.
+ * @param [in]  reader Record decoder, after the header.
+ * @param [out] patch  IPS patch.
+ * @param [in]  copy   If @b true the record data is copied.
+ * @return Read status. The offset is the start of the failing record.
+ */
+template<Format::Value F> Status IO::readParallel(RecordReader& reader, Patch& patch, bool copy)
+{
+    Stats& stats = Stats::instance();
+    PhaseTimer timer(Phase::Parse);
+    // Boundary scan. A truncated record is reported after the records
+    // before it, which may fail first.
+    Status scan;
+    std::vector<size_t> starts;
+    starts.reserve(_size / 64);
+    _eofCollision = 0;
+    _eofCollisionRecord = Status::NoRecord;
+    for(;;)
     {
         Record record;
-        ret = readRecord(record);
-        if(ret)
+        size_t start = reader.offset();
+        if((0 == _eofCollision) && reader.eofCollision<F>())
+        {
+            _eofCollision = start;
+            _eofCollisionRecord = reader.index();
+        }
+        scan = reader.next<F>(record);
+        if(IPS_PATCH_END == scan.result)
         {
-            ret = patch.add(record);
-            if(false == ret)
+            scan = Status();
+            break;
+        }
+        if(!scan)
+        {
+            break;
+        }
+        starts.push_back(start);
+    }
+
+    // Decoded records lie before the footer or the truncated record.
+    size_t end = reader.offset();
+    size_t count = starts.size();
+    std::vector<uint32_t> offsets(count);
+    std::vector<uint16_t> sizes(count);
+    std::vector<uint8_t> rle(count);
+    std::vector<uintptr_t> payloads(count);
+
+    unsigned int threads = _threads ? _threads : std::thread::hardware_concurrency();
+    if(0 == threads)
+    {
+        threads = 1;
+    }
+    if(threads > count)
+    {
+        threads = count ? static_cast<unsigned int>(count) : 1;
+    }
+    std::vector<size_t> rleCount(threads, 0);
+    auto decode = [&](unsigned int t)
+    {
+        size_t first = (count * t) / threads;
+        size_t last  = (count * (t + 1)) / threads;
+        for(size_t i=first; i<last; i++)
+        {
+            Record record;
+            decodeRecord<F>(_data + starts[i], end - starts[i], record);
+            uintptr_t data = record.data;
+            if(record.rle)
             {
-                Error("Failed to add record.");
+                rleCount[t]++;
             }
+            else if(copy)
+            {
+                uint8_t *ptr = new uint8_t[record.size];
+                memcpy(ptr, reinterpret_cast<const uint8_t*>(record.data), record.size);
+                data = reinterpret_cast<uintptr_t>(ptr);
+            }
+            rle[i] = record.rle;
+            offsets[i] = record.offset;
+            sizes[i] = record.size;
+            payloads[i] = data;
         }
+    };
+    std::vector<std::thread> workers;
+    for(unsigned int t=1; t<threads; t++)
+    {
+        workers.push_back(std::thread(decode, t));
+    }
+    decode(0);
+    for(size_t t=0; t<workers.size(); t++)
+    {
+        workers[t].join();
     }
 
-    return ret;
+    size_t rleTotal = 0;
+    for(unsigned int t=0; t<threads; t++)
+    {
+        rleTotal += rleCount[t];
+    }
+    stats.records(count - rleTotal, rleTotal);
+
+    return storeRecords(offsets, sizes, rle, payloads, starts, scan, threads, copy, patch);
 }
 /**
  * Read IPS patch.
  * @param [in]  filename IPS patch filename.
  * @param [out] patch IPS patch.
  */
-bool IO::read(std::string const& filename, Patch& patch)
+Status IO::read(std::string const& filename, Patch& patch)
 {
-    _stream = fopen(filename.c_str(), "rb");
-    if(nullptr == _stream)
+    if(false == open(filename))
     {
-        Error("Failed to open %s: %s", filename.c_str(), strerror(errno));
-        return false;
+        return Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno);
     }
     
-    bool ret = readImpl(patch);
+    Status ret = readImpl(patch, true);
     
-    fclose(_stream);
-    _stream = nullptr;
+    release();
     
+    return report(ret);
+}
+/**
+ * Read IPS patch without copying record data.
+ * @param [in]  filename IPS patch filename.
+ * @param [out] patch    IPS patch.
+ * @param [in]  cache    If not @b nullptr, parsed patch cache.
+ */
+Status IO::map(std::string const& filename, Patch& patch, Cache* cache)
+{
+    if(false == open(filename))
+    {
+        return Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno);
+    }
+
+    uint64_t key = 0;
+    if(nullptr != cache)
+    {
+        key = hash64(_data, _size);
+        if(cache->load(key, _data, _size, patch))
+        {
+            return Status();
+        }
+    }
+
+    Status ret = readImpl(patch, false);
+    if(!ret)
+    {
+        return report(ret);
+    }
+
+    if(nullptr != cache)
+    {
+        cache->store(key, _data, _size, patch);
+    }
     return ret;
 }
 /**
- * Internal implementation of IPS patch writing.
+ * Read an IPS patch held in memory without copying record data.
+ * The records point to @b data which must outlive the patch.
+ * @param [in]  data  Patch data.
+ * @param [in]  size  Patch size.
+ * @param [out] patch IPS patch.
  */
-bool IO::writeImpl(Patch const& patch)
+Status IO::parse(const uint8_t* data, size_t size, Patch& patch)
 {
-    uint8_t buffer[8];
-    size_t nWritten;
+    release();
+    _data = data;
+    _size = size;
+    _filename = "(buffer)";
+
+    Status ret = readImpl(patch, false);
+
+    _data = nullptr;
+    _size = 0;
+    return report(ret);
+}
+/**
+ * Check IPS patch validity without copying any record data.
+ * @param [in]  filename IPS patch filename.
+ * @param [out] report   Validation report.
+ * @return @b true if the patch is valid.
+ */
+bool IO::validate(std::string const& filename, Validation& report)
+{
+    report = Validation();
+    if(false == open(filename))
+    {
+        report.result = IPS_ERROR_OPEN;
+        return false;
+    }
+    
+    bool ret = validateImpl(report);
+
+    release();
+
+    return ret;
+}
+/**
+ * Check the validity of an IPS patch held in memory.
+ * @param [in]  data     Patch data.
+ * @param [in]  size     Patch size.
+ * @param [out] report   Validation report.
+ * @return @b true if the patch is valid.
+ */
+bool IO::validate(const uint8_t* data, size_t size, Validation& report)
+{
+    report = Validation();
+    release();
+    _data = data;
+    _size = size;
+    _filename = "(buffer)";
+
+    bool ret = validateImpl(report);
+
+    _data = nullptr;
+    _size = 0;
+    return ret;
+}
+/**
+ * Internal implementation of IPS patch validation.
+ * @param [out] report   Validation report.
+ * @return @b true if the patch is valid.
+ */
+bool IO::validateImpl(Validation& report)
+{
+    RecordReader reader;
+    Status status = reader.begin(_data, _size);
+    if(status)
+    {
+        report.truncation = reader.truncation();
+        status = (Format::IPS32 == reader.format()) ? validateRecords<Format::IPS32>(reader, report)
+                                                    : validateRecords<Format::IPS>(reader, report);
+    }
+    this->report(status);
+    report.result = status.result;
+    if(!status)
+    {
+        report.errorOffset = status.offset;
+        report.errorRecord = status.record;
+    }
+    return status;
+}
+/**
+ * Record validation, specialized for a patch format.
+ * The records are streamed without being stored. Records sorted by
+ * offset cannot overlap, which is checked on the fly. Otherwise the
+ * patch is decoded again into a span index which is sorted to find the
+ * first overlapping record, like when the patch is read.
+ * @param [in]  reader Record decoder, after the header.
+ * @param [out] report Validation report.
+ * @return Validation status. The offset is the start of the failing record.
+ */
+template<Format::Value F> Status IO::validateRecords(RecordReader& reader, Validation& report)
+{
+    Stats& stats = Stats::instance();
+    PhaseTimer timer(Phase::Parse);
+    size_t collision = 0;
+    size_t collisionRecord = Status::NoRecord;
+    uint64_t last = 0;
+    uint64_t maxEnd = 0;
+    bool sorted = true;
+    Status status;
+    for(;;)
+    {
+        Record record;
+        size_t start = reader.offset();
+        if((0 == collision) && reader.eofCollision<F>())
+        {
+            collision = start;
+            collisionRecord = reader.index();
+        }
+        status = reader.next<F>(record);
+        if(IPS_PATCH_END == status.result)
+        {
+            status = Status();
+            break;
+        }
+        if(!status)
+        {
+            break;
+        }
+        stats.record(record.rle);
+        uint64_t end = static_cast<uint64_t>(record.offset) + record.size;
+        sorted = sorted && (last <= record.offset);
+        last = end;
+        maxEnd = std::max(maxEnd, end);
+        report.records++;
+        report.rleRecords += record.rle ? 1 : 0;
+    }
+
+    if(false == sorted)
+    {
+        // Fallback for unsorted patches.
+        PhaseTimer sortTimer(Phase::Sort);
+        std::vector<RecordSpan> spans;
+        spans.reserve(report.records);
+        reader.begin(_data, _size);
+        for(size_t i=0; i<report.records; i++)
+        {
+            Record record;
+            reader.next<F>(record);
+            RecordSpan span = { record.offset, record.size, i };
+            spans.push_back(span);
+        }
+        sortSpans(spans, _threads);
+        size_t limit = firstOverlap(spans, 0);
+        if(limit < report.records)
+        {
+            // Only the records before the failing one are reported.
+            reader.begin(_data, _size);
+            report.rleRecords = 0;
+            maxEnd = 0;
+            for(size_t i=0; i<limit; i++)
+            {
+                Record record;
+                reader.next<F>(record);
+                maxEnd = std::max(maxEnd, static_cast<uint64_t>(record.offset) + record.size);
+                report.rleRecords += record.rle ? 1 : 0;
+            }
+            report.records = limit;
+            status = Status(IPS_ERROR_INVALID, reader.offset(), limit);
+        }
+    }
+    report.maxOutputSize = maxEnd;
+
+    if(status && collision)
+    {
+        // "EOF" read as an offset would end the patch for most patchers.
+        status = Status(IPS_ERROR_OFFSET, collision, collisionRecord);
+    }
+    return status;
+}
+/**
+ * Write the header of the output format.
+ * @return Write status.
+ */
+Status IO::writeHeader()
+{
+    const char *header = (Format::IPS32 == _format) ? FormatTraits<Format::IPS32>::header() : FormatTraits<Format::IPS>::header();
+    size_t headerSize = (Format::IPS32 == _format) ? FormatTraits<Format::IPS32>::HeaderSize : FormatTraits<Format::IPS>::HeaderSize;
     _offset = 0;
-    // Write header.
-    nWritten = fwrite(IO::Header, 1, IO::HeaderSize, _stream);
+    size_t nWritten = fwrite(header, 1, headerSize, _stream);
     _offset += nWritten;
-    if(IO::HeaderSize != (off_t)nWritten)
+    if(headerSize != nWritten)
     {
-        Error("Failed to write header : %s", strerror(errno));
-        return false;
+        return Status(IPS_ERROR_WRITE, _offset, Status::NoRecord, errno);
     }
-    // Write records.
+    return Status();
+}
+/**
+ * Write the records of a patch in the output format.
+ * @param [in] patch IPS patch.
+ * @return Write status. The record is the index of the failing record in
+ *         @b patch.
+ */
+Status IO::writeRecords(Patch const& patch)
+{
+    return (Format::IPS32 == _format) ? writeRecords<Format::IPS32>(patch) : writeRecords<Format::IPS>(patch);
+}
+/**
+ * Write the records of a patch in the format @b F .
+ * @param [in] patch IPS patch.
+ * @return Write status. The record is the index of the failing record in
+ *         @b patch.
+ */
+template<Format::Value F> Status IO::writeRecords(Patch const& patch)
+{
+    static const size_t offsetSize = FormatTraits<F>::OffsetSize;
+    uint8_t buffer[offsetSize + 5];
+    size_t nWritten;
     for(size_t i=0; i<patch.count(); i++)
     {
         Record const& record = patch[i];
         // Offset.
-        buffer[0] = (record.offset >> 16) & 0xff;
-        buffer[1] = (record.offset >>  8) & 0xff;
-        buffer[2] = (record.offset      ) & 0xff;
+        for(size_t j=0; j<offsetSize; j++)
+        {
+            buffer[j] = (record.offset >> (8 * (offsetSize - 1 - j))) & 0xff;
+        }
+        uint8_t *size = buffer + offsetSize;
         if(false == record.rle)
         {
             // Size.
-            buffer[3] = (record.size >> 8) & 0xff;
-            buffer[4] = (record.size     ) & 0xff;
+            size[0] = (record.size >> 8) & 0xff;
+            size[1] = (record.size     ) & 0xff;
             // Write header.
-            nWritten = fwrite(buffer, 1, 5, _stream);
+            nWritten = fwrite(buffer, 1, offsetSize + 2, _stream);
             _offset += nWritten;
-            if(5 != nWritten)
+            if((offsetSize + 2) != nWritten)
             {
-                Error("Failed to write record #%d header: %s", i, strerror(errno));
-                return false;
+                return Status(IPS_ERROR_WRITE, _offset, i, errno);
             }
             // Data.
             nWritten = fwrite(reinterpret_cast<uint8_t*>(record.data), 1, record.size, _stream);
             _offset += nWritten;
             if(record.size != nWritten)
             {
-                Error("Failed to write record #%d data: %s", i, strerror(errno));
-                return false;
+                return Status(IPS_ERROR_WRITE, _offset, i, errno);
             }
         }
         else
         {
             // Size.
-            buffer[3] = 0;
-            buffer[4] = 0;
+            size[0] = 0;
+            size[1] = 0;
             // Record data is 3 bytes long.
             // -- 1st and 2nd bytes are repeat count
-            buffer[5] = (record.size >> 8) & 0xff;
-            buffer[6] = (record.size     ) & 0xff;
+            size[2] = (record.size >> 8) & 0xff;
+            size[3] = (record.size     ) & 0xff;
             // -- 3rd byte is the repeated data
-            buffer[7] = static_cast<uint8_t>(record.data & 0xff);
+            size[4] = static_cast<uint8_t>(record.data & 0xff);
             // Write RLE record.
-            nWritten = fwrite(buffer, 1, 8, _stream);
+            nWritten = fwrite(buffer, 1, offsetSize + 5, _stream);
             _offset += nWritten;
-            if(8 != nWritten)
+            if((offsetSize + 5) != nWritten)
             {
-                Error("Failed to write RLE record %d: %s", i, strerror(errno));
-                return false;
+                return Status(IPS_ERROR_WRITE, _offset, i, errno);
             }
         }
     }
-    // Write footer.
-    nWritten = fwrite(IO::Footer, 1, IO::FooterSize, _stream);
+    return Status();
+}
+/**
+ * Write the footer of the output format, followed by the truncation size
+ * if there is one.
+ * @param [in] truncation Output size or @b Patch::NoTruncation .
+ * @return Write status.
+ */
+Status IO::writeFooter(size_t truncation)
+{
+    const char *footer = (Format::IPS32 == _format) ? FormatTraits<Format::IPS32>::footer() : FormatTraits<Format::IPS>::footer();
+    size_t footerSize = (Format::IPS32 == _format) ? FormatTraits<Format::IPS32>::FooterSize : FormatTraits<Format::IPS>::FooterSize;
+    size_t trailerSize = (Format::IPS32 == _format) ? FormatTraits<Format::IPS32>::TrailerSize : FormatTraits<Format::IPS>::TrailerSize;
+    uint8_t buffer[8];
+    size_t size = footerSize;
+    memcpy(buffer, footer, footerSize);
+    if(Patch::NoTruncation != truncation)
+    {
+        if(truncation >> (8 * trailerSize))
+        {
+            return Status(IPS_ERROR_OFFSET, _offset);
+        }
+        for(size_t i=0; i<trailerSize; i++)
+        {
+            buffer[size++] = static_cast<uint8_t>(truncation >> (8 * (trailerSize - 1 - i)));
+        }
+    }
+    size_t nWritten = fwrite(buffer, 1, size, _stream);
     _offset += nWritten;
-    if(IO::FooterSize != (off_t)nWritten)
+    if(size != nWritten)
     {
-        Error("Failed to write footer : %s", strerror(errno));
-        return false;
+        return Status(IPS_ERROR_WRITE, _offset, Status::NoRecord, errno);
     }
-    return true;
+    return Status();
+}
+/**
+ * Internal implementation of IPS patch writing.
+ * @return Write status. The offset is the number of bytes written.
+ */
+Status IO::writeImpl(Patch const& patch)
+{
+    // Records are sorted, the last one has the largest offset.
+    size_t count = patch.count();
+    bool large = (count && (patch.offsets()[count - 1] > 0xffffff)) || (patch.truncated() && (patch.truncation() > 0xffffff));
+    _format = large ? Format::IPS32 : Format::IPS;
+    Status status = writeHeader();
+    if(status)
+    {
+        status = writeRecords(patch);
+    }
+    if(status)
+    {
+        status = writeFooter(patch.truncation());
+    }
+    return status;
 }
 /**
  * Write IPS patch.
  * @param [in] filename IPS patch filename.
  * @param [in] patch    IPS patch.
  */
-bool IO::write(std::string const& filename, Patch const& patch)
+Status IO::write(std::string const& filename, Patch const& patch)
 {
+    _filename = filename;
     _stream = fopen(filename.c_str(), "wb");
     if(nullptr == _stream)
     {
-        Error("Failed to open %s: %s", filename.c_str(), strerror(errno));
-        return false;
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno));
     }
     
-    bool ret = writeImpl(patch);
+    Status ret = writeImpl(patch);
     
-    fclose(_stream);
+    if((0 != fclose(_stream)) && ret)
+    {
+        ret = Status(IPS_ERROR_SAVE, _offset, Status::NoRecord, errno);
+    }
     _stream = nullptr;
     
-    return ret;
+    return report(ret);
+}
+/**
+ * Start writing an IPS patch. Records are then written with append() and
+ * the patch is completed with finish().
+ * @param [in] filename IPS patch filename.
+ * @param [in] format   Patch format.
+ * @return Write status.
+ */
+Status IO::create(std::string const& filename, Format::Value format)
+{
+    if(nullptr != _stream)
+    {
+        fclose(_stream);
+    }
+    _filename = filename;
+    _format = format;
+    _stream = fopen(filename.c_str(), "wb");
+    if(nullptr == _stream)
+    {
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno));
+    }
+    Status ret = writeHeader();
+    if(!ret)
+    {
+        fclose(_stream);
+        _stream = nullptr;
+    }
+    return report(ret);
+}
+/**
+ * Write the records of a patch to the patch started by create(). The
+ * records are written as is: they must follow the previously written
+ * ones.
+ * @param [in] patch IPS patch.
+ * @return Write status.
+ */
+Status IO::append(Patch const& patch)
+{
+    if(nullptr == _stream)
+    {
+        return report(Status(IPS_ERROR_WRITE));
+    }
+    Status ret = writeRecords(patch);
+    if(!ret)
+    {
+        fclose(_stream);
+        _stream = nullptr;
+    }
+    return report(ret);
+}
+/**
+ * Complete the patch started by create().
+ * @param [in] truncation Output size stored after the footer, or
+ *                        @b Patch::NoTruncation .
+ * @return Write status.
+ */
+Status IO::finish(size_t truncation)
+{
+    if(nullptr == _stream)
+    {
+        return report(Status(IPS_ERROR_WRITE));
+    }
+    Status ret = writeFooter(truncation);
+    if((0 != fclose(_stream)) && ret)
+    {
+        ret = Status(IPS_ERROR_SAVE, _offset, Status::NoRecord, errno);
+    }
+    _stream = nullptr;
+    return report(ret);
+}
+/**
+ * Write IPS patch to memory.
+ * @param [in]  patch  IPS patch.
+ * @param [out] output Patch data.
+ */
+Status IO::write(Patch const& patch, std::vector<uint8_t>& output)
+{
+    _filename = "(buffer)";
+    char *buffer = nullptr;
+    size_t size = 0;
+    _stream = open_memstream(&buffer, &size);
+    if(nullptr == _stream)
+    {
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno));
+    }
+
+    Status ret = writeImpl(patch);
+
+    fclose(_stream);
+    _stream = nullptr;
+
+    if(ret)
+    {
+        output.assign(buffer, buffer + size);
+    }
+    free(buffer);
+    return report(ret);
 }
 
 } // namespace IPS
@@ -17,10 +17,119 @@
 #define _IPS_IO_H_
 
 #include <string>
+#include <vector>
+#include <cstdio>
+#include "format.h"
 #include "ips.h"
+#include "mapping.h"
 
 namespace IPS {
 
+class Cache;
+
+/**
+ * Patch validation report.
+ */
+struct Validation
+{
+    Result result;        /**< Validation result. **/
+    size_t records;       /**< Number of records. **/
+    size_t rleRecords;    /**< Number of RLE records. **/
+    size_t maxOutputSize; /**< Minimum output size needed by the records. **/
+    size_t truncation;    /**< Output size stored after the footer (Patch::NoTruncation if none). **/
+    size_t errorOffset;   /**< Patch file offset of the first error. **/
+    size_t errorRecord;   /**< Index of the first invalid record (Status::NoRecord if none). **/
+    /** Default constructor. **/
+    Validation();
+};
+
+/**
+ * Streaming record decoder.
+ * Records are decoded one at a time, in patch order, from patch data held
+ * in memory (usually a mapped patch file). Record data points to the
+ * patch data. Records are neither sorted nor checked for overlap.
+ * The format is found by begin(). Hot loops call the decoder specialized
+ * for it, the untyped next() dispatches on each call.
+ */
+class RecordReader
+{
+    public:
+        /** Default constructor. **/
+        RecordReader();
+        /**
+         * Start decoding. The header and the footer are checked. The
+         * footer is either at the end of file or followed by the
+         * truncation size.
+         * @param [in] data Patch data, which must outlive the decoded records.
+         * @param [in] size Patch size.
+         * @return @b IPS_ERROR_FILE_TYPE if the header or the footer is invalid.
+         */
+        Status begin(const uint8_t* data, size_t size);
+        /** Patch format. **/
+        Format::Value format() const;
+        /** Output size stored after the footer, or @b Patch::NoTruncation . **/
+        size_t truncation() const;
+        /**
+         * Decode the next record.
+         * @param [out] record IPS record.
+         * @return @b IPS_OK, @b IPS_PATCH_END after the last record or
+         *         @b IPS_ERROR_READ if the record is truncated. The offset
+         *         of a failure is the start of the record.
+         */
+        Status next(Record& record);
+        /**
+         * Decode the next record of a patch of format @b F .
+         * @param [out] record IPS record.
+         * @return Same as next().
+         */
+        template<Format::Value F> Status next(Record& record);
+        /** Patch offset of the next record. **/
+        size_t offset() const;
+        /** Number of records decoded so far. **/
+        size_t index() const;
+        /** Check if the next record offset reads as the footer. **/
+        bool eofCollision() const;
+        /** Check if the next record offset reads as the footer of @b F . **/
+        template<Format::Value F> bool eofCollision() const;
+
+    private:
+        const uint8_t* _data;
+        /** Offset of the next record. **/
+        size_t _offset;
+        /** Offset of the end of the record list. **/
+        size_t _end;
+        size_t _index;
+        Format::Value _format;
+        /** Output size stored after the footer. **/
+        size_t _truncation;
+};
+
+/**
+ * Decode the next record of a patch of format @b F .
+ * @param [out] record IPS record.
+ * @return Same as next().
+ */
+template<Format::Value F> inline Status RecordReader::next(Record& record)
+{
+    if(_offset >= _end)
+    {
+        return Status(IPS_PATCH_END, _offset);
+    }
+    size_t n = decodeRecord<F>(_data + _offset, _end - _offset, record);
+    if(0 == n)
+    {
+        return Status(IPS_ERROR_READ, _offset, _index);
+    }
+    _offset += n;
+    _index++;
+    return Status();
+}
+/** Check if the next record offset reads as the footer of @b F . **/
+template<Format::Value F> inline bool RecordReader::eofCollision() const
+{
+    return footerCollision<F>(_data + _offset, _end - _offset);
+}
+
 /**
  * IPS patch input/output.
  */
@@ -31,6 +140,8 @@ class IO
         static const off_t HeaderSize;
         static const char* Footer;
         static const off_t FooterSize;
+        /** Default patch size above which records are parsed in parallel. **/
+        static const size_t ParallelThreshold;
         
     public:
         /** Default constructor. **/
@@ -41,42 +152,192 @@ class IO
          * Read IPS patch.
          * @param [in]  filename IPS patch filename.
          * @param [out] patch    IPS patch.
+         * @return Read status.
+         */
+        Status read(std::string const& filename, Patch& patch);
+        /**
+         * Read IPS patch without copying record data.
+         * The patch file stays mapped and the records point to it until
+         * the next call to read(), map(), validate() or the destruction
+         * of the IO object.
+         * @param [in]  filename IPS patch filename.
+         * @param [out] patch    IPS patch.
+         * @param [in]  cache    If not @b nullptr, parsed patch cache.
+         * @return Read status.
          */
-        bool read(std::string const& filename, Patch& patch);
+        Status map(std::string const& filename, Patch& patch, Cache* cache=nullptr);
         /**
-         * Write IPS patch.
+         * Read an IPS patch held in memory without copying record data.
+         * The records point to @b data which must outlive the patch.
+         * @param [in]  data  Patch data.
+         * @param [in]  size  Patch size.
+         * @param [out] patch IPS patch.
+         * @return Read status.
+         */
+        Status parse(const uint8_t* data, size_t size, Patch& patch);
+        /**
+         * Check IPS patch validity without storing any record.
+         * Records are checked for bounds, overlap, truncated payloads and
+         * offsets colliding with the "EOF" marker. Only unsorted patches
+         * need a temporary index of the record spans.
+         * @param [in]  filename IPS patch filename.
+         * @param [out] report   Validation report.
+         * @return @b true if the patch is valid.
+         */
+        bool validate(std::string const& filename, Validation& report);
+        /**
+         * Check the validity of an IPS patch held in memory.
+         * @param [in]  data     Patch data.
+         * @param [in]  size     Patch size.
+         * @param [out] report   Validation report.
+         * @return @b true if the patch is valid.
+         */
+        bool validate(const uint8_t* data, size_t size, Validation& report);
+        /**
+         * Write IPS patch. Patches with offsets wider than 24 bits are
+         * written in the IPS32 format.
          * @param [in] filename IPS patch filename.
          * @param [in] patch    IPS patch.
+         * @return Write status.
          */
-        bool write(std::string const& filename, Patch const& patch);
+        Status write(std::string const& filename, Patch const& patch);
+        /**
+         * Start writing an IPS patch. Records are then written with
+         * append() and the patch is completed with finish().
+         * @param [in] filename IPS patch filename.
+         * @param [in] format   Patch format.
+         * @return Write status.
+         */
+        Status create(std::string const& filename, Format::Value format=Format::IPS);
+        /**
+         * Write the records of a patch to the patch started by create().
+         * The records are written as is: they must follow the previously
+         * written ones.
+         * @param [in] patch IPS patch.
+         * @return Write status.
+         */
+        Status append(Patch const& patch);
+        /**
+         * Complete the patch started by create().
+         * @param [in] truncation Output size stored after the footer, or
+         *                        @b Patch::NoTruncation .
+         * @return Write status.
+         */
+        Status finish(size_t truncation=Patch::NoTruncation);
+        /**
+         * Write IPS patch to memory. Patches with offsets wider than 24
+         * bits are written in the IPS32 format.
+         * @param [in]  patch  IPS patch.
+         * @param [out] output Patch data.
+         * @return Write status.
+         */
+        Status write(Patch const& patch, std::vector<uint8_t>& output);
+        /**
+         * Enable or disable failure logging.
+         * Failures are still reported through the returned status.
+         * @param [in] enable Log failures.
+         */
+        void setLogging(bool enable);
+        /**
+         * Parse large patches on several threads.
+         * Record boundaries are found by a serial scan, then records are
+         * decoded, copied and checked for overlap in parallel.
+         * @param [in] threads   Number of threads (0 for one per core, 1
+         *                       disables parallel parsing).
+         * @param [in] threshold Minimum patch size.
+         */
+        void setParallelParse(unsigned int threads, size_t threshold=ParallelThreshold);
 
     private:
-        /** Read header and check its validity. **/
-        bool readHeader();
-        /** Read footer and check its validity. **/
-        bool readFooter();
-        /** 
-         * Read record.
-         * @param [out] record IPS record.
+        /**
+         * Map patch file.
+         * @param [in] filename IPS patch filename.
          * @return @b true on success.
          */
-        bool readRecord(Record& record);
+        bool open(std::string const& filename);
+        /** Release the mapped patch file. **/
+        void release();
         /**
          * Internal implementation of IPS patch reading.
+         * @param [out] patch  IPS patch.
+         * @param [in]  copy   If @b true the record data is copied.
+         * @return Read status. The offset is the start of the failing record.
+         */
+        Status readImpl(Patch& patch, bool copy);
+        /**
+         * Serial record parsing, specialized for a patch format.
+         * @param [in]  reader Record decoder, after the header.
+         * @param [out] patch  IPS patch.
+         * @param [in]  copy   If @b true the record data is copied.
+         * @return Read status. The offset is the start of the failing record.
          */
-        bool readImpl(Patch& patch);
+        template<Format::Value F> Status readRecords(RecordReader& reader, Patch& patch, bool copy);
+        /**
+         * Parallel record parsing, specialized for a patch format.
+         * @param [in]  reader Record decoder, after the header.
+         * @param [out] patch  IPS patch.
+         * @param [in]  copy   If @b true the record data is copied.
+         * @return Read status. The offset is the start of the failing record.
+         */
+        template<Format::Value F> Status readParallel(RecordReader& reader, Patch& patch, bool copy);
+        /**
+         * Internal implementation of IPS patch validation.
+         * @param [out] report   Validation report.
+         * @return @b true if the patch is valid.
+         */
+        bool validateImpl(Validation& report);
+        /**
+         * Record validation, specialized for a patch format.
+         * @param [in]  reader Record decoder, after the header.
+         * @param [out] report Validation report.
+         * @return Validation status. The offset is the start of the failing record.
+         */
+        template<Format::Value F> Status validateRecords(RecordReader& reader, Validation& report);
+        /** Write the header of the output format. **/
+        Status writeHeader();
+        /** Write the records of a patch in the output format. **/
+        Status writeRecords(Patch const& patch);
+        /** Write the records of a patch in the format @b F . **/
+        template<Format::Value F> Status writeRecords(Patch const& patch);
+        /** Write the footer of the output format and the truncation size. **/
+        Status writeFooter(size_t truncation);
         /**
          * Internal implementation of IPS patch writing.
+         * @return Write status. The offset is the number of bytes written.
+         */
+        Status writeImpl(Patch const& patch);
+        /**
+         * Log a failure if logging is enabled.
+         * @param [in] status Operation status.
+         * @return @b status.
          */
-        bool writeImpl(Patch const& patch);
+        Status report(Status const& status) const;
         
     private:
         /** File handle. **/
         FILE* _stream;
+        /** Mapped patch. **/
+        MappedFile _file;
+        /** Patch data (mapped file or user buffer). **/
+        const uint8_t* _data;
+        /** Patch size. **/
+        size_t _size;
         /** Filename. **/
         std::string _filename;
         /** File offset. **/
         size_t _offset;
+        /** Output format. **/
+        Format::Value _format;
+        /** Offset of the first record whose offset reads as "EOF". **/
+        size_t _eofCollision;
+        /** Index of the record whose offset reads as "EOF". **/
+        size_t _eofCollisionRecord;
+        /** Log failures. **/
+        bool _logging;
+        /** Number of parse threads. **/
+        unsigned int _threads;
+        /** Minimum patch size for parallel parsing. **/
+        size_t _parallelThreshold;
 };
 
 } // namespace IPS
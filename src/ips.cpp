@@ -17,6 +17,61 @@
 #include "ips.h"
 
 namespace IPS {
+
+const size_t Status::NoRecord;
+const size_t Patch::NoTruncation;
+
+/** Default constructor (success). **/
+Status::Status()
+    : result(IPS_OK)
+    , offset(0)
+    , record(NoRecord)
+    , error(0)
+{}
+/**
+ * Constructor.
+ * @param [in] result Result code.
+ * @param [in] offset Offset of the failure.
+ * @param [in] record Index of the failing record.
+ * @param [in] error  errno value.
+ */
+Status::Status(Result result, size_t offset, size_t record, int error)
+    : result(result)
+    , offset(offset)
+    , record(record)
+    , error(error)
+{}
+/** Short description of the result code. **/
+const char* Status::message() const
+{
+    switch(result)
+    {
+        case IPS_ERROR_INVALID:
+            return "overlapping record";
+        case IPS_ERROR_OFFSET:
+            return "record offset collides with the EOF marker";
+        case IPS_ERROR_PROCESS:
+            return "processing failed";
+        case IPS_ERROR_READ:
+            return "truncated record";
+        case IPS_ERROR_WRITE:
+            return "write failed";
+        case IPS_ERROR_SAVE:
+            return "save failed";
+        case IPS_ERROR_OPEN:
+            return "open failed";
+        case IPS_ERROR_FILE_TYPE:
+            return "invalid header or footer";
+        case IPS_ERROR:
+            return "error";
+        case IPS_PATCH_END:
+            return "end of patch";
+        case IPS_OK:
+            return "ok";
+    }
+    return "unknown";
+}
+
 /**
  * Default constructor.
  */
@@ -58,13 +113,27 @@ Record::Record(uint32_t offset, uint16_t size, uint8_t data)
  * Default constructor.
  */
 Patch::Patch()
-    : _records()
+    : _offsets()
+    , _sizes()
+    , _rle()
+    , _payloads()
+    , _truncation(NoTruncation)
 {}
 /**
  * Destructor.
  */
 Patch::~Patch()
 {}
+/**
+ * Insert a record at index @b i .
+ */
+void Patch::insert(size_t i, Record const& record)
+{
+    _offsets.insert(_offsets.begin()+i, record.offset);
+    _sizes.insert(_sizes.begin()+i, record.size);
+    _rle.insert(_rle.begin()+i, record.rle ? 1 : 0);
+    _payloads.insert(_payloads.begin()+i, record.data);
+}
 /**
  * Add record to patch.
  * @param [in] record  Record 
@@ -74,27 +143,32 @@ Patch::~Patch()
  */
 bool Patch::add(Record const& record, bool check)
 {
-    if((false == _records.empty()) && check)
+    if((false == _offsets.empty()) && check)
     {
-        // Find the right spot.
-        int m0 = 2*record.offset + record.size;
-        for(size_t i=0; i<_records.size(); i++)
+        // Find the right spot. Records are sorted and do not overlap, so
+        // only the neighbours of the insertion point need to be checked.
+        size_t i = std::upper_bound(_offsets.begin(), _offsets.end(), record.offset) - _offsets.begin();
+        if(i)
         {
-            int m1 = 2*_records[i].offset + _records[i].size;
-            int w  = record.size + _records[i].size;
-            bool overlap =  (abs(m0 - m1) < w);
-            if(overlap)
+            if((static_cast<size_t>(_offsets[i-1]) + _sizes[i-1]) > record.offset)
             {
                 return false;
             }
-            if(_records[i].offset > record.offset)
+        }
+        if(i < _offsets.size())
+        {
+            if((static_cast<size_t>(record.offset) + record.size) > _offsets[i])
             {
-                _records.insert(_records.begin()+i, record);
-                return true;
+                return false;
             }
+            insert(i, record);
+            return true;
         }
     } 
-    _records.push_back(record);
+    _offsets.push_back(record.offset);
+    _sizes.push_back(record.size);
+    _rle.push_back(record.rle ? 1 : 0);
+    _payloads.push_back(record.data);
     return true;
 }
 
@@ -105,33 +179,136 @@ bool Patch::add(Record const& record, bool check)
  */
 bool Patch::remove(size_t index)
 {
-    if(index >= _records.size())
+    if(index >= _offsets.size())
+    {
+        return false;
+    }
+    _offsets.erase(_offsets.begin()+index);
+    _sizes.erase(_sizes.begin()+index);
+    _rle.erase(_rle.begin()+index);
+    _payloads.erase(_payloads.begin()+index);
+    return true;
+}
+/**
+ * Replace the records by the content of the columns, which are moved
+ * into the patch. Records must be sorted by offset and must not overlap.
+ * @param [in] offsets  Destination offsets.
+ * @param [in] sizes    Data sizes.
+ * @param [in] rle      RLE flags.
+ * @param [in] payloads Data pointers or RLE data bytes.
+ * @return @b false if the columns sizes differ.
+ */
+bool Patch::assign(std::vector<uint32_t>&& offsets, std::vector<uint16_t>&& sizes, std::vector<uint8_t>&& rle, std::vector<uintptr_t>&& payloads)
+{
+    size_t n = offsets.size();
+    if((sizes.size() != n) || (rle.size() != n) || (payloads.size() != n))
     {
         return false;
     }
-    _records.erase(_records.begin()+index);
+    _offsets = std::move(offsets);
+    _sizes = std::move(sizes);
+    _rle = std::move(rle);
+    _payloads = std::move(payloads);
     return true;
 }
+/**
+ * Preallocate storage for @b n records.
+ */
+void Patch::reserve(size_t n)
+{
+    _offsets.reserve(n);
+    _sizes.reserve(n);
+    _rle.reserve(n);
+    _payloads.reserve(n);
+}
 /**
  * Returns the number of record in the patch.
  */
 size_t Patch::count() const
 {
-    return _records.size();
+    return _offsets.size();
+}
+/**
+ * Get the record at the index @b i .
+ */
+Record Patch::operator[] (size_t i) const
+{
+    Record record;
+    record.rle = (0 != _rle[i]);
+    record.data = _payloads[i];
+    record.offset = _offsets[i];
+    record.size = _sizes[i];
+    return record;
 }
 /**
- * Access the record at the index @b i .
+ * Find the first record ending after @b offset .
+ * Records do not overlap when they were added with overlap checks, so
+ * this is the record holding @b offset if there is one.
+ * @param [in] offset Output offset.
+ * @return Record index or count() if there is none.
  */
-Record& Patch::operator[] (size_t i)
+size_t Patch::find(size_t offset) const
 {
-    return _records[i];
+    size_t i = std::upper_bound(_offsets.begin(), _offsets.end(), offset,
+        [](size_t value, uint32_t start) { return value < start; }) - _offsets.begin();
+    if(i && ((static_cast<size_t>(_offsets[i-1]) + _sizes[i-1]) > offset))
+    {
+        return i-1;
+    }
+    return i;
+}
+/**
+ * Output size needed by the records.
+ */
+size_t Patch::outputSize() const
+{
+    const uint32_t *offsets = _offsets.data();
+    const uint16_t *sizes = _sizes.data();
+    size_t n = _offsets.size();
+    uint64_t last = 0;
+    // Record ends fit in 33 bits (32 bits offsets, 16 bits sizes).
+    for(size_t i=0; i<n; i++)
+    {
+        uint64_t end = static_cast<uint64_t>(offsets[i]) + sizes[i];
+        last = (end > last) ? end : last;
+    }
+    return last;
 }
 /**
- * Access the record at the index @b i .
+ * Set the output size stored after the footer.
+ * @param [in] size Truncation size or @b NoTruncation .
  */
-Record const& Patch::operator[] (size_t i) const
+void Patch::setTruncation(size_t size)
 {
-    return _records[i];
+    _truncation = size;
+}
+/**
+ * Output size stored after the footer, or @b NoTruncation .
+ */
+size_t Patch::truncation() const
+{
+    return _truncation;
+}
+/**
+ * Check if the patch holds a truncation size.
+ */
+bool Patch::truncated() const
+{
+    return (NoTruncation != _truncation);
+}
+/**
+ * Final output size: the truncation size if there is one, or the largest
+ * of the source size and of the output size needed by the records.
+ * @param [in] sourceSize Source size.
+ */
+size_t Patch::finalSize(size_t sourceSize) const
+{
+    if(truncated())
+    {
+        return _truncation;
+    }
+    size_t size = outputSize();
+    return (size > sourceSize) ? size : sourceSize;
 }
 
 } // namespace IPS
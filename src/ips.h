@@ -40,6 +40,37 @@ enum Result
     IPS_OK              =  1
 };
 
+/**
+ * Operation status.
+ * Failures carry the offset where they were detected (patch offset for
+ * reads, output offset for writes) and the index of the record involved.
+ */
+struct Status
+{
+    /** Record index value when no record is involved. **/
+    static const size_t NoRecord = static_cast<size_t>(-1);
+
+    Result result;  /**< Result code. **/
+    size_t offset;  /**< Offset of the failure. **/
+    size_t record;  /**< Index of the failing record or @b NoRecord. **/
+    int    error;   /**< errno value for system errors, 0 otherwise. **/
+
+    /** Default constructor (success). **/
+    Status();
+    /**
+     * Constructor.
+     * @param [in] result Result code.
+     * @param [in] offset Offset of the failure.
+     * @param [in] record Index of the failing record.
+     * @param [in] error  errno value.
+     */
+    Status(Result result, size_t offset=0, size_t record=NoRecord, int error=0);
+    /** @b true on success. **/
+    inline operator bool() const { return IPS_OK == result; }
+    /** Short description of the result code. **/
+    const char* message() const;
+};
+
 /**
  * IPS record.
  */
@@ -75,9 +106,15 @@ struct Record
 
 /**
  * An IPS patch is basically a list of records.
+ * Records are sorted by offset and stored as separate columns, so that
+ * searches and sweeps over offsets and sizes only touch those arrays.
  */
 class Patch
 {
+    public:
+        /** Truncation size of a patch without truncation trailer. **/
+        static const size_t NoTruncation = SIZE_MAX;
+
     public:
         /**
          * Default constructor.
@@ -102,21 +139,76 @@ class Patch
          * @return @b false if the index is out of bound.
          */
         bool remove(size_t index);
+        /**
+         * Replace the records by the content of the columns, which are
+         * moved into the patch. Records must be sorted by offset and
+         * must not overlap.
+         * @param [in] offsets  Destination offsets.
+         * @param [in] sizes    Data sizes.
+         * @param [in] rle      RLE flags.
+         * @param [in] payloads Data pointers or RLE data bytes.
+         * @return @b false if the columns sizes differ.
+         */
+        bool assign(std::vector<uint32_t>&& offsets, std::vector<uint16_t>&& sizes, std::vector<uint8_t>&& rle, std::vector<uintptr_t>&& payloads);
+        /**
+         * Preallocate storage for @b n records.
+         */
+        void reserve(size_t n);
         /**
          * Returns the number of record in the patch.
          */
         size_t count() const;
         /**
-         * Access the record at the index @b i .
+         * Get the record at the index @b i .
+         */
+        Record operator[] (size_t i) const;
+        /**
+         * Find the first record ending after @b offset .
+         * @param [in] offset Output offset.
+         * @return Record index or count() if there is none.
          */
-        Record& operator[] (size_t i);
+        size_t find(size_t offset) const;
         /**
-         * Access the record at the index @b i .
+         * Output size needed by the records.
          */
-        Record const& operator[] (size_t i) const;        
+        size_t outputSize() const;
+        /**
+         * Set the output size stored after the footer.
+         * @param [in] size Truncation size or @b NoTruncation .
+         */
+        void setTruncation(size_t size);
+        /** Output size stored after the footer, or @b NoTruncation . **/
+        size_t truncation() const;
+        /** Check if the patch holds a truncation size. **/
+        bool truncated() const;
+        /**
+         * Final output size: the truncation size if there is one, or the
+         * largest of the source size and of the output size needed by the
+         * records.
+         * @param [in] sourceSize Source size.
+         */
+        size_t finalSize(size_t sourceSize) const;
+        /** Destination offsets. **/
+        inline const uint32_t* offsets() const { return _offsets.data(); }
+        /** Data sizes. **/
+        inline const uint16_t* sizes() const { return _sizes.data(); }
+        /** RLE flags. **/
+        inline const uint8_t* rle() const { return _rle.data(); }
+        /** Data pointers or RLE data bytes. **/
+        inline const uintptr_t* payloads() const { return _payloads.data(); }
+    private:
+        void insert(size_t i, Record const& record);
     private:
-        /** Record array. **/
-        std::vector<Record> _records;
+        /** Destination offset of each record. **/
+        std::vector<uint32_t> _offsets;
+        /** Data size of each record. **/
+        std::vector<uint16_t> _sizes;
+        /** RLE flag of each record. **/
+        std::vector<uint8_t> _rle;
+        /** Data pointer or RLE data byte of each record. **/
+        std::vector<uintptr_t> _payloads;
+        /** Output size stored after the footer. **/
+        size_t _truncation;
 };
 
 } // namespace IPS
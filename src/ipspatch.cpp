@@ -0,0 +1,228 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+#include "ips.h"
+#include "io.h"
+#include "mapping.h"
+#include "utils.h"
+#include "ipspatch.h"
+
+static_assert(IPSPATCH_ERROR_INVALID   == IPS::IPS_ERROR_INVALID,   "result code mismatch");
+static_assert(IPSPATCH_ERROR_OFFSET    == IPS::IPS_ERROR_OFFSET,    "result code mismatch");
+static_assert(IPSPATCH_ERROR_PROCESS   == IPS::IPS_ERROR_PROCESS,   "result code mismatch");
+static_assert(IPSPATCH_ERROR_READ      == IPS::IPS_ERROR_READ,      "result code mismatch");
+static_assert(IPSPATCH_ERROR_WRITE     == IPS::IPS_ERROR_WRITE,     "result code mismatch");
+static_assert(IPSPATCH_ERROR_SAVE      == IPS::IPS_ERROR_SAVE,      "result code mismatch");
+static_assert(IPSPATCH_ERROR_OPEN      == IPS::IPS_ERROR_OPEN,      "result code mismatch");
+static_assert(IPSPATCH_ERROR_FILE_TYPE == IPS::IPS_ERROR_FILE_TYPE, "result code mismatch");
+static_assert(IPSPATCH_ERROR           == IPS::IPS_ERROR,           "result code mismatch");
+static_assert(IPSPATCH_OK              == IPS::IPS_OK,              "result code mismatch");
+
+/**
+ * Parsed patch. Records point to the patch data owned by the handle.
+ */
+struct ipspatch
+{
+    std::vector<uint8_t> data;
+    IPS::Patch patch;
+};
+
+/**
+ * Copy a buffer into a malloc'ed one owned by the caller.
+ */
+static int release(std::vector<uint8_t> const& buffer, uint8_t** output, size_t* outputSize)
+{
+    uint8_t *ptr = static_cast<uint8_t*>(malloc(buffer.size() ? buffer.size() : 1));
+    if(nullptr == ptr)
+    {
+        return IPS::IPS_ERROR;
+    }
+    if(buffer.size())
+    {
+        memcpy(ptr, buffer.data(), buffer.size());
+    }
+    *output = ptr;
+    *outputSize = buffer.size();
+    return IPS::IPS_OK;
+}
+
+/**
+ * Parse the patch data held by a new handle. The handle is handed to the
+ * caller on success, and released otherwise.
+ */
+static int parse(std::unique_ptr<ipspatch_t>& handle, ipspatch_t** patch)
+{
+    IPS::IO io;
+    io.setLogging(false);
+    int ret = io.parse(handle->data.data(), handle->data.size(), handle->patch).result;
+    if(IPS::IPS_OK != ret)
+    {
+        return ret;
+    }
+    *patch = handle.release();
+    return IPS::IPS_OK;
+}
+
+extern "C" {
+
+int ipspatch_open_file(const char* filename, ipspatch_t** patch)
+{
+    if((nullptr == filename) || (nullptr == patch))
+    {
+        return IPS::IPS_ERROR;
+    }
+    *patch = nullptr;
+    try
+    {
+        IPS::MappedFile file;
+        if(false == file.open(filename))
+        {
+            return IPS::IPS_ERROR_OPEN;
+        }
+        std::unique_ptr<ipspatch_t> handle(new ipspatch_t);
+        handle->data.assign(file.data(), file.data() + file.size());
+        return parse(handle, patch);
+    }
+    catch(std::bad_alloc const&)
+    {
+        return IPS::IPS_ERROR;
+    }
+}
+
+int ipspatch_open_buffer(const uint8_t* data, size_t size, ipspatch_t** patch)
+{
+    if(((nullptr == data) && size) || (nullptr == patch))
+    {
+        return IPS::IPS_ERROR;
+    }
+    *patch = nullptr;
+    try
+    {
+        std::unique_ptr<ipspatch_t> handle(new ipspatch_t);
+        handle->data.assign(data, data + size);
+        return parse(handle, patch);
+    }
+    catch(std::bad_alloc const&)
+    {
+        return IPS::IPS_ERROR;
+    }
+}
+
+size_t ipspatch_record_count(const ipspatch_t* patch)
+{
+    return (nullptr != patch) ? patch->patch.count() : 0;
+}
+
+int ipspatch_apply(const ipspatch_t* patch, const uint8_t* source, size_t source_size, uint8_t** output, size_t* output_size)
+{
+    if((nullptr == patch) || ((nullptr == source) && source_size) || (nullptr == output) || (nullptr == output_size))
+    {
+        return IPS::IPS_ERROR;
+    }
+    *output = nullptr;
+    *output_size = 0;
+    try
+    {
+        std::vector<uint8_t> buffer;
+        IPS::Status status = IPS::apply(source, source_size, patch->patch, buffer);
+        if(!status)
+        {
+            return status.result;
+        }
+        return release(buffer, output, output_size);
+    }
+    catch(std::bad_alloc const&)
+    {
+        return IPS::IPS_ERROR;
+    }
+}
+
+int ipspatch_validate(const uint8_t* data, size_t size, ipspatch_validation_t* report)
+{
+    if((nullptr == data) && size)
+    {
+        return IPS::IPS_ERROR;
+    }
+    try
+    {
+        IPS::IO io;
+        io.setLogging(false);
+        IPS::Validation validation;
+        io.validate(data, size, validation);
+        if(nullptr != report)
+        {
+            report->result = validation.result;
+            report->records = validation.records;
+            report->rle_records = validation.rleRecords;
+            report->max_output_size = validation.maxOutputSize;
+            report->error_offset = validation.errorOffset;
+            report->error_record = validation.errorRecord;
+            report->truncation = validation.truncation;
+        }
+        return validation.result;
+    }
+    catch(std::bad_alloc const&)
+    {
+        return IPS::IPS_ERROR;
+    }
+}
+
+int ipspatch_diff(const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size, uint8_t** output, size_t* output_size)
+{
+    if(((nullptr == source) && source_size) || ((nullptr == target) && target_size) || (nullptr == output) || (nullptr == output_size))
+    {
+        return IPS::IPS_ERROR;
+    }
+    *output = nullptr;
+    *output_size = 0;
+    try
+    {
+        IPS::Patch patch;
+        if(false == IPS::diff(source, source_size, target, target_size, patch))
+        {
+            return IPS::IPS_ERROR_PROCESS;
+        }
+        IPS::IO io;
+        io.setLogging(false);
+        std::vector<uint8_t> buffer;
+        IPS::Status status = io.write(patch, buffer);
+        if(!status)
+        {
+            return status.result;
+        }
+        return release(buffer, output, output_size);
+    }
+    catch(std::bad_alloc const&)
+    {
+        return IPS::IPS_ERROR;
+    }
+}
+
+void ipspatch_close(ipspatch_t* patch)
+{
+    delete patch;
+}
+
+void ipspatch_free(void* buffer)
+{
+    free(buffer);
+}
+
+} // extern "C"
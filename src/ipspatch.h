@@ -0,0 +1,121 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPSPATCH_H_
+#define _IPSPATCH_H_
+
+/*
+ * libipspatch C API.
+ * Every function returns one of the IPSPATCH_* codes below. They have the
+ * same values as IPS::Result. The library never writes log messages.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define IPSPATCH_API __attribute__((visibility("default")))
+#else
+#define IPSPATCH_API
+#endif
+
+/** Result codes. **/
+#define IPSPATCH_ERROR_INVALID   (-9)
+#define IPSPATCH_ERROR_OFFSET    (-8)
+#define IPSPATCH_ERROR_PROCESS   (-7)
+#define IPSPATCH_ERROR_READ      (-6)
+#define IPSPATCH_ERROR_WRITE     (-5)
+#define IPSPATCH_ERROR_SAVE      (-4)
+#define IPSPATCH_ERROR_OPEN      (-3)
+#define IPSPATCH_ERROR_FILE_TYPE (-2)
+#define IPSPATCH_ERROR           (-1)
+#define IPSPATCH_OK              (1)
+
+/** Parsed patch. **/
+typedef struct ipspatch ipspatch_t;
+
+/** Validation report. **/
+typedef struct ipspatch_validation
+{
+    int result;             /**< Validation result. **/
+    size_t records;         /**< Number of records. **/
+    size_t rle_records;     /**< Number of RLE records. **/
+    size_t max_output_size; /**< Minimum output size needed by the records. **/
+    size_t error_offset;    /**< Patch offset of the first error. **/
+    size_t error_record;    /**< Index of the first invalid record (SIZE_MAX if none). **/
+    size_t truncation;      /**< Output size stored after the footer (SIZE_MAX if none). **/
+} ipspatch_validation_t;
+
+/**
+ * Read an IPS patch file.
+ * @param [in]  filename Patch filename.
+ * @param [out] patch    Parsed patch, to be released with ipspatch_close().
+ */
+IPSPATCH_API int ipspatch_open_file(const char* filename, ipspatch_t** patch);
+/**
+ * Read an IPS patch from memory. The data is copied.
+ * @param [in]  data  Patch data.
+ * @param [in]  size  Patch size.
+ * @param [out] patch Parsed patch, to be released with ipspatch_close().
+ */
+IPSPATCH_API int ipspatch_open_buffer(const uint8_t* data, size_t size, ipspatch_t** patch);
+/**
+ * Number of records.
+ */
+IPSPATCH_API size_t ipspatch_record_count(const ipspatch_t* patch);
+/**
+ * Apply a patch to a source buffer.
+ * @param [in]  patch       Parsed patch.
+ * @param [in]  source      Source data.
+ * @param [in]  source_size Source size.
+ * @param [out] output      Patched data, to be released with ipspatch_free().
+ * @param [out] output_size Patched data size.
+ */
+IPSPATCH_API int ipspatch_apply(const ipspatch_t* patch, const uint8_t* source, size_t source_size, uint8_t** output, size_t* output_size);
+/**
+ * Check an IPS patch held in memory.
+ * @param [in]  data   Patch data.
+ * @param [in]  size   Patch size.
+ * @param [out] report Validation report (may be NULL).
+ */
+IPSPATCH_API int ipspatch_validate(const uint8_t* data, size_t size, ipspatch_validation_t* report);
+/**
+ * Create an IPS patch turning a source buffer into a target buffer.
+ * @param [in]  source      Source data.
+ * @param [in]  source_size Source size.
+ * @param [in]  target      Target data.
+ * @param [in]  target_size Target size.
+ * @param [out] output      Patch data, to be released with ipspatch_free().
+ * @param [out] output_size Patch size.
+ */
+IPSPATCH_API int ipspatch_diff(const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size, uint8_t** output, size_t* output_size);
+/**
+ * Release a patch.
+ */
+IPSPATCH_API void ipspatch_close(ipspatch_t* patch);
+/**
+ * Release a buffer returned by the library.
+ */
+IPSPATCH_API void ipspatch_free(void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPSPATCH_H_ */
@@ -15,6 +15,8 @@
  */
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
+#include <chrono>
 #include "log.h"
 
 namespace Log {
@@ -36,6 +38,17 @@ const char* Type::name() const
             return "unknown";
     }
 }
+/**
+ * Call the output with variadic format parameters.
+ */
+static void emit(Output* output, Type type, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    output->out(type, format, args);
+    va_end(args);
+}
+
 /** Default constructor. **/
 Output::Output()
 {}
@@ -54,23 +67,256 @@ void Output::out(Type type, const char* format, va_list args)
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
 }
+/**
+ * Output structured event. By default the event is formatted as an
+ * information message.
+ * @param [in] event   Event.
+ */
+void Output::event(Event const& event)
+{
+    emit(this, Type::Info, "Applying record: %5zu    offset: %08x    size: %5u    rle: %s",
+         event.index, event.offset, static_cast<unsigned int>(event.size), event.rle ? "yes" : "no");
+}
+
+/** Default constructor. **/
+Record::Record()
+    : type(Type::Info)
+    , isEvent(false)
+    , event()
+    , format("")
+    , count(0)
+    , used(0)
+{}
+/**
+ * Add argument. Extra arguments are ignored, strings are truncated.
+ */
+void Record::push(Argument const& arg)
+{
+    if(count >= MaxArguments)
+    {
+        return;
+    }
+    args[count] = arg;
+    if(Argument::String == arg.kind)
+    {
+        const char *str = (nullptr != arg.s) ? arg.s : "(null)";
+        size_t len = strlen(str);
+        if(used >= StringsSize)
+        {
+            used = StringsSize - 1;
+            len = 0;
+        }
+        else if((used + len + 1) > StringsSize)
+        {
+            len = StringsSize - used - 1;
+        }
+        memcpy(strings + used, str, len);
+        strings[used + len] = '\0';
+        // Records are copied, so keep an offset rather than a pointer.
+        args[count].u = used;
+        used += len + 1;
+    }
+    count++;
+}
+/**
+ * Format record.
+ * Each conversion is formatted on its own using the kind of the captured
+ * argument, so length modifiers of the format string are rewritten.
+ * @param [out] buffer  Output buffer.
+ * @param [in]  size    Output buffer size.
+ */
+void Record::print(char* buffer, size_t size) const
+{
+    size_t n = 0;
+    size_t index = 0;
+    const char *ptr = this->format;
+    if(0 == size)
+    {
+        return;
+    }
+    buffer[0] = '\0';
+    while(*ptr && ((n + 1) < size))
+    {
+        if('%' != *ptr)
+        {
+            buffer[n++] = *ptr++;
+            continue;
+        }
+        if('%' == ptr[1])
+        {
+            buffer[n++] = '%';
+            ptr += 2;
+            continue;
+        }
+        // Copy flags, width and precision, skip length modifiers.
+        char spec[32];
+        size_t len = 0;
+        spec[len++] = *ptr++;
+        while(*ptr && strchr("-+ #0123456789.", *ptr) && (len < (sizeof(spec) - 4)))
+        {
+            spec[len++] = *ptr++;
+        }
+        while(*ptr && strchr("hljztL", *ptr))
+        {
+            ptr++;
+        }
+        char conversion = *ptr;
+        if(0 == conversion)
+        {
+            break;
+        }
+        ptr++;
+
+        int written = 0;
+        if(index >= count)
+        {
+            written = snprintf(buffer + n, size - n, "(missing)");
+        }
+        else
+        {
+            Argument const& arg = args[index++];
+            switch(conversion)
+            {
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o':
+                case 'c':
+                {
+                    long long value = (Argument::Real == arg.kind) ? static_cast<long long>(arg.d) : arg.i;
+                    if('c' != conversion)
+                    {
+                        spec[len++] = 'l';
+                        spec[len++] = 'l';
+                    }
+                    spec[len++] = conversion;
+                    spec[len] = '\0';
+                    if(('d' == conversion) || ('i' == conversion))
+                    {
+                        written = snprintf(buffer + n, size - n, spec, value);
+                    }
+                    else if('c' == conversion)
+                    {
+                        written = snprintf(buffer + n, size - n, spec, static_cast<int>(value));
+                    }
+                    else
+                    {
+                        written = snprintf(buffer + n, size - n, spec, static_cast<unsigned long long>(value));
+                    }
+                    break;
+                }
+                case 'f':
+                case 'F':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G':
+                {
+                    double value = (Argument::Real == arg.kind) ? arg.d :
+                                   ((Argument::Signed == arg.kind) ? static_cast<double>(arg.i) : static_cast<double>(arg.u));
+                    spec[len++] = conversion;
+                    spec[len] = '\0';
+                    written = snprintf(buffer + n, size - n, spec, value);
+                    break;
+                }
+                case 's':
+                    spec[len++] = conversion;
+                    spec[len] = '\0';
+                    written = snprintf(buffer + n, size - n, spec, (Argument::String == arg.kind) ? (strings + arg.u) : "(invalid)");
+                    break;
+                case 'p':
+                    spec[len++] = conversion;
+                    spec[len] = '\0';
+                    written = snprintf(buffer + n, size - n, spec, arg.p);
+                    break;
+                default:
+                    written = 0;
+                    break;
+            }
+        }
+        if(written > 0)
+        {
+            n += static_cast<size_t>(written);
+            if(n >= size)
+            {
+                n = size - 1;
+            }
+        }
+    }
+    buffer[n] = '\0';
+}
 
 /** Destructor. **/
 Logger::~Logger()
-{}
+{
+    end();
+}
 /**
 * Begin logger.
 * @param [in] out  Log output.
 */
 void Logger::begin(Output *out)
 {
+    end();
+    _output = out;
+}
+/**
+ * Begin asynchronous logger.
+ * @param [in] out       Log output.
+ * @param [in] capacity  Queue capacity (rounded up to a power of 2).
+ * @param [in] policy    Overflow policy.
+ */
+void Logger::beginAsync(Output *out, size_t capacity, Policy::Value policy)
+{
+    end();
+    size_t n = 2;
+    while(n < capacity)
+    {
+        n <<= 1;
+    }
+    _cells = new Cell[n];
+    for(size_t i=0; i<n; i++)
+    {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    _mask = n - 1;
+    _enqueue.store(0, std::memory_order_relaxed);
+    _dequeue = 0;
+    _dropped.store(0);
+    _policy = policy;
     _output = out;
+    _running = true;
+    _sleeping = false;
+    _thread = std::thread(&Logger::run, this);
+    _async = true;
 }
 /**
-* Stop logger.
+* Stop logger. Pending records are flushed.
 */
 void Logger::end()
 {
+    if(_async)
+    {
+        // Records are no longer queued once the producers already
+        // pushing one are done.
+        _async = false;
+        while(0 != _producers.load())
+        {
+            std::this_thread::yield();
+        }
+        _running = false;
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _wake.notify_one();
+        }
+        _thread.join();
+        delete [] _cells;
+        _cells = nullptr;
+    }
+    std::lock_guard<std::mutex> lock(_outputMutex);
+    _output = nullptr;
 }
 /**
 * Output log string.
@@ -80,15 +326,174 @@ void Logger::end()
 */
 void Logger::out(Type type, const char* format, ...)
 {
-    if(nullptr == _output)
+    std::lock_guard<std::mutex> lock(_outputMutex);
+    Output *output = _output.load();
+    if(nullptr == output)
     {
         return;
     }
     va_list args;
     va_start(args, format);
-    _output->out(type, format, args);
+    output->out(type, format, args);
     va_end(args);
 }
+/**
+ * Output structured event. The event is queued in asynchronous mode.
+ * @param [in] event   Event.
+ */
+void Logger::event(Event const& event)
+{
+    if(_async)
+    {
+        Record record;
+        record.isEvent = true;
+        record.event = event;
+        push(record);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(_outputMutex);
+        Output *output = _output.load();
+        if(nullptr != output)
+        {
+            output->event(event);
+        }
+    }
+}
+/**
+ * Set runtime log level threshold.
+ * @param [in] level   Minimum log type.
+ */
+void Logger::setLevel(Type level)
+{
+    _level = static_cast<int>(level.value);
+}
+/** Number of records dropped since the logger started. **/
+size_t Logger::dropped() const
+{
+    return _dropped.load();
+}
+/**
+ * Queue record, unless the asynchronous logger is stopping.
+ */
+void Logger::push(Record const& record)
+{
+    _producers++;
+    if(_async.load())
+    {
+        enqueue(record);
+    }
+    _producers--;
+}
+/**
+ * Queue record (bounded MPMC queue by Dmitry Vyukov, used with a single
+ * consumer).
+ */
+void Logger::enqueue(Record const& record)
+{
+    size_t pos = _enqueue.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        Cell *cell = &_cells[pos & _mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if(0 == diff)
+        {
+            if(_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell->record = record;
+                cell->sequence.store(pos + 1, std::memory_order_release);
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            // Queue is full.
+            if(Policy::Drop == _policy)
+            {
+                _dropped++;
+                return;
+            }
+            std::this_thread::yield();
+            pos = _enqueue.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            pos = _enqueue.load(std::memory_order_relaxed);
+        }
+    }
+    if(_sleeping.load(std::memory_order_acquire))
+    {
+        _wake.notify_one();
+    }
+}
+/** Dequeue record. **/
+bool Logger::pop(Record& record)
+{
+    Cell *cell = &_cells[_dequeue & _mask];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    if(sequence != (_dequeue + 1))
+    {
+        return false;
+    }
+    record = cell->record;
+    cell->sequence.store(_dequeue + _mask + 1, std::memory_order_release);
+    _dequeue++;
+    return true;
+}
+/** Logger thread. **/
+void Logger::run()
+{
+    Record record;
+    char buffer[512];
+    size_t reported = 0;
+    for(;;)
+    {
+        bool running = _running.load();
+        bool empty = true;
+        // The output is shared with callers logging synchronously while
+        // the logger stops.
+        Output *output = _output.load();
+        while(pop(record))
+        {
+            empty = false;
+            if(nullptr == output)
+            {
+                continue;
+            }
+            if(record.isEvent)
+            {
+                std::lock_guard<std::mutex> lock(_outputMutex);
+                output->event(record.event);
+            }
+            else
+            {
+                record.print(buffer, sizeof(buffer));
+                std::lock_guard<std::mutex> lock(_outputMutex);
+                emit(output, record.type, "%s", buffer);
+            }
+        }
+        size_t dropped = _dropped.load();
+        if((dropped != reported) && (nullptr != output))
+        {
+            snprintf(buffer, sizeof(buffer), "%zu log records dropped", dropped - reported);
+            std::lock_guard<std::mutex> lock(_outputMutex);
+            emit(output, Type::Warning, "%s", buffer);
+            reported = dropped;
+        }
+        if(!running)
+        {
+            break;
+        }
+        if(empty)
+        {
+            std::unique_lock<std::mutex> lock(_wakeMutex);
+            _sleeping.store(true, std::memory_order_release);
+            _wake.wait_for(lock, std::chrono::milliseconds(5));
+            _sleeping.store(false, std::memory_order_release);
+        }
+    }
+}
 /** Get logger instance. */
 Logger& Logger::instance()
 {
@@ -98,10 +503,32 @@ Logger& Logger::instance()
 /** Default constructor. **/
 Logger::Logger()
     : _output(nullptr)
+    , _level(static_cast<int>(Type::Info))
+    , _async(false)
+    , _producers(0)
+    , _policy(Policy::Drop)
+    , _cells(nullptr)
+    , _mask(0)
+    , _enqueue(0)
+    , _dequeue(0)
+    , _dropped(0)
+    , _running(false)
+    , _sleeping(false)
 {}
 /** Constructor. **/
 Logger::Logger(Logger const&)
     : _output(nullptr)
+    , _level(static_cast<int>(Type::Info))
+    , _async(false)
+    , _producers(0)
+    , _policy(Policy::Drop)
+    , _cells(nullptr)
+    , _mask(0)
+    , _enqueue(0)
+    , _dequeue(0)
+    , _dropped(0)
+    , _running(false)
+    , _sleeping(false)
 {}
 /** Copy operator. **/
 Logger& Logger::operator= (Logger const&)
@@ -16,7 +16,22 @@
 #ifndef _LOG_H_
 #define _LOG_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <thread>
+
+/**
+ * Compile-time log level threshold (0: info, 1: warning, 2: error,
+ * 3: none). Calls below it are compiled out.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 0
+#endif
 
 namespace Log {
 /**
@@ -47,6 +62,16 @@ struct Type
      */
     const char* name() const;
 };
+/**
+ * Structured per-record event, emitted while a patch is applied.
+ */
+struct Event
+{
+    size_t   index;   /**< Record index. **/
+    uint32_t offset;  /**< Record offset. **/
+    uint16_t size;    /**< Record size. **/
+    bool     rle;     /**< RLE record. **/
+};
 /**
  * Log string output.
  */
@@ -64,9 +89,98 @@ class Output
          * @param [in] arg     Format arguments.
          */
         virtual void out(Type type, const char* format, va_list args);
+        /**
+         * Output structured event. By default the event is formatted
+         * as an information message.
+         * @param [in] event   Event.
+         */
+        virtual void event(Event const& event);
+};
+/**
+ * Log message argument, captured by value so that the message can be
+ * formatted later on the logger thread.
+ */
+struct Argument
+{
+    /** Argument kinds. **/
+    enum Kind
+    {
+        Signed,     /**< Signed integer. **/
+        Unsigned,   /**< Unsigned integer. **/
+        Real,       /**< Floating point value. **/
+        String,     /**< Nul terminated string. **/
+        Pointer     /**< Pointer. **/
+    };
+    Kind kind;  /**< Argument kind. **/
+    union
+    {
+        long long          i;
+        unsigned long long u;
+        double             d;
+        const char*        s;
+        const void*        p;
+    };
+    inline Argument()                     : kind(Signed)   { i = 0; }
+    inline Argument(int v)                : kind(Signed)   { i = v; }
+    inline Argument(long v)               : kind(Signed)   { i = v; }
+    inline Argument(long long v)          : kind(Signed)   { i = v; }
+    inline Argument(unsigned int v)       : kind(Unsigned) { u = v; }
+    inline Argument(unsigned long v)      : kind(Unsigned) { u = v; }
+    inline Argument(unsigned long long v) : kind(Unsigned) { u = v; }
+    inline Argument(double v)             : kind(Real)     { d = v; }
+    inline Argument(const char* v)        : kind(String)   { s = v; }
+    inline Argument(const void* v)        : kind(Pointer)  { p = v; }
+};
+/**
+ * Asynchronous log record. Strings are copied into the record.
+ */
+struct Record
+{
+    /** Maximum number of arguments. **/
+    static const size_t MaxArguments = 8;
+    /** Size of the string storage. **/
+    static const size_t StringsSize = 192;
+
+    Type        type;                       /**< Log type. **/
+    bool        isEvent;                    /**< Structured event record. **/
+    Event       event;                      /**< Structured event. **/
+    const char* format;                     /**< Format string (must be a literal). **/
+    size_t      count;                      /**< Argument count. **/
+    Argument    args[MaxArguments];         /**< Arguments. **/
+    char        strings[StringsSize];       /**< String arguments storage. **/
+    size_t      used;                       /**< Used string storage. **/
+
+    /** Default constructor. **/
+    Record();
+    /**
+     * Add argument. Extra arguments are ignored, strings are truncated.
+     */
+    void push(Argument const& arg);
+    /**
+     * Format record.
+     * @param [out] buffer  Output buffer.
+     * @param [in]  size    Output buffer size.
+     */
+    void print(char* buffer, size_t size) const;
+};
+/**
+ * Overflow policy of the asynchronous logger.
+ */
+struct Policy
+{
+    /** Policy values. **/
+    enum Value
+    {
+        Drop,   /**< Drop the record if the queue is full. **/
+        Block   /**< Wait until there is room in the queue. **/
+    };
 };
 /**
  * Logger (evil singleton).
+ * By default records are formatted and written on the caller thread.
+ * In asynchronous mode callers push compact records into a bounded
+ * lock-free multi-producer single-consumer queue and a background thread
+ * formats and outputs them.
  */
 class Logger
 {
@@ -79,7 +193,14 @@ class Logger
          */
         void begin(Output *out);
         /**
-         * Stop logger.
+         * Begin asynchronous logger.
+         * @param [in] out       Log output.
+         * @param [in] capacity  Queue capacity (rounded up to a power of 2).
+         * @param [in] policy    Overflow policy.
+         */
+        void beginAsync(Output *out, size_t capacity=4096, Policy::Value policy=Policy::Drop);
+        /**
+         * Stop logger. Pending records are flushed.
          */
         void end();
         /**
@@ -89,6 +210,49 @@ class Logger
          * @param [in] ...     Format parameters.
          */
         void out(Type type, const char* format, ...);
+        /**
+         * Log message. The record is queued in asynchronous mode.
+         * @param [in] type    Log type.
+         * @param [in] format  Format string.
+         * @param [in] args    Format parameters.
+         */
+        template <typename... Args>
+        void log(Type type, const char* format, Args... args)
+        {
+            if(_async.load())
+            {
+                Record record;
+                record.type = type;
+                record.format = format;
+                pushArguments(record, args...);
+                push(record);
+            }
+            else
+            {
+                out(type, format, args...);
+            }
+        }
+        /**
+         * Output structured event. The event is queued in asynchronous
+         * mode.
+         * @param [in] event   Event.
+         */
+        void event(Event const& event);
+        /**
+         * Set runtime log level threshold. Messages below it are
+         * discarded before their arguments are evaluated.
+         * @param [in] level   Minimum log type.
+         */
+        void setLevel(Type level);
+        /**
+         * Check if messages of the given type are output.
+         */
+        inline bool enabled(Type::Value type) const
+        {
+            return (nullptr != _output.load(std::memory_order_relaxed)) && (static_cast<int>(type) >= _level.load(std::memory_order_relaxed));
+        }
+        /** Number of records dropped since the logger started. **/
+        size_t dropped() const;
         /** Get logger instance. */
         static Logger& instance();
     private:
@@ -98,15 +262,57 @@ class Logger
         Logger(Logger const&);
         /** Copy operator. **/
         Logger& operator= (Logger const&);
+        /** Capture arguments. **/
+        static inline void pushArguments(Record&) {}
+        template <typename T, typename... Args>
+        static inline void pushArguments(Record& record, T value, Args... args)
+        {
+            record.push(Argument(value));
+            pushArguments(record, args...);
+        }
+        /** Queue record, unless the asynchronous logger is stopping. **/
+        void push(Record const& record);
+        /** Queue record. **/
+        void enqueue(Record const& record);
+        /** Dequeue record. **/
+        bool pop(Record& record);
+        /** Logger thread. **/
+        void run();
     private:
-        Output* _output;
+        /** Queue cell. **/
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            Record record;
+        };
+        std::atomic<Output*> _output;
+        std::atomic<int> _level;
+        std::mutex _outputMutex;
+        std::atomic<bool> _async;
+        /** Number of threads pushing a record, end() waits for them. **/
+        std::atomic<size_t> _producers;
+        Policy::Value _policy;
+        Cell* _cells;
+        size_t _mask;
+        std::atomic<size_t> _enqueue;
+        size_t _dequeue;
+        std::atomic<size_t> _dropped;
+        std::atomic<bool> _running;
+        std::atomic<bool> _sleeping;
+        std::mutex _wakeMutex;
+        std::condition_variable _wake;
+        std::thread _thread;
 };
 
 } // namespace Log
 
 
-#define Info(format, ...)    do { Log::Logger::instance().out(Log::Type::Info,    format, ##__VA_ARGS__); } while(0);
-#define Warning(format, ...) do { Log::Logger::instance().out(Log::Type::Warning, format, ##__VA_ARGS__); } while(0);
-#define Error(format, ...)   do { Log::Logger::instance().out(Log::Type::Error,   format, ##__VA_ARGS__); } while(0);
+#define LOG_CALL(t, format, ...) do { if((LOG_LEVEL <= Log::Type::t) && Log::Logger::instance().enabled(Log::Type::t)) { Log::Logger::instance().log(Log::Type::t, format, ##__VA_ARGS__); } } while(0)
+
+#define Info(format, ...)    LOG_CALL(Info,    format, ##__VA_ARGS__);
+#define Warning(format, ...) LOG_CALL(Warning, format, ##__VA_ARGS__);
+#define Error(format, ...)   LOG_CALL(Error,   format, ##__VA_ARGS__);
+
+#define LogRecord(i, o, s, r) do { if((LOG_LEVEL <= Log::Type::Info) && Log::Logger::instance().enabled(Log::Type::Info)) { Log::Event e = { (i), (o), static_cast<uint16_t>(s), (r) }; Log::Logger::instance().event(e); } } while(0);
 
 #endif /* _LOG_H_ */
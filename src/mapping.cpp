@@ -0,0 +1,295 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "mapping.h"
+
+namespace IPS {
+
+/** Default constructor. **/
+MappedFile::MappedFile()
+    : _data(nullptr)
+    , _size(0)
+{}
+/** Destructor. **/
+MappedFile::~MappedFile()
+{
+    close();
+}
+/**
+ * Map file into memory.
+ * @param [in] filename Filename.
+ * @return @b true on success.
+ */
+bool MappedFile::open(std::string const& filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        Error("Failed to open %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+    {
+        Error("Failed to stat %s: %s", filename.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    _size = static_cast<size_t>(st.st_size);
+    if(_size)
+    {
+        void *ptr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(MAP_FAILED == ptr)
+        {
+            Error("Failed to map %s: %s", filename.c_str(), strerror(errno));
+            ::close(fd);
+            _size = 0;
+            return false;
+        }
+        _data = static_cast<uint8_t*>(ptr);
+    }
+    ::close(fd);
+    return true;
+}
+/**
+ * Unmap file.
+ */
+void MappedFile::close()
+{
+    if(nullptr != _data)
+    {
+        munmap(_data, _size);
+    }
+    _data = nullptr;
+    _size = 0;
+}
+/** Mapped data (@b nullptr for empty files). **/
+const uint8_t* MappedFile::data() const
+{
+    return _data;
+}
+/** File size. **/
+size_t MappedFile::size() const
+{
+    return _size;
+}
+/**
+ * Drop the resident pages. They are read again from the file on the next
+ * access.
+ */
+void MappedFile::drop() const
+{
+    if(nullptr != _data)
+    {
+        madvise(_data, _size, MADV_DONTNEED);
+    }
+}
+/** Constructor. **/
+MappedFile::MappedFile(MappedFile const&)
+    : _data(nullptr)
+    , _size(0)
+{}
+/** Copy operator. **/
+MappedFile& MappedFile::operator= (MappedFile const&)
+{
+    return *this;
+}
+
+const size_t MappedWindow::DefaultBudget;
+
+/** Default constructor. **/
+MappedWindow::MappedWindow()
+    : _fd(-1)
+    , _filename()
+    , _size(0)
+    , _budget(0)
+    , _window(nullptr)
+    , _start(0)
+    , _length(0)
+    , _released(0)
+{}
+/** Destructor. **/
+MappedWindow::~MappedWindow()
+{
+    close();
+}
+/**
+ * Open file.
+ * @param [in] filename Filename.
+ * @param [in] budget   Maximum mapped size (rounded up to the page size).
+ * @return @b true on success.
+ */
+bool MappedWindow::open(std::string const& filename, size_t budget)
+{
+    close();
+
+    _fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(_fd < 0)
+    {
+        Error("Failed to open %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if(fstat(_fd, &st) < 0)
+    {
+        Error("Failed to stat %s: %s", filename.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    _filename = filename;
+    _size = static_cast<size_t>(st.st_size);
+    _budget = (budget + page - 1) & ~(page - 1);
+    if(0 == _budget)
+    {
+        _budget = page;
+    }
+    return true;
+}
+/**
+ * Unmap window and close file.
+ */
+void MappedWindow::close()
+{
+    unmap();
+    if(_fd >= 0)
+    {
+        ::close(_fd);
+    }
+    _fd = -1;
+    _filename.clear();
+    _size = 0;
+    _budget = 0;
+}
+/** File size. **/
+size_t MappedWindow::size() const
+{
+    return _size;
+}
+/** Maximum mapped size. **/
+size_t MappedWindow::budget() const
+{
+    return _budget;
+}
+/**
+ * Map a file range. The returned pointer stays valid until the next call
+ * to data() or close().
+ * @param [in] offset File offset.
+ * @param [in] length Range length (at least 1 and at most @b budget()
+ *                    bytes).
+ * @return @b nullptr if the range is empty, out of the file or too large,
+ *         or if the mapping failed.
+ */
+const uint8_t* MappedWindow::data(size_t offset, size_t length)
+{
+    if((_fd < 0) || (0 == length) || (offset >= _size) || (length > (_size - offset)))
+    {
+        return nullptr;
+    }
+    if((nullptr != _window) && (offset >= _start) && ((offset + length) <= (_start + _length)))
+    {
+        return _window + (offset - _start);
+    }
+
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = offset & ~(page - 1);
+    if((offset + length - start) > _budget)
+    {
+        return nullptr;
+    }
+    unmap();
+    size_t end = start + _budget;
+    if(end > _size)
+    {
+        end = _size;
+    }
+    void *ptr = mmap(nullptr, end - start, PROT_READ, MAP_PRIVATE, _fd, static_cast<off_t>(start));
+    if(MAP_FAILED == ptr)
+    {
+        Error("Failed to map %s: %s", _filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+    madvise(ptr, end - start, MADV_SEQUENTIAL);
+    _window = static_cast<uint8_t*>(ptr);
+    _start = start;
+    _length = end - start;
+    _released = start;
+    return _window + (offset - _start);
+}
+/**
+ * Drop the resident pages of the window below a file offset. They will
+ * not be accessed again.
+ * @param [in] offset File offset.
+ */
+void MappedWindow::release(size_t offset)
+{
+    if(nullptr == _window)
+    {
+        return;
+    }
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t end = offset & ~(page - 1);
+    if(end > (_start + _length))
+    {
+        end = _start + _length;
+    }
+    if(end > _released)
+    {
+        madvise(_window + (_released - _start), end - _released, MADV_DONTNEED);
+        _released = end;
+    }
+}
+/** Unmap current window. **/
+void MappedWindow::unmap()
+{
+    if(nullptr != _window)
+    {
+        madvise(_window, _length, MADV_DONTNEED);
+        munmap(_window, _length);
+    }
+    _window = nullptr;
+    _start = 0;
+    _length = 0;
+    _released = 0;
+}
+/** Constructor. **/
+MappedWindow::MappedWindow(MappedWindow const&)
+    : _fd(-1)
+    , _filename()
+    , _size(0)
+    , _budget(0)
+    , _window(nullptr)
+    , _start(0)
+    , _length(0)
+    , _released(0)
+{}
+/** Copy operator. **/
+MappedWindow& MappedWindow::operator= (MappedWindow const&)
+{
+    return *this;
+}
+
+} // namespace IPS
@@ -0,0 +1,145 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_MAPPING_H_
+#define _IPS_MAPPING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace IPS {
+
+/**
+ * Read-only memory mapped file.
+ */
+class MappedFile
+{
+    public:
+        /** Default constructor. **/
+        MappedFile();
+        /** Destructor. **/
+        ~MappedFile();
+        /**
+         * Map file into memory.
+         * @param [in] filename Filename.
+         * @return @b true on success.
+         */
+        bool open(std::string const& filename);
+        /**
+         * Unmap file.
+         */
+        void close();
+        /** Mapped data (@b nullptr for empty files). **/
+        const uint8_t* data() const;
+        /** File size. **/
+        size_t size() const;
+        /**
+         * Drop the resident pages. They are read again from the file on
+         * the next access.
+         */
+        void drop() const;
+
+    private:
+        /** Constructor. **/
+        MappedFile(MappedFile const&);
+        /** Copy operator. **/
+        MappedFile& operator= (MappedFile const&);
+
+    private:
+        /** Mapped data. **/
+        uint8_t* _data;
+        /** File size. **/
+        size_t _size;
+};
+
+/**
+ * Read-only sliding window over a file.
+ * At most @b budget bytes of the file are mapped at once. Moving the
+ * window releases the pages of the previous one, so that large files are
+ * scanned with a bounded resident set.
+ */
+class MappedWindow
+{
+    public:
+        /** Default window size. **/
+        static const size_t DefaultBudget = 64 * 1024 * 1024;
+
+    public:
+        /** Default constructor. **/
+        MappedWindow();
+        /** Destructor. **/
+        ~MappedWindow();
+        /**
+         * Open file.
+         * @param [in] filename Filename.
+         * @param [in] budget   Maximum mapped size (rounded up to the page
+         *                      size).
+         * @return @b true on success.
+         */
+        bool open(std::string const& filename, size_t budget=DefaultBudget);
+        /**
+         * Unmap window and close file.
+         */
+        void close();
+        /** File size. **/
+        size_t size() const;
+        /** Maximum mapped size. **/
+        size_t budget() const;
+        /**
+         * Map a file range. The returned pointer stays valid until the
+         * next call to data() or close().
+         * @param [in] offset File offset.
+         * @param [in] length Range length (at least 1 and at most
+         *                    @b budget() bytes).
+         * @return @b nullptr if the range is empty, out of the file or too
+         *         large, or if the mapping failed.
+         */
+        const uint8_t* data(size_t offset, size_t length);
+        /**
+         * Drop the resident pages of the window below a file offset. They
+         * will not be accessed again.
+         * @param [in] offset File offset.
+         */
+        void release(size_t offset);
+
+    private:
+        /** Unmap current window. **/
+        void unmap();
+
+    private:
+        MappedWindow(MappedWindow const&);
+        MappedWindow& operator= (MappedWindow const&);
+
+    private:
+        int _fd;
+        std::string _filename;
+        /** File size. **/
+        size_t _size;
+        /** Maximum mapped size. **/
+        size_t _budget;
+        /** Window start address. **/
+        uint8_t* _window;
+        /** Window file offset. **/
+        size_t _start;
+        /** Window size. **/
+        size_t _length;
+        /** Offset below which pages were dropped. **/
+        size_t _released;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_MAPPING_H_ */
@@ -0,0 +1,255 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstring>
+#include "plan.h"
+
+namespace IPS {
+
+const size_t ApplyPlan::HoleThreshold;
+const size_t ApplyPlan::MaxGap;
+const size_t ApplyPlan::Alignment;
+
+/** Constructor. **/
+ApplyPlan::ApplyPlan()
+    : _fill(false)
+    , _sourceSize(0)
+    , _outputSize(0)
+    , _extents()
+{}
+/**
+ * Check if an output range can be rendered without the records, i.e. if
+ * it is past the end of the source or if the source data is available.
+ */
+bool ApplyPlan::fillable(size_t from, size_t to) const
+{
+    return (from >= to) || _fill || (from >= _sourceSize);
+}
+/**
+ * Extend an extent to the alignment boundaries. The extent never grows
+ * over the previous extent, the next record or the end of the output.
+ * @param [in,out] extent      Extent.
+ * @param [in]     previousEnd End of the previous extents.
+ * @param [in]     nextStart   Offset of the next record.
+ * @param [in]     maxExtent   Maximum extent size.
+ */
+void ApplyPlan::close(Extent& extent, size_t previousEnd, size_t nextStart, size_t maxExtent)
+{
+    size_t start = extent.offset & ~(Alignment - 1);
+    if(start < previousEnd)
+    {
+        start = previousEnd;
+    }
+    size_t end = extent.offset + extent.size;
+    size_t alignedEnd = (end + Alignment - 1) & ~(Alignment - 1);
+    if(alignedEnd > nextStart)
+    {
+        alignedEnd = nextStart;
+    }
+    if(alignedEnd > _outputSize)
+    {
+        alignedEnd = _outputSize;
+    }
+    if((start < extent.offset) && fillable(start, extent.offset) && ((end - start) <= maxExtent))
+    {
+        extent.size += extent.offset - start;
+        extent.offset = start;
+    }
+    if((alignedEnd > end) && fillable(end, alignedEnd) && ((alignedEnd - extent.offset) <= maxExtent))
+    {
+        extent.size = alignedEnd - extent.offset;
+    }
+}
+/**
+ * Build the extents of a patch.
+ * @param [in] patch      IPS patch.
+ * @param [in] sourceSize Source size.
+ * @param [in] fill       If @b false, the source data is not available and
+ *                        gaps inside the source are never filled.
+ * @param [in] maxExtent  Maximum extent size.
+ */
+void ApplyPlan::build(Patch const& patch, size_t sourceSize, bool fill, size_t maxExtent)
+{
+    _fill = fill;
+    _sourceSize = sourceSize;
+    _outputSize = patch.outputSize();
+    if(_outputSize < sourceSize)
+    {
+        _outputSize = sourceSize;
+    }
+    _extents.clear();
+
+    const uint32_t *offsets = patch.offsets();
+    const uint16_t *sizes = patch.sizes();
+    const uint8_t *rle = patch.rle();
+    const uintptr_t *payloads = patch.payloads();
+    size_t n = patch.count();
+    // Leave room for the alignment.
+    size_t limit = (maxExtent > (4 * Alignment)) ? (maxExtent - (2 * Alignment)) : maxExtent;
+
+    size_t previousEnd = 0;
+    bool open = false;
+    Extent current;
+    for(size_t i=0; i<n; i++)
+    {
+        size_t start = offsets[i];
+        size_t end = start + sizes[i];
+        bool direct = (sizes[i] > limit);
+        if(rle[i])
+        {
+            direct = direct || ((0 == (payloads[i] & 0xff)) && (sizes[i] >= HoleThreshold));
+        }
+        else if(sizes[i] >= HoleThreshold)
+        {
+            size_t runStart, runEnd;
+            findZeroRun(reinterpret_cast<const uint8_t*>(payloads[i]), 0, sizes[i], runStart, runEnd);
+            direct = direct || (runStart < sizes[i]);
+        }
+
+        if(open)
+        {
+            size_t currentEnd = current.offset + current.size;
+            size_t last = (end > currentEnd) ? end : currentEnd;
+            if((false == direct) && (start >= current.offset) && ((last - current.offset) <= limit) &&
+               ((start <= currentEnd) || (((start - currentEnd) <= MaxGap) && fillable(currentEnd, start))))
+            {
+                current.size = last - current.offset;
+                current.count++;
+                continue;
+            }
+            close(current, previousEnd, start, maxExtent);
+            _extents.push_back(current);
+            previousEnd = current.offset + current.size;
+            open = false;
+        }
+
+        current.offset = start;
+        current.size = sizes[i];
+        current.first = i;
+        current.count = 1;
+        current.direct = direct;
+        current.flush = (start < previousEnd);
+        if(direct)
+        {
+            _extents.push_back(current);
+            if(previousEnd < end)
+            {
+                previousEnd = end;
+            }
+        }
+        else
+        {
+            open = true;
+        }
+    }
+    if(open)
+    {
+        close(current, previousEnd, _outputSize, maxExtent);
+        _extents.push_back(current);
+    }
+}
+/** Number of extents. **/
+size_t ApplyPlan::count() const
+{
+    return _extents.size();
+}
+/** Access the extent at the index @b i . **/
+Extent const& ApplyPlan::operator[] (size_t i) const
+{
+    return _extents[i];
+}
+/**
+ * Write the content of an extent: source data (or zeros past its end)
+ * overlaid with the records.
+ * @param [in]  extent Extent (not direct).
+ * @param [in]  patch  IPS patch.
+ * @param [in]  source Source data from @b extent.offset up to the end of the
+ *                     extent or of the source. Only read if the extent
+ *                     starts inside the source and the plan was built with
+ *                     @b fill set.
+ * @param [out] buffer Output buffer of at least @b extent.size bytes.
+ */
+void ApplyPlan::render(Extent const& extent, Patch const& patch, const uint8_t* source, uint8_t* buffer) const
+{
+    size_t start = extent.offset;
+    size_t end = start + extent.size;
+    if(start < _sourceSize)
+    {
+        // Without source data the records cover this part.
+        if(_fill)
+        {
+            memcpy(buffer, source, ((end < _sourceSize) ? end : _sourceSize) - start);
+        }
+    }
+    if(end > _sourceSize)
+    {
+        size_t from = (start > _sourceSize) ? start : _sourceSize;
+        memset(buffer + (from - start), 0, end - from);
+    }
+
+    const uint32_t *offsets = patch.offsets();
+    const uint16_t *sizes = patch.sizes();
+    const uint8_t *rle = patch.rle();
+    const uintptr_t *payloads = patch.payloads();
+    for(size_t i=extent.first; i<(extent.first + extent.count); i++)
+    {
+        if(rle[i])
+        {
+            memset(buffer + (offsets[i] - start), static_cast<uint8_t>(payloads[i]), sizes[i]);
+        }
+        else
+        {
+            memcpy(buffer + (offsets[i] - start), reinterpret_cast<const uint8_t*>(payloads[i]), sizes[i]);
+        }
+    }
+}
+/**
+ * Find the next zero run long enough to become a hole.
+ * @param [in]  data     Record data.
+ * @param [in]  from     Search start.
+ * @param [in]  size     Record size.
+ * @param [out] runStart Run start (@b size if there is none).
+ * @param [out] runEnd   Run end (@b size if there is none).
+ */
+void ApplyPlan::findZeroRun(const uint8_t* data, size_t from, size_t size, size_t& runStart, size_t& runEnd)
+{
+    runStart = runEnd = size;
+    if(size < HoleThreshold)
+    {
+        return;
+    }
+    for(size_t j=from; j<size; )
+    {
+        if(data[j])
+        {
+            j++;
+            continue;
+        }
+        size_t k = j;
+        while((k < size) && (0 == data[k]))
+        {
+            k++;
+        }
+        if((k - j) >= HoleThreshold)
+        {
+            runStart = j;
+            runEnd = k;
+            return;
+        }
+        j = k;
+    }
+}
+
+} // namespace IPS
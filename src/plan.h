@@ -0,0 +1,111 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_PLAN_H_
+#define _IPS_PLAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "ips.h"
+
+namespace IPS {
+
+/**
+ * Output range written at once.
+ */
+struct Extent
+{
+    size_t offset;  /**< Output offset. **/
+    size_t size;    /**< Extent size. **/
+    size_t first;   /**< Index of the first record. **/
+    size_t count;   /**< Number of records. **/
+    bool   direct;  /**< The record is written on its own so that its zero runs become holes. **/
+    bool   flush;   /**< The extent overlaps the previous one. **/
+};
+
+/**
+ * Apply planner.
+ * Contiguous and nearly contiguous records are merged into extents of at
+ * most @b MaxExtent bytes. Gaps between records and the bytes needed to
+ * align extents on @b Alignment are filled with the source data (or
+ * zeros past the end of the source).
+ * Records holding zero runs of at least @b HoleThreshold bytes get their
+ * own extents, flagged as direct.
+ */
+class ApplyPlan
+{
+    public:
+        /** Zero runs at least this long are stored as holes. **/
+        static const size_t HoleThreshold = 4096;
+        /** Largest gap filled from the source. **/
+        static const size_t MaxGap = 4096;
+        /** Extent boundaries alignment. **/
+        static const size_t Alignment = 4096;
+
+    public:
+        /** Constructor. **/
+        ApplyPlan();
+        /**
+         * Build the extents of a patch.
+         * @param [in] patch      IPS patch.
+         * @param [in] sourceSize Source size.
+         * @param [in] fill       If @b false, the source data is not
+         *                        available and gaps inside the source are
+         *                        never filled.
+         * @param [in] maxExtent  Maximum extent size.
+         */
+        void build(Patch const& patch, size_t sourceSize, bool fill, size_t maxExtent);
+        /** Number of extents. **/
+        size_t count() const;
+        /** Access the extent at the index @b i . **/
+        Extent const& operator[] (size_t i) const;
+        /**
+         * Write the content of an extent.
+         * @param [in]  extent Extent (not direct).
+         * @param [in]  patch  IPS patch.
+         * @param [in]  source Source data from @b extent.offset up to the end
+         *                     of the extent or of the source. Only read if
+         *                     the extent starts inside the source and the
+         *                     plan was built with @b fill set.
+         * @param [out] buffer Output buffer of at least @b extent.size bytes.
+         */
+        void render(Extent const& extent, Patch const& patch, const uint8_t* source, uint8_t* buffer) const;
+        /**
+         * Find the next zero run long enough to become a hole.
+         * @param [in]  data     Record data.
+         * @param [in]  from     Search start.
+         * @param [in]  size     Record size.
+         * @param [out] runStart Run start (@b size if there is none).
+         * @param [out] runEnd   Run end (@b size if there is none).
+         */
+        static void findZeroRun(const uint8_t* data, size_t from, size_t size, size_t& runStart, size_t& runEnd);
+
+    private:
+        bool fillable(size_t from, size_t to) const;
+        void close(Extent& extent, size_t previousEnd, size_t nextStart, size_t maxExtent);
+
+    private:
+        /** Gaps inside the source are filled. **/
+        bool _fill;
+        size_t _sourceSize;
+        /** Final output size. **/
+        size_t _outputSize;
+        std::vector<Extent> _extents;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_PLAN_H_ */
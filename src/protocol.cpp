@@ -0,0 +1,179 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+#include "protocol.h"
+
+namespace IPS {
+
+/** Maximum request size. **/
+static const uint32_t MaxRequestSize = 64 * 1024;
+
+/** Read exactly @b len bytes. **/
+static bool readAll(int fd, void* buffer, size_t len)
+{
+    uint8_t *ptr = static_cast<uint8_t*>(buffer);
+    while(len)
+    {
+        ssize_t n = recv(fd, ptr, len, 0);
+        if(n <= 0)
+        {
+            if((n < 0) && (EINTR == errno))
+            {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+/** Write exactly @b len bytes. **/
+static bool writeAll(int fd, const void* buffer, size_t len)
+{
+    const uint8_t *ptr = static_cast<const uint8_t*>(buffer);
+    while(len)
+    {
+        ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Connect to the patch daemon.
+ * @param [in] path Unix domain socket path.
+ * @return Socket or -1 on error.
+ */
+int connect(std::string const& path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+    {
+        Error("Socket path is too long: %s", path.c_str());
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        Error("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    if(::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        Error("Failed to connect to %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+/**
+ * Read a request.
+ * @return @b false on error or if the peer closed the connection.
+ */
+bool readRequest(int fd, Request& request)
+{
+    uint32_t len;
+    if(false == readAll(fd, &len, sizeof(len)))
+    {
+        return false;
+    }
+    if((0 == len) || (len > MaxRequestSize))
+    {
+        Error("Invalid request size: %u", len);
+        return false;
+    }
+    std::vector<char> buffer(len);
+    if(false == readAll(fd, &buffer[0], len))
+    {
+        return false;
+    }
+    if(0 != buffer[len-1])
+    {
+        Error("Malformed request");
+        return false;
+    }
+    request.command = &buffer[0];
+    request.args.clear();
+    for(size_t i=request.command.size()+1; i<len; )
+    {
+        request.args.push_back(&buffer[i]);
+        i += request.args.back().size() + 1;
+    }
+    return true;
+}
+/**
+ * Send a request.
+ */
+bool writeRequest(int fd, Request const& request)
+{
+    std::string buffer(4, '\0');
+    buffer.append(request.command.c_str(), request.command.size()+1);
+    for(size_t i=0; i<request.args.size(); i++)
+    {
+        buffer.append(request.args[i].c_str(), request.args[i].size()+1);
+    }
+    if((buffer.size() - 4) > MaxRequestSize)
+    {
+        Error("Request is too large");
+        return false;
+    }
+    uint32_t len = static_cast<uint32_t>(buffer.size() - 4);
+    memcpy(&buffer[0], &len, sizeof(len));
+    return writeAll(fd, buffer.data(), buffer.size());
+}
+/**
+ * Read a response.
+ */
+bool readResponse(int fd, Result& result)
+{
+    int32_t value;
+    if(false == readAll(fd, &value, sizeof(value)))
+    {
+        return false;
+    }
+    result = static_cast<Result>(value);
+    return true;
+}
+/**
+ * Send a response.
+ */
+bool writeResponse(int fd, Result result)
+{
+    int32_t value = static_cast<int32_t>(result);
+    return writeAll(fd, &value, sizeof(value));
+}
+
+} // namespace IPS
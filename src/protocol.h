@@ -0,0 +1,69 @@
+/*
+ * IPS Patcher
+ * 
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_PROTOCOL_H_
+#define _IPS_PROTOCOL_H_
+
+#include <string>
+#include <vector>
+#include "ips.h"
+
+namespace IPS {
+
+/**
+ * Patch daemon request.
+ * On the wire a request is a 32 bits length followed by the command and
+ * its arguments as nul terminated strings. The response is the 32 bits
+ * result code. Both use the host byte order as they never leave the
+ * machine.
+ *
+ * Supported requests:
+ *  - apply source patch destination [crc32]
+ *  - validate patch
+ *  - diff source target patch
+ */
+struct Request
+{
+    std::string command;            /**< Command name. **/
+    std::vector<std::string> args;  /**< Command arguments. **/
+};
+
+/**
+ * Connect to the patch daemon.
+ * @param [in] path Unix domain socket path.
+ * @return Socket or -1 on error.
+ */
+int connect(std::string const& path);
+/**
+ * Read a request.
+ * @return @b false on error or if the peer closed the connection.
+ */
+bool readRequest(int fd, Request& request);
+/**
+ * Send a request.
+ */
+bool writeRequest(int fd, Request const& request);
+/**
+ * Read a response.
+ */
+bool readResponse(int fd, Result& result);
+/**
+ * Send a response.
+ */
+bool writeResponse(int fd, Result result);
+
+} // namespace IPS
+
+#endif /* _IPS_PROTOCOL_H_ */
@@ -0,0 +1,190 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cstring>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+namespace IPS {
+
+/** Counters read from /proc/self/io. **/
+static const char* ioNames[6] =
+{
+    "rchar", "wchar", "syscr", "syscw", "read_bytes", "write_bytes"
+};
+
+/**
+ * Read process I/O counters.
+ * They are left to 0 if /proc/self/io is not available.
+ */
+static void readIoCounters(uint64_t counters[6])
+{
+    memset(counters, 0, 6 * sizeof(uint64_t));
+    FILE *stream = fopen("/proc/self/io", "r");
+    if(nullptr == stream)
+    {
+        return;
+    }
+    char name[32];
+    unsigned long long value;
+    while(2 == fscanf(stream, "%31[^:]: %llu\n", name, &value))
+    {
+        for(int i=0; i<6; i++)
+        {
+            if(0 == strcmp(name, ioNames[i]))
+            {
+                counters[i] = value;
+            }
+        }
+    }
+    fclose(stream);
+}
+
+/** Read a clock in nanoseconds. **/
+static uint64_t now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Phase name.
+ */
+const char* Phase::name(Value v)
+{
+    static const char* names[Phase::Count] =
+    {
+        "open", "header_footer", "parse", "sort_overlap", "copy", "apply", "flush"
+    };
+    return (v < Phase::Count) ? names[v] : "unknown";
+}
+
+/** Constructor. **/
+Stats::Stats()
+    : _enabled(false)
+    , _dataRecords(0)
+    , _rleRecords(0)
+    , _bytesRead(0)
+    , _bytesWritten(0)
+    , _start(0)
+{
+    for(int i=0; i<Phase::Count; i++)
+    {
+        _wall[i] = 0;
+        _cpu[i] = 0;
+        _calls[i] = 0;
+    }
+    memset(_io, 0, sizeof(_io));
+}
+/** Get stats instance. **/
+Stats& Stats::instance()
+{
+    static Stats stats;
+    return stats;
+}
+/** Start collecting. Process I/O counters are sampled here. **/
+void Stats::enable()
+{
+    readIoCounters(_io);
+    _start = now(CLOCK_MONOTONIC);
+    _enabled = true;
+}
+/**
+ * Account for a phase run.
+ * @param [in] phase Phase.
+ * @param [in] wall  Wall time in nanoseconds.
+ * @param [in] cpu   Thread CPU time in nanoseconds.
+ */
+void Stats::add(Phase::Value phase, uint64_t wall, uint64_t cpu)
+{
+    _wall[phase] += wall;
+    _cpu[phase] += cpu;
+    _calls[phase]++;
+}
+/**
+ * Print stats as a JSON object.
+ * Record insertion runs inside the parse loop, so its time is
+ * subtracted from the parse phase.
+ * @param [in] stream Output stream.
+ */
+void Stats::print(FILE* stream) const
+{
+    uint64_t io[6];
+    readIoCounters(io);
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+
+    uint64_t wall[Phase::Count], cpu[Phase::Count];
+    for(int i=0; i<Phase::Count; i++)
+    {
+        wall[i] = _wall[i];
+        cpu[i] = _cpu[i];
+    }
+    wall[Phase::Parse] -= (wall[Phase::Sort] < wall[Phase::Parse]) ? wall[Phase::Sort] : wall[Phase::Parse];
+    cpu[Phase::Parse]  -= (cpu[Phase::Sort]  < cpu[Phase::Parse])  ? cpu[Phase::Sort]  : cpu[Phase::Parse];
+
+    fprintf(stream, "{\n  \"phases\": {\n");
+    for(int i=0; i<Phase::Count; i++)
+    {
+        fprintf(stream, "    \"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"calls\": %llu }%s\n",
+                Phase::name(static_cast<Phase::Value>(i)),
+                wall[i] / 1e6, cpu[i] / 1e6, static_cast<unsigned long long>(_calls[i].load()),
+                (i < (Phase::Count-1)) ? "," : "");
+    }
+    fprintf(stream, "  },\n");
+    fprintf(stream, "  \"total_wall_ms\": %.3f,\n", (now(CLOCK_MONOTONIC) - _start) / 1e6);
+    fprintf(stream, "  \"user_cpu_ms\": %.3f,\n", usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3);
+    fprintf(stream, "  \"system_cpu_ms\": %.3f,\n", usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3);
+    fprintf(stream, "  \"records\": { \"data\": %llu, \"rle\": %llu },\n",
+            static_cast<unsigned long long>(_dataRecords.load()), static_cast<unsigned long long>(_rleRecords.load()));
+    fprintf(stream, "  \"bytes_read\": %llu,\n", static_cast<unsigned long long>(_bytesRead.load()));
+    fprintf(stream, "  \"bytes_written\": %llu,\n", static_cast<unsigned long long>(_bytesWritten.load()));
+    fprintf(stream, "  \"syscalls\": { \"read\": %llu, \"write\": %llu },\n",
+            static_cast<unsigned long long>(io[2] - _io[2]), static_cast<unsigned long long>(io[3] - _io[3]));
+    fprintf(stream, "  \"process_io\": { \"rchar\": %llu, \"wchar\": %llu, \"read_bytes\": %llu, \"write_bytes\": %llu },\n",
+            static_cast<unsigned long long>(io[0] - _io[0]), static_cast<unsigned long long>(io[1] - _io[1]),
+            static_cast<unsigned long long>(io[4] - _io[4]), static_cast<unsigned long long>(io[5] - _io[5]));
+    fprintf(stream, "  \"page_faults\": { \"minor\": %ld, \"major\": %ld },\n", usage.ru_minflt, usage.ru_majflt);
+    fprintf(stream, "  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+}
+
+/** Start timing a phase. **/
+PhaseTimer::PhaseTimer(Phase::Value phase)
+    : _phase(phase)
+    , _enabled(Stats::instance().enabled())
+    , _wall(0)
+    , _cpu(0)
+{
+    if(_enabled)
+    {
+        _wall = now(CLOCK_MONOTONIC);
+        _cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+/** Stop timing and account for the phase. **/
+PhaseTimer::~PhaseTimer()
+{
+    if(_enabled)
+    {
+        uint64_t cpu = now(CLOCK_THREAD_CPUTIME_ID) - _cpu;
+        uint64_t wall = now(CLOCK_MONOTONIC) - _wall;
+        Stats::instance().add(_phase, wall, cpu);
+    }
+}
+
+} // namespace IPS
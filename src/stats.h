@@ -0,0 +1,131 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_STATS_H_
+#define _IPS_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+namespace IPS {
+/**
+ * Instrumented phases.
+ */
+struct Phase
+{
+    /** Phase values. **/
+    enum Value
+    {
+        Open = 0,   /**< Patch file open and mapping. **/
+        Header,     /**< Header and footer checks. **/
+        Parse,      /**< Record parsing. **/
+        Sort,       /**< Record insertion and overlap checks. **/
+        Copy,       /**< Source copy. **/
+        Apply,      /**< Record writes. **/
+        Flush,      /**< Output flush and close. **/
+        Count
+    };
+    /**
+     * Phase name.
+     */
+    static const char* name(Value v);
+};
+/**
+ * Per-phase timings and I/O counters.
+ * Collection is disabled by default and costs a single test per probe
+ * until enable() is called.
+ */
+class Stats
+{
+    public:
+        /** Get stats instance. **/
+        static Stats& instance();
+        /** Start collecting. Process I/O counters are sampled here. **/
+        void enable();
+        /** Check if stats are collected. **/
+        inline bool enabled() const { return _enabled; }
+        /**
+         * Account for a phase run.
+         * @param [in] phase Phase.
+         * @param [in] wall  Wall time in nanoseconds.
+         * @param [in] cpu   Thread CPU time in nanoseconds.
+         */
+        void add(Phase::Value phase, uint64_t wall, uint64_t cpu);
+        /** Account for a parsed record. **/
+        inline void record(bool rle)
+        {
+            if(_enabled) { (rle ? _rleRecords : _dataRecords)++; }
+        }
+        /** Account for parsed records. **/
+        inline void records(size_t data, size_t rle)
+        {
+            if(_enabled) { _dataRecords += data; _rleRecords += rle; }
+        }
+        /** Account for bytes read. **/
+        inline void read(size_t bytes)
+        {
+            if(_enabled) { _bytesRead += bytes; }
+        }
+        /** Account for bytes written. **/
+        inline void written(size_t bytes)
+        {
+            if(_enabled) { _bytesWritten += bytes; }
+        }
+        /**
+         * Print stats as a JSON object.
+         * @param [in] stream Output stream.
+         */
+        void print(FILE* stream) const;
+
+    private:
+        Stats();
+        Stats(Stats const&);
+        Stats& operator=(Stats const&);
+
+    private:
+        bool _enabled;
+        std::atomic<uint64_t> _wall[Phase::Count];
+        std::atomic<uint64_t> _cpu[Phase::Count];
+        std::atomic<uint64_t> _calls[Phase::Count];
+        std::atomic<uint64_t> _dataRecords;
+        std::atomic<uint64_t> _rleRecords;
+        std::atomic<uint64_t> _bytesRead;
+        std::atomic<uint64_t> _bytesWritten;
+        /** Process I/O counters when collection started. **/
+        uint64_t _io[6];
+        /** Wall clock origin (nanoseconds). **/
+        uint64_t _start;
+};
+/**
+ * Scoped phase timer.
+ */
+class PhaseTimer
+{
+    public:
+        /** Start timing a phase. **/
+        PhaseTimer(Phase::Value phase);
+        /** Stop timing and account for the phase. **/
+        ~PhaseTimer();
+    private:
+        Phase::Value _phase;
+        bool _enabled;
+        uint64_t _wall;
+        uint64_t _cpu;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_STATS_H_ */
@@ -13,61 +13,277 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library.
  */
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "log.h"
+#include "backend.h"
+#include "io.h"
+#include "mapping.h"
+#include "plan.h"
+#include "stats.h"
+#include "writer.h"
 #include "utils.h"
 
 namespace IPS {
 
+/**
+ * CRC32 lookup table.
+ */
+struct CRC32Table
+{
+    uint32_t value[256];
+    CRC32Table()
+    {
+        for(uint32_t i=0; i<256; i++)
+        {
+            uint32_t c = i;
+            for(int j=0; j<8; j++)
+            {
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            }
+            value[i] = c;
+        }
+    }
+};
+
+/**
+ * Compute the CRC32 (IEEE 802.3) of a memory block.
+ * @param [in] data  Data buffer.
+ * @param [in] len   Data size.
+ * @param [in] crc   CRC of the previous blocks (0 for the first one).
+ * @return Updated CRC.
+ */
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc)
+{
+    static const CRC32Table table;
+    crc = ~crc;
+    for(size_t i=0; i<len; i++)
+    {
+        crc = table.value[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * Compute a 64 bits non-cryptographic hash of a memory block.
+ * This is MurmurHash64A, which processes 8 bytes per step.
+ * @param [in] data  Data buffer.
+ * @param [in] len   Data size.
+ * @return Hash value.
+ */
+uint64_t hash64(const uint8_t* data, size_t len)
+{
+    static const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    static const int r = 47;
+    uint64_t h = 0x9747b28c ^ (len * m);
+
+    size_t i;
+    for(i=0; (i+8)<=len; i+=8)
+    {
+        uint64_t k;
+        memcpy(&k, data+i, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if(i < len)
+    {
+        uint64_t k = 0;
+        for(size_t j=len; j>i; j--)
+        {
+            k = (k << 8) | data[j-1];
+        }
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/** Default constructor. **/
+ApplyOptions::ApplyOptions()
+    : verbose(false)
+    , checkCrc(false)
+    , expectedCrc(0)
+    , progress()
+    , progressInterval(50)
+    , cancel(nullptr)
+    , logErrors(true)
+    , batched(true)
+    , fused(false)
+    , memoryBudget(MappedWindow::DefaultBudget)
+    , backend(Backend::Auto)
+{}
+
+/**
+ * Throttled progress notification and cancellation check.
+ */
+class ProgressTracker
+{
+    public:
+        ProgressTracker(ApplyOptions const& options, size_t totalBytes, size_t totalRecords)
+            : _options(options)
+            , _last()
+        {
+            _progress.bytes = 0;
+            _progress.totalBytes = totalBytes;
+            _progress.records = 0;
+            _progress.totalRecords = totalRecords;
+        }
+        /**
+         * Account for written bytes and applied records.
+         * @return @b false if apply was cancelled.
+         */
+        bool step(size_t bytes, size_t records)
+        {
+            _progress.bytes += bytes;
+            _progress.records += records;
+            if(_options.progress)
+            {
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if((now - _last) >= std::chrono::milliseconds(_options.progressInterval))
+                {
+                    _last = now;
+                    _options.progress(_progress);
+                }
+            }
+            return !cancelled();
+        }
+        /** Send the final notification. **/
+        void finish()
+        {
+            if(_options.progress)
+            {
+                _options.progress(_progress);
+            }
+        }
+        /** Check if apply was cancelled. **/
+        bool cancelled() const
+        {
+            return (nullptr != _options.cancel) && _options.cancel->load();
+        }
+    private:
+        ApplyOptions const& _options;
+        Progress _progress;
+        std::chrono::steady_clock::time_point _last;
+};
+
+/**
+ * Log a failed operation.
+ * @param [in] status   Operation status.
+ * @param [in] filename File the failure relates to.
+ * @param [in] log      Log the failure.
+ * @return @b status.
+ */
+static Status report(Status const& status, const char* filename, bool log)
+{
+    if(log && !status)
+    {
+        if(Status::NoRecord == status.record)
+        {
+            Error("%s: %s at offset %zx%s%s", filename, status.message(), status.offset,
+                  status.error ? ": " : "", status.error ? strerror(status.error) : "");
+        }
+        else
+        {
+            Error("%s: %s at offset %zx (record #%zu)%s%s", filename, status.message(), status.offset, status.record,
+                  status.error ? ": " : "", status.error ? strerror(status.error) : "");
+        }
+    }
+    return status;
+}
+
 /**
  * Create a copy of the source file.
- * @param [in] sourceFilename Source filename.
- * @param [in] destFilename   Destination filename.
+ * @param [in]  sourceFilename Source filename.
+ * @param [in]  destFilename   Destination filename.
+ * @param [out] crc            If not @b nullptr, CRC32 of the source file.
+ * @param [in]  tracker        If not @b nullptr, progress tracker.
+ * @param [out] status         Copy status. Read failures are reported with
+ *                             the @b IPS_ERROR_READ code.
  * @return File descriptor pointing to the beginnig of the destination
  *         file or @b nullptr if something went wrong.
  */
-FILE* copyFile(std::string const& sourceFilename, std::string const& destFilename)
+static FILE* copyFileImpl(std::string const& sourceFilename, std::string const& destFilename, uint32_t* crc, ProgressTracker* tracker, Status& status)
 {
+    PhaseTimer timer(Phase::Copy);
     FILE *input;
     FILE *output;
     
+    status = Status();
     input = fopen(sourceFilename.c_str(), "rb");
     if(nullptr == input)
     {
-        Error("Failed to open %s : %s", sourceFilename.c_str(), strerror(errno));
+        status = Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno);
         return nullptr;
     }
+    posix_fadvise(fileno(input), 0, 0, POSIX_FADV_SEQUENTIAL);
 
     output = fopen(destFilename.c_str(), "wb");
     if(nullptr == output)
     {
-        Error("Failed to open %s : %s", destFilename.c_str(), strerror(errno));
+        status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
     }
     else
     {
+        static const size_t bufferSize = 64 * 1024;
+        uint8_t *buffer = new uint8_t[bufferSize];
         size_t n;
+        size_t copied = 0;
         bool ret = true;
     
+        if(nullptr != crc)
+        {
+            *crc = 0;
+        }
         while(!feof(input) && ret)
         {
-            uint8_t byte;
-            n = fread(&byte, 1, 1, input);
-            if(1 == n)
+            n = fread(buffer, 1, bufferSize, input);
+            if(n)
             {
-                n = fwrite(&byte, 1, 1, output);
-                if(1 != n)
+                if(nullptr != crc)
+                {
+                    *crc = crc32(buffer, n, *crc);
+                }
+                if(n != fwrite(buffer, 1, n, output))
                 {
-                    Error("Failed to write data to %s : %s", destFilename.c_str(), strerror(errno));
+                    status = Status(IPS_ERROR_WRITE, copied, Status::NoRecord, errno);
                     ret = false;
                 }
+                copied += n;
+                Stats::instance().read(n);
+                Stats::instance().written(n);
             }
-            else if(!feof(input))
+            if(ret && ferror(input))
             {
-                Error("Failed to read data from %s: %s", sourceFilename.c_str(), strerror(errno));
+                status = Status(IPS_ERROR_READ, copied, Status::NoRecord, errno);
                 ret = false;
             }
+            if(ret && (nullptr != tracker))
+            {
+                ret = tracker->step(n, 0);
+                if(false == ret)
+                {
+                    status = Status(IPS_ERROR, copied);
+                }
+            }
         }
+        delete [] buffer;
         fseek(output, 0, SEEK_SET);
         
         if(false == ret)
@@ -82,92 +298,2461 @@ FILE* copyFile(std::string const& sourceFilename, std::string const& destFilenam
 }
 
 /**
- * Apply patch to input file and write output to another file.
- * @param [in] in      Input filename.
- * @param [in] out     Output filename.
- * @param [in] patch   IPS patch.
- * @param [in] verbose Output informations. 
+ * Create a copy of the source file.
+ * @param [in]  sourceFilename Source filename.
+ * @param [in]  destFilename   Destination filename.
+ * @param [out] crc            If not @b nullptr, CRC32 of the source file.
+ * @return File descriptor pointing to the beginnig of the destination
+ *         file or @b nullptr if something went wrong.
  */
-bool apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose)
+FILE* copyFile(std::string const& sourceFilename, std::string const& destFilename, uint32_t* crc)
 {
-    FILE *output;
-    output = IPS::copyFile(in, out);    
-    if(nullptr == output)
+    Status status;
+    FILE *output = copyFileImpl(sourceFilename, destFilename, crc, nullptr, status);
+    report(status, ((IPS_ERROR_OPEN == status.result) || (IPS_ERROR_READ == status.result)) ? sourceFilename.c_str() : destFilename.c_str(), true);
+    return output;
+}
+
+/** Zero runs at least this long are stored as holes. **/
+static const size_t HoleThreshold = ApplyPlan::HoleThreshold;
+
+/**
+ * Write a byte repeatedly at the current position.
+ * @param [in] output Output file.
+ * @param [in] byte   Byte value.
+ * @param [in] size   Number of bytes.
+ * @return Number of bytes written.
+ */
+static size_t writeFill(FILE* output, uint8_t byte, size_t size)
+{
+    uint8_t buffer[HoleThreshold];
+    memset(buffer, byte, (size < sizeof(buffer)) ? size : sizeof(buffer));
+    size_t written = 0;
+    while(written < size)
+    {
+        size_t n = size - written;
+        if(n > sizeof(buffer))
+        {
+            n = sizeof(buffer);
+        }
+        n = fwrite(buffer, 1, n, output);
+        written += n;
+        if(0 == n)
+        {
+            break;
+        }
+    }
+    return written;
+}
+
+/**
+ * Zero an output range without writing data.
+ * The part of the range inside the file is deallocated and the file is
+ * extended to cover the rest, so that the filesystem stores holes.
+ * @param [in]     fd           Output file descriptor.
+ * @param [in]     offset       Range offset.
+ * @param [in]     size         Range size.
+ * @param [in,out] outputLength Output length.
+ * @return @b false if the filesystem does not support it.
+ */
+static bool punchHole(int fd, size_t offset, size_t size, size_t& outputLength)
+{
+    size_t end = offset + size;
+    if(offset < outputLength)
     {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        size_t last = (end < outputLength) ? end : outputLength;
+        if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, last - offset) < 0)
+        {
+            return false;
+        }
+#else
         return false;
+#endif
     }
-    
+    if(end > outputLength)
+    {
+        if(ftruncate(fd, end) < 0)
+        {
+            return false;
+        }
+        outputLength = end;
+    }
+    return true;
+}
+
+/**
+ * Output size while the records are written: large enough for the source
+ * data, the records and the final size, so that writes never grow the
+ * output. The output is trimmed to the final size once written.
+ * @param [in] sourceSize  Source size.
+ * @param [in] recordsEnd  Output size needed by the records.
+ * @param [in] finalSize   Final output size.
+ */
+static size_t workingSize(size_t sourceSize, size_t recordsEnd, size_t finalSize)
+{
+    size_t size = (sourceSize > recordsEnd) ? sourceSize : recordsEnd;
+    return (size > finalSize) ? size : finalSize;
+}
+
+/**
+ * Size the output before anything is written to it. The blocks of the
+ * range written in full (the source copy) are allocated at once, the rest
+ * of the output is left as a hole until written.
+ * @param [in] fd    Output file descriptor.
+ * @param [in] dense Size of the range written in full.
+ * @param [in] size  Output size.
+ * @return @b false if the output could not be resized.
+ */
+static bool preallocate(int fd, size_t dense, size_t size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    // Best effort, the filesystem may not support it.
+    if(dense && (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, dense) < 0) && (EOPNOTSUPP != errno))
+    {
+        Warning("Failed to preallocate output: %s", strerror(errno));
+    }
+#endif
+    return (0 == ftruncate(fd, size));
+}
+
+/**
+ * Write zeros, as holes when possible.
+ * @param [in]     output       Output file.
+ * @param [in]     offset       Output offset.
+ * @param [in]     size         Number of bytes.
+ * @param [in,out] outputLength Output length.
+ * @param [out]    failed       Offset of the failure.
+ */
+static bool writeZeros(FILE* output, size_t offset, size_t size, size_t& outputLength, size_t& failed)
+{
+    if((0 == fflush(output)) && punchHole(fileno(output), offset, size, outputLength))
+    {
+        return true;
+    }
+    fseek(output, offset, SEEK_SET);
+    size_t n = writeFill(output, 0, size);
+    if(outputLength < (offset + n))
+    {
+        outputLength = offset + n;
+    }
+    failed = offset + n;
+    return (n == size);
+}
+
+/**
+ * Write record data. Zero runs of at least @b HoleThreshold bytes are
+ * written as holes.
+ * @param [in]     output       Output file.
+ * @param [in]     offset       Output offset.
+ * @param [in]     data         Record data.
+ * @param [in]     size         Record size.
+ * @param [in,out] outputLength Output length.
+ * @param [out]    failed       Offset of the failure.
+ */
+static bool writeData(FILE* output, size_t offset, const uint8_t* data, size_t size, size_t& outputLength, size_t& failed)
+{
+    for(size_t i=0; i<size; )
+    {
+        size_t runStart, runEnd;
+        ApplyPlan::findZeroRun(data, i, size, runStart, runEnd);
+        if(runStart > i)
+        {
+            fseek(output, offset + i, SEEK_SET);
+            size_t n = fwrite(data + i, 1, runStart - i, output);
+            if(outputLength < (offset + i + n))
+            {
+                outputLength = offset + i + n;
+            }
+            if((runStart - i) != n)
+            {
+                failed = offset + i + n;
+                return false;
+            }
+        }
+        if((runStart < size) && (false == writeZeros(output, offset + runStart, runEnd - runStart, outputLength, failed)))
+        {
+            return false;
+        }
+        i = runEnd;
+    }
+    return true;
+}
+
+/**
+ * Write patch records to an output file already holding the source data.
+ * Growth past the end of the output and long zero runs are stored as
+ * holes when the filesystem supports it.
+ * @param [in] output  Output file.
+ * @param [in] patch   IPS patch.
+ * @param [in] verbose Output informations. 
+ * @param [in] tracker If not @b nullptr, progress tracker.
+ * @return Apply status. The offset is the output offset of the failure.
+ */
+static Status applyRecords(FILE* output, IPS::Patch const& patch, bool verbose, ProgressTracker* tracker)
+{
+    PhaseTimer timer(Phase::Apply);
+    Stats& stats = Stats::instance();
     // Get output length.
     size_t outputLength;
     fseek(output, 0, SEEK_END);
     outputLength  = ftell(output);
     fseek(output, 0, SEEK_SET);
     outputLength -= ftell(output);
-    
+
+    // The output gets its final size before the records are written.
+    size_t finalSize = patch.finalSize(outputLength);
+    size_t size = workingSize(outputLength, patch.outputSize(), finalSize);
+    if((0 != fflush(output)) || (false == preallocate(fileno(output), 0, size)))
+    {
+        return Status(IPS_ERROR_WRITE, outputLength, Status::NoRecord, errno);
+    }
+    outputLength = size;
+
     // Write records.
-    size_t n;
     bool ret = true;
+    Status status;
     for(size_t i=0; ret && (i<patch.count()); i++)
     {
         IPS::Record const& record = patch[i];
+        size_t failed = record.offset;
         if(verbose)
         {
-            Info("Applying record: %5d    offset: %08x    size: %5d    rle: %s",
-                 i, record.offset, record.size, record.rle ? "yes" : "no");
+            LogRecord(i, record.offset, record.size, record.rle);
         }
         
         // If the offset is beyond output, fill with empty byte.
         if(outputLength < record.offset)
         {
-            while(ret && (outputLength < record.offset))
+            size_t filled = record.offset - outputLength;
+            ret = writeZeros(output, outputLength, filled, outputLength, failed);
+            stats.written(filled);
+            if(verbose)
+            {
+                Info("Applying record: filled %zu bytes", filled);
+            }
+        }
+        
+        if(ret)
+        {
+            if(record.rle && (0 == record.data) && (record.size >= HoleThreshold))
+            {
+                ret = writeZeros(output, record.offset, record.size, outputLength, failed);
+            }
+            else if(record.rle)
             {
-                uint8_t byte = 0x00;
-                n = fwrite(&byte, 1, 1, output);
-                if(1 != n)
+                fseek(output, record.offset, SEEK_SET);
+                size_t n = writeFill(output, static_cast<uint8_t>(record.data), record.size);
+                if(outputLength < (record.offset + n))
                 {
-                    Error("Failed to write record #%d: %s", i, strerror(errno));
-                    ret = false;
+                    outputLength = record.offset + n;
                 }
-                outputLength += n;
+                failed = record.offset + n;
+                ret = (record.size == n);
             }
-            if(verbose)
+            else
             {
-                Info("Applying record: filled %d bytes", record.offset - outputLength);
+                ret = writeData(output, record.offset, reinterpret_cast<const uint8_t*>(record.data), record.size, outputLength, failed);
             }
-            outputLength += record.size;
         }
-        else
+        if(false == ret)
         {
-            fseek(output, record.offset, SEEK_SET);
+            status = Status(IPS_ERROR_WRITE, failed, i, errno);
+            break;
         }
-        
-        if(record.rle)
+        stats.written(record.size);
+        if(nullptr != tracker)
         {
-            uint8_t byte = static_cast<uint8_t>(record.data);
-            for(size_t j=0; ret && (j<record.size); j++)
+            ret = tracker->step(record.size, 1);
+            if(false == ret)
             {
-                n = fwrite(&byte, 1, 1, output);
-                if(1 != n)
-                {
-                    Error("Failed to write record #%d: %s", i, strerror(errno));
-                    ret = false;
-                }
+                status = Status(IPS_ERROR, record.offset, i);
             }
         }
-        else
+    }
+    if(status && (finalSize != size) && ((0 != fflush(output)) || (ftruncate(fileno(output), finalSize) < 0)))
+    {
+        status = Status(IPS_ERROR_WRITE, finalSize, Status::NoRecord, errno);
+    }
+    return status;
+}
+
+/**
+ * Queue zeros, as holes when possible. Pending writes are flushed first
+ * as they may cover the range.
+ * @param [in]     writer       Batched writer.
+ * @param [in]     fd           Output file descriptor.
+ * @param [in]     offset       Output offset.
+ * @param [in]     size         Number of bytes.
+ * @param [in,out] outputLength Output length.
+ */
+static bool queueZeros(BatchWriter& writer, int fd, size_t offset, size_t size, size_t& outputLength)
+{
+    if(false == writer.flush())
+    {
+        return false;
+    }
+    if(punchHole(fd, offset, size, outputLength))
+    {
+        return true;
+    }
+    if(outputLength < (offset + size))
+    {
+        outputLength = offset + size;
+    }
+    return writer.fill(offset, 0, size);
+}
+
+/**
+ * Copy the source file through the staging buffers of a batched writer.
+ * The copy is complete when the function returns.
+ * @param [in]  input   Input file descriptor.
+ * @param [in]  writer  Batched writer.
+ * @param [in]  direct  Read with O_DIRECT into the aligned staging buffers
+ *                      (buffered reads are used if the filesystem does not
+ *                      support it).
+ * @param [out] crc     If not @b nullptr, CRC32 of the source file.
+ * @param [in]  tracker Progress tracker.
+ * @param [out] copied  Number of bytes copied.
+ * @return Copy status.
+ */
+static Status copyBatched(int input, BatchWriter& writer, bool direct, uint32_t* crc, ProgressTracker& tracker, size_t& copied)
+{
+    PhaseTimer timer(Phase::Copy);
+    copied = 0;
+    if(nullptr != crc)
+    {
+        *crc = 0;
+    }
+    int flags = fcntl(input, F_GETFL);
+    direct = direct && (flags >= 0) && (0 == fcntl(input, F_SETFL, flags | O_DIRECT));
+    if(false == direct)
+    {
+        posix_fadvise(input, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    for(;;)
+    {
+        uint8_t *buffer = writer.acquire();
+        if(nullptr == buffer)
+        {
+            break;
+        }
+        ssize_t n;
+        do
         {
-            n = fwrite(reinterpret_cast<uint8_t*>(record.data), 1, record.size, output);
-            if(record.size != n)
+            n = read(input, buffer, BatchWriter::BufferSize);
+            if((n < 0) && (EINVAL == errno) && direct)
             {
-                Error("Failed to write record #%d: %s", i, strerror(errno));
-                ret = false;
+                // The filesystem does not support direct I/O.
+                fcntl(input, F_SETFL, flags);
+                posix_fadvise(input, 0, 0, POSIX_FADV_SEQUENTIAL);
+                direct = false;
+                errno = EINTR;
             }
+        } while((n < 0) && (EINTR == errno));
+        if(n <= 0)
+        {
+            int error = errno;
+            writer.commit(buffer, copied, 0);
+            if(n < 0)
+            {
+                writer.flush();
+                return Status(IPS_ERROR_READ, copied, Status::NoRecord, error);
+            }
+            break;
+        }
+        if(nullptr != crc)
+        {
+            *crc = crc32(buffer, n, *crc);
+        }
+        writer.commit(buffer, copied, n);
+        copied += n;
+        Stats::instance().read(n);
+        Stats::instance().written(n);
+        if(false == tracker.step(n, 0))
+        {
+            writer.flush();
+            return Status(IPS_ERROR, copied);
+        }
+        // Direct reads past the end of the file may be rejected.
+        if(direct && (static_cast<size_t>(n) < BatchWriter::BufferSize))
+        {
+            break;
         }
     }
-    fclose(output);
-    return ret;
+    // Records may overwrite the source data.
+    if(false == writer.flush())
+    {
+        return Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+    }
+    return Status();
 }
 
+/**
+ * Copy the source file by queuing writes straight from a window mapping
+ * it. The copy is complete when the function returns.
+ * @param [in]  window  Source window.
+ * @param [in]  writer  Batched writer.
+ * @param [out] crc     If not @b nullptr, CRC32 of the source file.
+ * @param [in]  tracker Progress tracker.
+ * @param [out] copied  Number of bytes copied.
+ * @return Copy status.
+ */
+static Status copyMapped(MappedWindow& window, BatchWriter& writer, uint32_t* crc, ProgressTracker& tracker, size_t& copied)
+{
+    PhaseTimer timer(Phase::Copy);
+    copied = 0;
+    if(nullptr != crc)
+    {
+        *crc = 0;
+    }
+    size_t size = window.size();
+    while(copied < size)
+    {
+        size_t n = ((size - copied) > window.budget()) ? window.budget() : (size - copied);
+        const uint8_t *data = window.data(copied, n);
+        if(nullptr == data)
+        {
+            return Status(IPS_ERROR_READ, copied, Status::NoRecord, errno);
+        }
+        if(nullptr != crc)
+        {
+            *crc = crc32(data, n, *crc);
+        }
+        // The window is moved by the next iteration.
+        if(!(writer.write(copied, data, n) && writer.flush()))
+        {
+            return Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+        }
+        copied += n;
+        Stats::instance().read(n);
+        Stats::instance().written(n);
+        if(false == tracker.step(n, 0))
+        {
+            return Status(IPS_ERROR, copied);
+        }
+    }
+    return Status();
+}
 
-} // namespace IPS
+/**
+ * Copy the source file in the kernel with copy_file_range.
+ * @param [in]  input       Input file descriptor.
+ * @param [in]  output      Output file descriptor.
+ * @param [in]  tracker     Progress tracker.
+ * @param [out] copied      Number of bytes copied.
+ * @param [out] unsupported Set if nothing was copied because the kernel or
+ *                          the filesystems do not support it.
+ * @return Copy status.
+ */
+static Status copyRange(int input, int output, ProgressTracker& tracker, size_t& copied, bool& unsupported)
+{
+    static const size_t chunk = 64 * 1024 * 1024;
+    PhaseTimer timer(Phase::Copy);
+    copied = 0;
+    unsupported = false;
+    loff_t inOffset = 0, outOffset = 0;
+    for(;;)
+    {
+        ssize_t n = copy_file_range(input, &inOffset, output, &outOffset, chunk, 0);
+        if(n < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+            if((0 == copied) && ((ENOSYS == errno) || (EXDEV == errno) || (EINVAL == errno) || (EOPNOTSUPP == errno) || (EBADF == errno)))
+            {
+                unsupported = true;
+                return Status();
+            }
+            return Status(IPS_ERROR_WRITE, copied, Status::NoRecord, errno);
+        }
+        if(0 == n)
+        {
+            break;
+        }
+        copied += n;
+        Stats::instance().read(n);
+        Stats::instance().written(n);
+        if(false == tracker.step(n, 0))
+        {
+            return Status(IPS_ERROR, copied);
+        }
+    }
+    return Status();
+}
 
+/**
+ * Queue a record written on its own. Record data is written straight
+ * from the patch and zero runs are stored as holes when possible.
+ * @param [in]     writer       Batched writer.
+ * @param [in]     fd           Output file descriptor.
+ * @param [in]     record       Record.
+ * @param [in,out] outputLength Output length.
+ */
+static bool queueRecord(BatchWriter& writer, int fd, IPS::Record const& record, size_t& outputLength)
+{
+    if(record.rle && (0 == record.data) && (record.size >= HoleThreshold))
+    {
+        return queueZeros(writer, fd, record.offset, record.size, outputLength);
+    }
+    if(record.rle)
+    {
+        return writer.fill(record.offset, static_cast<uint8_t>(record.data), record.size);
+    }
+    bool ret = true;
+    const uint8_t *data = reinterpret_cast<const uint8_t*>(record.data);
+    for(size_t j=0; ret && (j<record.size); )
+    {
+        size_t runStart, runEnd;
+        ApplyPlan::findZeroRun(data, j, record.size, runStart, runEnd);
+        if(runStart > j)
+        {
+            ret = writer.write(record.offset + j, data + j, runStart - j);
+        }
+        if(ret && (runStart < record.size))
+        {
+            ret = queueZeros(writer, fd, record.offset + runStart, runEnd - runStart, outputLength);
+        }
+        j = runEnd;
+    }
+    return ret;
+}
+
+/**
+ * Source data used to fill the gaps between merged records: a buffer held
+ * in memory or a window over the source file.
+ */
+class SourceData
+{
+    public:
+        /** No source data. **/
+        SourceData()
+            : _data(nullptr)
+            , _window(nullptr)
+        {}
+        /** Source buffer. **/
+        explicit SourceData(const uint8_t* data)
+            : _data(data)
+            , _window(nullptr)
+        {}
+        /** Source file window. **/
+        explicit SourceData(MappedWindow* window)
+            : _data(nullptr)
+            , _window(window)
+        {}
+        /** Check if the source data is available. **/
+        bool available() const
+        {
+            return (nullptr != _data) || (nullptr != _window);
+        }
+        /**
+         * Get a source range. Ranges are requested in increasing order, so
+         * the pages below @b offset are released.
+         * @return @b nullptr if the range could not be mapped.
+         */
+        const uint8_t* get(size_t offset, size_t length)
+        {
+            if(nullptr != _data)
+            {
+                return _data + offset;
+            }
+            _window->release(offset);
+            return _window->data(offset, length);
+        }
+
+    private:
+        const uint8_t* _data;
+        MappedWindow* _window;
+};
+
+/**
+ * Queue patch records on a batched writer.
+ * Records are merged into extents by the apply planner. Each extent is
+ * rendered into a staging buffer and written at once. Growth past the
+ * end of the output and long zero runs are stored as holes when the
+ * filesystem supports it.
+ * @param [in] writer       Batched writer.
+ * @param [in] fd           Output file descriptor.
+ * @param [in] source       Source data, used to fill the gaps between
+ *                          records (may be unavailable).
+ * @param [in] sourceSize   Length of the source data already in the output.
+ * @param [in] outputLength Output length.
+ * @param [in] patch        IPS patch.
+ * @param [in] verbose      Output informations. 
+ * @param [in] tracker      If not @b nullptr, progress tracker.
+ * @return Apply status. Write failures are detected when the writes
+ *         complete, so they are not tied to a record.
+ */
+static Status applyBatched(BatchWriter& writer, int fd, SourceData& source, size_t sourceSize, size_t outputLength, IPS::Patch const& patch, bool verbose, ProgressTracker* tracker)
+{
+    PhaseTimer timer(Phase::Apply);
+    Stats& stats = Stats::instance();
+    ApplyPlan plan;
+    plan.build(patch, sourceSize, source.available(), BatchWriter::BufferSize);
+
+    bool ret = true;
+    Status status;
+    for(size_t e=0; ret && (e<plan.count()); e++)
+    {
+        Extent const& extent = plan[e];
+        size_t bytes = 0;
+        for(size_t i=extent.first; i<(extent.first + extent.count); i++)
+        {
+            if(verbose)
+            {
+                IPS::Record record = patch[i];
+                LogRecord(i, record.offset, record.size, record.rle);
+            }
+            bytes += patch.sizes()[i];
+        }
+        // Queued writes complete in any order.
+        if(extent.flush)
+        {
+            ret = writer.flush();
+        }
+
+        if(ret && (outputLength < extent.offset))
+        {
+            size_t filled = extent.offset - outputLength;
+            ret = queueZeros(writer, fd, outputLength, filled, outputLength);
+            stats.written(filled);
+            if(verbose)
+            {
+                Info("Applying record: filled %zu bytes", filled);
+            }
+        }
+        if(ret)
+        {
+            if(extent.direct)
+            {
+                ret = queueRecord(writer, fd, patch[extent.first], outputLength);
+            }
+            else
+            {
+                const uint8_t *data = nullptr;
+                if(source.available() && (extent.offset < sourceSize))
+                {
+                    size_t end = extent.offset + extent.size;
+                    data = source.get(extent.offset, ((end < sourceSize) ? end : sourceSize) - extent.offset);
+                    if(nullptr == data)
+                    {
+                        status = Status(IPS_ERROR_READ, extent.offset, extent.first);
+                        break;
+                    }
+                }
+                uint8_t *buffer = writer.acquire();
+                ret = (nullptr != buffer);
+                if(ret)
+                {
+                    plan.render(extent, patch, data, buffer);
+                    ret = writer.commit(buffer, extent.offset, extent.size);
+                }
+            }
+        }
+        if(false == ret)
+        {
+            break;
+        }
+        size_t last = extent.offset + extent.size;
+        if(outputLength < last)
+        {
+            outputLength = last;
+        }
+        stats.written(extent.size);
+        if(nullptr != tracker)
+        {
+            ret = tracker->step(bytes, extent.count);
+            if(false == ret)
+            {
+                status = Status(IPS_ERROR, extent.offset, extent.first + extent.count - 1);
+            }
+        }
+    }
+    if(false == writer.flush())
+    {
+        status = Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+    }
+    return status;
+}
+
+/**
+ * Apply patch to input file and write output to another file using
+ * batched positional writes.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] options Apply options.
+ * @param [in] backend Source copy backend (not @b Auto nor @b Stdio).
+ * @param [in] tracker Progress tracker.
+ * @return Apply status.
+ */
+static Status applyFileBatched(const char* in, const char* out, IPS::Patch const& patch, ApplyOptions const& options, Backend::Value backend, ProgressTracker& tracker)
+{
+    int input = open(in, O_RDONLY | O_CLOEXEC);
+    if(input < 0)
+    {
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno), in, options.logErrors);
+    }
+    int output = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output < 0)
+    {
+        Status status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        close(input);
+        return report(status, out, options.logErrors);
+    }
+    BatchWriter writer;
+    if(false == writer.open(output))
+    {
+        close(input);
+        close(output);
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, ENOMEM), out, options.logErrors);
+    }
+
+    // The gaps between merged records are filled through a window over
+    // the source, so that only a bounded part of it is resident.
+    size_t budget = options.memoryBudget;
+    if(budget < (2 * BatchWriter::BufferSize))
+    {
+        budget = 2 * BatchWriter::BufferSize;
+    }
+    MappedWindow window;
+    bool mapped = window.open(in, budget);
+
+    // The output gets its final size before the source is copied. The
+    // kernel copy may share the source blocks, they are not allocated.
+    struct stat info;
+    size_t sourceSize = (0 == fstat(input, &info)) ? info.st_size : 0;
+    size_t size = workingSize(sourceSize, patch.outputSize(), patch.finalSize(sourceSize));
+    Status status;
+    if(false == preallocate(output, (Backend::CopyRange == backend) ? 0 : sourceSize, size))
+    {
+        status = Status(IPS_ERROR_WRITE, 0, Status::NoRecord, errno);
+    }
+
+    uint32_t crc;
+    size_t copied = 0;
+    if(status && (Backend::CopyRange == backend))
+    {
+        bool unsupported;
+        status = copyRange(input, output, tracker, copied, unsupported);
+        if(unsupported)
+        {
+            backend = Backend::Read;
+        }
+    }
+    if((Backend::Map == backend) && (false == mapped))
+    {
+        backend = Backend::Read;
+    }
+    if(options.verbose)
+    {
+        Info("Source copy: %s", Backend::name(backend));
+    }
+    if(status && (Backend::Map == backend))
+    {
+        status = copyMapped(window, writer, options.checkCrc ? &crc : nullptr, tracker, copied);
+    }
+    else if(status && (Backend::CopyRange != backend))
+    {
+        status = copyBatched(input, writer, (Backend::Direct == backend), options.checkCrc ? &crc : nullptr, tracker, copied);
+    }
+    close(input);
+    if(status && options.checkCrc && (crc != options.expectedCrc))
+    {
+        if(options.logErrors)
+        {
+            Error("Source CRC32 mismatch for %s: expected %08x, got %08x", in, options.expectedCrc, crc);
+        }
+        writer.close();
+        close(output);
+        remove(out);
+        return Status(IPS_ERROR_PROCESS);
+    }
+    if(status)
+    {
+        SourceData source;
+        if(mapped && (window.size() == copied))
+        {
+            source = SourceData(&window);
+        }
+        // The source may have changed since it was sized.
+        size_t finalSize = patch.finalSize(copied);
+        status = applyBatched(writer, output, source, copied, (copied > size) ? copied : size, patch, options.verbose, &tracker);
+        if(status && (ftruncate(output, finalSize) < 0))
+        {
+            status = Status(IPS_ERROR_WRITE, finalSize, Status::NoRecord, errno);
+        }
+    }
+    {
+        PhaseTimer timer(Phase::Flush);
+        writer.close();
+        if((0 != close(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    if(tracker.cancelled())
+    {
+        if(options.logErrors)
+        {
+            Warning("Cancelled");
+        }
+        remove(out);
+        return Status(IPS_ERROR, status.offset, status.record);
+    }
+    tracker.finish();
+    return report(status, (IPS_ERROR_READ == status.result) ? in : out, options.logErrors);
+}
+
+/**
+ * Sequential file reader. A thread reads the next chunk while the
+ * current one is being processed.
+ */
+class ChunkReader
+{
+    public:
+        /** Chunk size. **/
+        static const size_t ChunkSize = 1024 * 1024;
+
+    public:
+        /**
+         * Constructor.
+         * @param [in] fd Input file descriptor (not owned).
+         */
+        ChunkReader(int fd)
+            : _fd(fd)
+            , _storage(2 * ChunkSize)
+            , _stop(false)
+            , _current(0)
+        {
+            for(int i=0; i<2; i++)
+            {
+                _chunks[i].full = false;
+                _chunks[i].size = 0;
+                _chunks[i].error = 0;
+            }
+            _thread = std::thread(&ChunkReader::run, this);
+        }
+        /** Destructor. Waits for the reader thread. **/
+        ~ChunkReader()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _condition.notify_all();
+            _thread.join();
+        }
+        /**
+         * Wait for the next chunk. The returned buffer can hold
+         * @b ChunkSize bytes and stays valid until release() is called.
+         * @param [out] size  Number of bytes read (less than @b ChunkSize
+         *                    at the end of the file).
+         * @param [out] error errno value of a failed read.
+         */
+        uint8_t* next(size_t& size, int& error)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            Chunk& chunk = _chunks[_current];
+            _condition.wait(lock, [&chunk]() { return chunk.full; });
+            size = chunk.size;
+            error = chunk.error;
+            return _storage.data() + (_current * ChunkSize);
+        }
+        /** Give the current chunk back to the reader thread. **/
+        void release()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _chunks[_current].full = false;
+                _current ^= 1;
+            }
+            _condition.notify_all();
+        }
+
+    private:
+        /** Reader thread. Stops after the end of the file or an error. **/
+        void run()
+        {
+            for(unsigned index=0; ; index^=1)
+            {
+                Chunk& chunk = _chunks[index];
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _condition.wait(lock, [this, &chunk]() { return _stop || !chunk.full; });
+                    if(_stop)
+                    {
+                        return;
+                    }
+                }
+                uint8_t *buffer = _storage.data() + (index * ChunkSize);
+                size_t size = 0;
+                int error = 0;
+                while(size < ChunkSize)
+                {
+                    ssize_t n = read(_fd, buffer + size, ChunkSize - size);
+                    if(n < 0)
+                    {
+                        if(EINTR == errno)
+                        {
+                            continue;
+                        }
+                        error = errno;
+                        break;
+                    }
+                    if(0 == n)
+                    {
+                        break;
+                    }
+                    size += n;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    chunk.size = size;
+                    chunk.error = error;
+                    chunk.full = true;
+                }
+                _condition.notify_all();
+                if(error || (size < ChunkSize))
+                {
+                    return;
+                }
+            }
+        }
+
+    private:
+        struct Chunk
+        {
+            bool full;
+            size_t size;
+            int error;
+        };
+        int _fd;
+        std::vector<uint8_t> _storage;
+        Chunk _chunks[2];
+        bool _stop;
+        unsigned _current;
+        std::mutex _mutex;
+        std::condition_variable _condition;
+        std::thread _thread;
+};
+
+/**
+ * Write a chunk. Zero blocks aligned on @b ApplyPlan::Alignment are
+ * skipped, the output file being new they read back as zeros.
+ * @param [in] fd     Output file descriptor.
+ * @param [in] offset Chunk offset (aligned).
+ * @param [in] data   Chunk data.
+ * @param [in] size   Chunk size.
+ * @param [out] failed Offset of the failure.
+ * @return errno value of a failed write (0 on success).
+ */
+static int writeChunk(int fd, size_t offset, const uint8_t* data, size_t size, size_t& failed)
+{
+    static const size_t block = ApplyPlan::Alignment;
+    for(size_t i=0; i<size; )
+    {
+        // Skip zero blocks.
+        size_t start = i;
+        for(; start<size; start+=block)
+        {
+            size_t n = ((size - start) < block) ? (size - start) : block;
+            const uint8_t *ptr = data + start;
+            size_t j = 0;
+            while((j < n) && (0 == ptr[j]))
+            {
+                j++;
+            }
+            if(j < n)
+            {
+                break;
+            }
+        }
+        // Gather the following data blocks.
+        size_t end = start;
+        for(; end<size; end+=block)
+        {
+            size_t n = ((size - end) < block) ? (size - end) : block;
+            const uint8_t *ptr = data + end;
+            size_t j = 0;
+            while((j < n) && (0 == ptr[j]))
+            {
+                j++;
+            }
+            if(j == n)
+            {
+                break;
+            }
+        }
+        if(end > size)
+        {
+            end = size;
+        }
+        for(size_t k=start; k<end; )
+        {
+            ssize_t n = pwrite(fd, data + k, end - k, offset + k);
+            if(n < 0)
+            {
+                if(EINTR == errno)
+                {
+                    continue;
+                }
+                failed = offset + k;
+                return errno;
+            }
+            k += n;
+        }
+        i = (end > start) ? end : size;
+    }
+    return 0;
+}
+
+/**
+ * Check the CRC32 of a source file before anything is written, then
+ * rewind it.
+ * @param [in] input   Source file descriptor.
+ * @param [in] options Apply options.
+ * @param [in] tracker Progress tracker, checked for cancellation.
+ * @param [in] in      Source filename.
+ * @return Check status (@b IPS_ERROR_PROCESS on mismatch).
+ */
+static Status sourceCrc(int input, ApplyOptions const& options, ProgressTracker& tracker, const char* in)
+{
+    PhaseTimer timer(Phase::Copy);
+    uint32_t crc = 0;
+    size_t offset = 0;
+    {
+        ChunkReader reader(input);
+        for(size_t n=ChunkReader::ChunkSize; ChunkReader::ChunkSize == n; )
+        {
+            int error;
+            uint8_t *chunk = reader.next(n, error);
+            if(error)
+            {
+                return report(Status(IPS_ERROR_READ, offset + n, Status::NoRecord, error), in, options.logErrors);
+            }
+            crc = crc32(chunk, n, crc);
+            Stats::instance().read(n);
+            offset += n;
+            reader.release();
+            if(tracker.cancelled())
+            {
+                if(options.logErrors)
+                {
+                    Warning("Cancelled");
+                }
+                return Status(IPS_ERROR, offset);
+            }
+        }
+    }
+    if(crc != options.expectedCrc)
+    {
+        if(options.logErrors)
+        {
+            Error("Source CRC32 mismatch for %s: expected %08x, got %08x", in, options.expectedCrc, crc);
+        }
+        return Status(IPS_ERROR_PROCESS);
+    }
+    if(lseek(input, 0, SEEK_SET) < 0)
+    {
+        return report(Status(IPS_ERROR_READ, 0, Status::NoRecord, errno), in, options.logErrors);
+    }
+    return Status();
+}
+
+/**
+ * Apply patch to input file in a single pass. The source is read in
+ * chunks, the records intersecting each chunk are written over it and
+ * the chunk is written once. Output writes are sequential.
+ * If the source CRC32 is checked, the source is hashed in a first pass
+ * and nothing is written on mismatch.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] options Apply options.
+ * @param [in] tracker Progress tracker.
+ * @return Apply status.
+ */
+static Status applyFused(const char* in, const char* out, IPS::Patch const& patch, ApplyOptions const& options, ProgressTracker& tracker)
+{
+    int input = open(in, O_RDONLY | O_CLOEXEC);
+    if(input < 0)
+    {
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno), in, options.logErrors);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(input, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    Stats& stats = Stats::instance();
+    if(options.checkCrc)
+    {
+        Status status = sourceCrc(input, options, tracker, in);
+        if(!status)
+        {
+            close(input);
+            return status;
+        }
+    }
+    int output = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output < 0)
+    {
+        Status status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        close(input);
+        return report(status, out, options.logErrors);
+    }
+
+    Status status;
+    // The output gets its final size before the first write. Zero blocks
+    // are skipped and left as holes, so no block is allocated upfront.
+    struct stat info;
+    size_t outputSize = patch.finalSize((0 == fstat(input, &info)) ? info.st_size : 0);
+    if(false == preallocate(output, 0, outputSize))
+    {
+        status = Status(IPS_ERROR_WRITE, 0, Status::NoRecord, errno);
+    }
+    {
+        PhaseTimer timer(Phase::Apply);
+        const uint32_t *offsets = patch.offsets();
+        const uint16_t *sizes = patch.sizes();
+        const uint8_t *rle = patch.rle();
+        const uintptr_t *payloads = patch.payloads();
+        size_t count = patch.count();
+
+        ChunkReader reader(input);
+        std::vector<uint8_t> tail;
+        bool eof = false;
+        size_t record = 0;
+        for(size_t offset=0; status && (!eof || (offset < outputSize)); )
+        {
+            // Source data, then zeros past its end.
+            uint8_t *chunk;
+            size_t n = 0;
+            bool read = !eof;
+            if(eof)
+            {
+                if(tail.empty())
+                {
+                    tail.resize(ChunkReader::ChunkSize);
+                }
+                chunk = tail.data();
+            }
+            else
+            {
+                int error;
+                chunk = reader.next(n, error);
+                if(error)
+                {
+                    status = Status(IPS_ERROR_READ, offset + n, Status::NoRecord, error);
+                    break;
+                }
+                eof = (n < ChunkReader::ChunkSize);
+                stats.read(n);
+                // The source may have changed since it was sized.
+                if(eof && !patch.truncated() && ((offset + n) > outputSize))
+                {
+                    outputSize = offset + n;
+                }
+            }
+            size_t size = n;
+            if(eof && (outputSize > (offset + n)))
+            {
+                size = outputSize - offset;
+                if(size > ChunkReader::ChunkSize)
+                {
+                    size = ChunkReader::ChunkSize;
+                }
+                memset(chunk + n, 0, size - n);
+            }
+
+            // Overlay records. They are sorted, so they are visited once
+            // unless they overlap.
+            size_t end = offset + size;
+            size_t applied = 0, bytes = 0;
+            for(size_t i=record; (i<count) && (offsets[i] < end); i++)
+            {
+                size_t first = (offsets[i] > offset) ? offsets[i] : offset;
+                size_t last = static_cast<size_t>(offsets[i]) + sizes[i];
+                if(last > end)
+                {
+                    last = end;
+                }
+                if(first >= last)
+                {
+                    continue;
+                }
+                if(options.verbose && (first == offsets[i]))
+                {
+                    LogRecord(i, offsets[i], sizes[i], rle[i] != 0);
+                }
+                if(rle[i])
+                {
+                    memset(chunk + (first - offset), static_cast<uint8_t>(payloads[i]), last - first);
+                }
+                else
+                {
+                    memcpy(chunk + (first - offset), reinterpret_cast<const uint8_t*>(payloads[i]) + (first - offsets[i]), last - first);
+                }
+                bytes += last - first;
+            }
+            while((record < count) && ((static_cast<size_t>(offsets[record]) + sizes[record]) <= end))
+            {
+                record++;
+                applied++;
+            }
+
+            // Nothing is written past the truncation size.
+            size_t length = (offset < outputSize) ? (outputSize - offset) : 0;
+            length = (length < size) ? length : size;
+            size_t failed;
+            int error = writeChunk(output, offset, chunk, length, failed);
+            if(read)
+            {
+                reader.release();
+            }
+            if(error)
+            {
+                status = Status(IPS_ERROR_WRITE, failed, Status::NoRecord, error);
+                break;
+            }
+            stats.written(length);
+            offset = end;
+            if(false == tracker.step(n + bytes, applied))
+            {
+                status = Status(IPS_ERROR, offset);
+            }
+            // The rest of the source is not needed past the output size.
+            if((0 == size) || (offset >= outputSize))
+            {
+                break;
+            }
+        }
+    }
+    close(input);
+
+    if(status && (ftruncate(output, outputSize) < 0))
+    {
+        status = Status(IPS_ERROR_WRITE, outputSize, Status::NoRecord, errno);
+    }
+    {
+        PhaseTimer timer(Phase::Flush);
+        if((0 != close(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    if(tracker.cancelled())
+    {
+        if(options.logErrors)
+        {
+            Warning("Cancelled");
+        }
+        remove(out);
+        return Status(IPS_ERROR, status.offset, status.record);
+    }
+    tracker.finish();
+    return report(status, (IPS_ERROR_READ == status.result) ? in : out, options.logErrors);
+}
+
+/**
+ * Apply patch to input file and write output to another file.
+ * If the source CRC32 does not match or if apply is cancelled, the output
+ * file is removed.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] options Apply options.
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, ApplyOptions const& options)
+{
+    size_t totalBytes = 0;
+    FILE *input = fopen(in, "rb");
+    if(nullptr != input)
+    {
+        fseek(input, 0, SEEK_END);
+        totalBytes = ftell(input);
+        fclose(input);
+    }
+    const uint16_t *sizes = patch.sizes();
+    for(size_t i=0; i<patch.count(); i++)
+    {
+        totalBytes += sizes[i];
+    }
+    ProgressTracker tracker(options, totalBytes, patch.count());
+    if(options.fused)
+    {
+        return applyFused(in, out, patch, options, tracker);
+    }
+    Backend::Value backend = options.batched ? options.backend : Backend::Stdio;
+    if(Backend::Auto == backend)
+    {
+        backend = Backend::select(in, out, options.checkCrc);
+    }
+    else if((Backend::CopyRange == backend) && options.checkCrc)
+    {
+        // The source has to be read to compute its CRC32.
+        backend = Backend::Read;
+    }
+    if(Backend::Stdio != backend)
+    {
+        return applyFileBatched(in, out, patch, options, backend, tracker);
+    }
+
+    FILE *output;
+    uint32_t crc;
+    Status status;
+    output = copyFileImpl(in, out, options.checkCrc ? &crc : nullptr, &tracker, status);
+    if(nullptr == output)
+    {
+        if(tracker.cancelled())
+        {
+            if(options.logErrors)
+            {
+                Warning("Cancelled");
+            }
+            remove(out);
+            return status;
+        }
+        return report(status, ((IPS_ERROR_OPEN == status.result) || (IPS_ERROR_READ == status.result)) ? in : out, options.logErrors);
+    }
+    
+    if(options.checkCrc && (crc != options.expectedCrc))
+    {
+        if(options.logErrors)
+        {
+            Error("Source CRC32 mismatch for %s: expected %08x, got %08x", in, options.expectedCrc, crc);
+        }
+        fclose(output);
+        remove(out);
+        return Status(IPS_ERROR_PROCESS);
+    }
+
+    status = applyRecords(output, patch, options.verbose, &tracker);
+    {
+        PhaseTimer timer(Phase::Flush);
+        if((0 != fclose(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    if(tracker.cancelled())
+    {
+        if(options.logErrors)
+        {
+            Warning("Cancelled");
+        }
+        remove(out);
+        return Status(IPS_ERROR, status.offset, status.record);
+    }
+    tracker.finish();
+    return report(status, out, options.logErrors);
+}
+
+/**
+ * Apply patch to input file and write output to another file.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] verbose Output informations. 
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose)
+{
+    ApplyOptions options;
+    options.verbose = verbose;
+    return apply(in, out, patch, options);
+}
+
+/**
+ * Apply patch to input file and write output to another file, only if
+ * the input file CRC32 matches the expected one.
+ * @param [in] in          Input filename.
+ * @param [in] out         Output filename.
+ * @param [in] patch       IPS patch.
+ * @param [in] verbose     Output informations. 
+ * @param [in] expectedCrc Expected input file CRC32.
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose, uint32_t expectedCrc)
+{
+    ApplyOptions options;
+    options.verbose = verbose;
+    options.checkCrc = true;
+    options.expectedCrc = expectedCrc;
+    return apply(in, out, patch, options);
+}
+
+/**
+ * Apply patch to an input buffer and write output to a file.
+ * @param [in] in      Input data.
+ * @param [in] inSize  Input data size.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] verbose Output informations. 
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, const char* out, IPS::Patch const& patch, bool verbose)
+{
+    int output = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output < 0)
+    {
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno), out, true);
+    }
+    BatchWriter writer;
+    if(false == writer.open(output))
+    {
+        close(output);
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, ENOMEM), out, true);
+    }
+    Status status;
+    size_t finalSize = patch.finalSize(inSize);
+    size_t size = workingSize(inSize, patch.outputSize(), finalSize);
+    if(false == preallocate(output, inSize, size))
+    {
+        status = Status(IPS_ERROR_WRITE, 0, Status::NoRecord, errno);
+    }
+    // The source buffer is written in place, records may overwrite it.
+    else if(inSize && !(writer.write(0, in, inSize) && writer.flush()))
+    {
+        status = Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+    }
+    if(status)
+    {
+        Stats::instance().written(inSize);
+        SourceData source(in);
+        status = applyBatched(writer, output, source, inSize, size, patch, verbose, nullptr);
+    }
+    if(status && (ftruncate(output, finalSize) < 0))
+    {
+        status = Status(IPS_ERROR_WRITE, finalSize, Status::NoRecord, errno);
+    }
+    {
+        PhaseTimer timer(Phase::Flush);
+        writer.close();
+        if((0 != close(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    return report(status, out, true);
+}
+
+/**
+ * Add a record to the output ranges written by the streaming apply.
+ * A record is rejected if it overlaps an earlier one, with the same rules
+ * as Patch::add. Adjacent ranges are merged.
+ * @param [in,out] ranges Written ranges (start, end), sorted by start.
+ * @param [in,out] high   Highest end written so far.
+ * @param [in]     offset Record offset.
+ * @param [in]     end    Record end.
+ * @return @b false if the record overlaps a written range.
+ */
+static bool claimRange(std::map<size_t, size_t>& ranges, size_t& high, size_t offset, size_t end)
+{
+    // Records past the highest end written so far cannot overlap.
+    std::map<size_t, size_t>::iterator next = (offset >= high) ? ranges.end() : ranges.upper_bound(offset);
+    if((ranges.end() != next) && (next->first < end))
+    {
+        return false;
+    }
+    std::map<size_t, size_t>::iterator previous = next;
+    bool merge = (ranges.begin() != next);
+    if(merge)
+    {
+        --previous;
+        if(offset < previous->second)
+        {
+            return false;
+        }
+    }
+    if((ranges.end() != next) && (next->first == end))
+    {
+        end = next->second;
+        next = ranges.erase(next);
+    }
+    if(merge && (previous->second == offset))
+    {
+        previous->second = end;
+    }
+    else
+    {
+        ranges.emplace_hint(next, offset, end);
+    }
+    if(end > high)
+    {
+        high = end;
+    }
+    return true;
+}
+/**
+ * Queue records as they are decoded. Contiguous records are gathered in
+ * staging buffers. Queued writes are flushed before a record overlapping
+ * them, so that records are applied in patch order.
+ * @param [in]  writer       Batched writer.
+ * @param [in]  fd           Output file descriptor.
+ * @param [in]  outputLength Length of the source data already in the output.
+ * @param [in]  reader       Record decoder.
+ * @param [in]  verbose      Output informations. 
+ * @param [in]  tracker      If not @b nullptr, progress tracker.
+ * @return Apply status. Decoding failures are reported with the
+ *         @b IPS_ERROR_READ code and the patch offset of the record,
+ *         overlapping records with the @b IPS_ERROR_INVALID code.
+ */
+template<Format::Value F> static Status applyStream(BatchWriter& writer, int fd, size_t outputLength, RecordReader& reader, bool verbose, ProgressTracker* tracker)
+{
+    PhaseTimer timer(Phase::Apply);
+    Stats& stats = Stats::instance();
+    // Staging buffer holding contiguous records.
+    uint8_t *buffer = nullptr;
+    size_t start = 0, used = 0;
+    // Range covered by the writes queued since the last flush.
+    size_t low = static_cast<size_t>(-1), high = 0;
+    // Output ranges written so far, overlapping records are rejected like
+    // when the patch is read.
+    std::map<size_t, size_t> written;
+    size_t writtenEnd = 0;
+
+    Status status;
+    bool ret = true;
+    while(ret)
+    {
+        IPS::Record record;
+        size_t recordStart = reader.offset();
+        status = reader.next<F>(record);
+        if(IPS_PATCH_END == status.result)
+        {
+            status = Status();
+            break;
+        }
+        if(!status)
+        {
+            break;
+        }
+        size_t end = static_cast<size_t>(record.offset) + record.size;
+        if(false == claimRange(written, writtenEnd, record.offset, end))
+        {
+            status = Status(IPS_ERROR_INVALID, recordStart, reader.index() - 1);
+            break;
+        }
+        stats.record(record.rle);
+        if(verbose)
+        {
+            LogRecord(reader.index() - 1, record.offset, record.size, record.rle);
+        }
+        bool direct = record.rle ? ((0 == record.data) && (record.size >= HoleThreshold)) : false;
+        if((false == record.rle) && (record.size >= HoleThreshold))
+        {
+            size_t runStart, runEnd;
+            ApplyPlan::findZeroRun(reinterpret_cast<const uint8_t*>(record.data), 0, record.size, runStart, runEnd);
+            direct = (runStart < record.size);
+        }
+        bool overlap = (record.offset < high) && (end > low);
+        bool gather = !direct && !overlap && (outputLength >= record.offset) && (nullptr != buffer) &&
+                      ((start + used) == record.offset) && ((used + record.size) <= BatchWriter::BufferSize);
+        if((nullptr != buffer) && !gather)
+        {
+            ret = writer.commit(buffer, start, used);
+            buffer = nullptr;
+        }
+        // Queued writes complete in any order.
+        if(ret && overlap)
+        {
+            ret = writer.flush();
+            low = static_cast<size_t>(-1);
+            high = 0;
+        }
+        if(ret && (outputLength < record.offset))
+        {
+            size_t filled = record.offset - outputLength;
+            ret = queueZeros(writer, fd, outputLength, filled, outputLength);
+            stats.written(filled);
+            if(verbose)
+            {
+                Info("Applying record: filled %zu bytes", filled);
+            }
+        }
+        if(ret && direct)
+        {
+            ret = queueRecord(writer, fd, record, outputLength);
+        }
+        else if(ret)
+        {
+            if(nullptr == buffer)
+            {
+                buffer = writer.acquire();
+                start = record.offset;
+                used = 0;
+                ret = (nullptr != buffer);
+            }
+            if(ret && record.rle)
+            {
+                memset(buffer + used, static_cast<uint8_t>(record.data), record.size);
+            }
+            else if(ret)
+            {
+                memcpy(buffer + used, reinterpret_cast<const uint8_t*>(record.data), record.size);
+            }
+            used += record.size;
+        }
+        if(record.offset < low)
+        {
+            low = record.offset;
+        }
+        if(end > high)
+        {
+            high = end;
+        }
+        if(outputLength < end)
+        {
+            outputLength = end;
+        }
+        stats.written(record.size);
+        if(ret && (nullptr != tracker))
+        {
+            ret = tracker->step(record.size, 1);
+            if(false == ret)
+            {
+                status = Status(IPS_ERROR, record.offset, reader.index() - 1);
+            }
+        }
+    }
+    if((nullptr != buffer) && (false == writer.commit(buffer, start, used)))
+    {
+        ret = false;
+    }
+    if((false == writer.flush()) && status)
+    {
+        status = Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+    }
+    return status;
+}
+/**
+ * Queue records as they are decoded, with the decoder specialized for the
+ * patch format.
+ */
+static Status applyStream(BatchWriter& writer, int fd, size_t outputLength, RecordReader& reader, bool verbose, ProgressTracker* tracker)
+{
+    if(Format::IPS32 == reader.format())
+    {
+        return applyStream<Format::IPS32>(writer, fd, outputLength, reader, verbose, tracker);
+    }
+    return applyStream<Format::IPS>(writer, fd, outputLength, reader, verbose, tracker);
+}
+
+/**
+ * Output size needed by the records, found by a scan of the record
+ * headers. Decoding failures are left to the apply loop.
+ * @param [in]  reader  Record decoder, after the header. It is copied, the
+ *                      records are decoded again when applied.
+ * @param [out] bytes   If not @b nullptr, total size of the records.
+ * @param [out] records If not @b nullptr, number of records.
+ */
+template<Format::Value F> static size_t recordsEnd(RecordReader reader, size_t* bytes, size_t* records)
+{
+    size_t last = 0, total = 0;
+    IPS::Record record;
+    while(reader.next<F>(record))
+    {
+        size_t end = static_cast<size_t>(record.offset) + record.size;
+        last = (end > last) ? end : last;
+        total += record.size;
+    }
+    if(nullptr != bytes)
+    {
+        *bytes = total;
+    }
+    if(nullptr != records)
+    {
+        *records = reader.index();
+    }
+    return last;
+}
+/**
+ * Output size needed by the records, with the decoder specialized for the
+ * patch format.
+ */
+static size_t recordsEnd(RecordReader const& reader, size_t* bytes=nullptr, size_t* records=nullptr)
+{
+    return (Format::IPS32 == reader.format()) ? recordsEnd<Format::IPS32>(reader, bytes, records) : recordsEnd<Format::IPS>(reader, bytes, records);
+}
+
+/**
+ * Apply a patch held in memory to an input buffer and write output to a
+ * file, without building a Patch.
+ * @param [in] in        Input data.
+ * @param [in] inSize    Input data size.
+ * @param [in] out       Output filename.
+ * @param [in] patch     IPS patch data.
+ * @param [in] patchSize IPS patch size.
+ * @param [in] verbose   Output informations. 
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, const char* out, const uint8_t* patch, size_t patchSize, bool verbose)
+{
+    RecordReader reader;
+    Status status = reader.begin(patch, patchSize);
+    if(!status)
+    {
+        return report(status, "(patch)", true);
+    }
+    int output = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output < 0)
+    {
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno), out, true);
+    }
+    BatchWriter writer;
+    if(false == writer.open(output))
+    {
+        close(output);
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, ENOMEM), out, true);
+    }
+    size_t end = recordsEnd(reader);
+    size_t finalSize = (Patch::NoTruncation != reader.truncation()) ? reader.truncation() : ((end > inSize) ? end : inSize);
+    size_t size = workingSize(inSize, end, finalSize);
+    if(false == preallocate(output, inSize, size))
+    {
+        status = Status(IPS_ERROR_WRITE, 0, Status::NoRecord, errno);
+    }
+    else if(inSize && !(writer.write(0, in, inSize) && writer.flush()))
+    {
+        status = Status(IPS_ERROR_WRITE, writer.errorOffset(), Status::NoRecord, writer.error());
+    }
+    if(status)
+    {
+        Stats::instance().written(inSize);
+        status = applyStream(writer, output, size, reader, verbose, nullptr);
+    }
+    if(status && (ftruncate(output, finalSize) < 0))
+    {
+        status = Status(IPS_ERROR_WRITE, finalSize, Status::NoRecord, errno);
+    }
+    {
+        PhaseTimer timer(Phase::Flush);
+        writer.close();
+        if((0 != close(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    if((IPS_ERROR_READ == status.result) || (IPS_ERROR_INVALID == status.result))
+    {
+        // The patch is truncated or invalid, the output is incomplete.
+        remove(out);
+        return report(status, "(patch)", true);
+    }
+    return report(status, out, true);
+}
+
+/**
+ * Apply a patch held in memory to an input file and write output to
+ * another file, without building a Patch.
+ * The source is copied with bounded buffers, through a bounded mapping
+ * window or in the kernel, and its CRC32 is checked while it is copied.
+ * @param [in] in        Input filename.
+ * @param [in] out       Output filename.
+ * @param [in] patch     IPS patch data (for instance a mapped patch file).
+ * @param [in] patchSize IPS patch size.
+ * @param [in] options   Apply options. The fused mode applies a Patch
+ *                       decoded from @b patch . Otherwise the writes are
+ *                       always batched and the stdio backend falls back
+ *                       to read.
+ * @return Apply status (@b IPS_ERROR_PROCESS if the source CRC32 does
+ *         not match).
+ */
+Status apply(const char* in, const char* out, const uint8_t* patch, size_t patchSize, ApplyOptions const& options)
+{
+    if(options.fused)
+    {
+        // The fused pass needs the records sorted by offset. The decoded
+        // records point to the patch data.
+        IO io;
+        io.setLogging(options.logErrors);
+        Patch decoded;
+        Status status = io.parse(patch, patchSize, decoded);
+        if(!status)
+        {
+            return status;
+        }
+        return apply(in, out, decoded, options);
+    }
+    RecordReader reader;
+    Status status = reader.begin(patch, patchSize);
+    if(!status)
+    {
+        return report(status, "(patch)", options.logErrors);
+    }
+    int input = open(in, O_RDONLY | O_CLOEXEC);
+    if(input < 0)
+    {
+        return report(Status(IPS_ERROR_OPEN, 0, Status::NoRecord, errno), in, options.logErrors);
+    }
+    int output = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output < 0)
+    {
+        status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        close(input);
+        return report(status, out, options.logErrors);
+    }
+    BatchWriter writer;
+    if(false == writer.open(output))
+    {
+        close(input);
+        close(output);
+        return report(Status(IPS_ERROR_SAVE, 0, Status::NoRecord, ENOMEM), out, options.logErrors);
+    }
+    Backend::Value backend = options.backend;
+    if(Backend::Auto == backend)
+    {
+        backend = Backend::select(in, out, options.checkCrc);
+    }
+    if(Backend::Stdio == backend)
+    {
+        // Records are queued to the batched writer, the source is read
+        // through its buffers as well.
+        backend = Backend::Read;
+    }
+    else if((Backend::CopyRange == backend) && options.checkCrc)
+    {
+        // The source has to be read to compute its CRC32.
+        backend = Backend::Read;
+    }
+    // The output gets its final size before the source is copied.
+    struct stat info;
+    size_t sourceSize = (0 == fstat(input, &info)) ? info.st_size : 0;
+    size_t bytes, records;
+    size_t end = recordsEnd(reader, &bytes, &records);
+    ProgressTracker tracker(options, sourceSize + bytes, records);
+    bool truncated = (Patch::NoTruncation != reader.truncation());
+    size_t size = workingSize(sourceSize, end, truncated ? reader.truncation() : sourceSize);
+    bool copyRangeFirst = (Backend::CopyRange == backend);
+    if(false == preallocate(output, copyRangeFirst ? 0 : sourceSize, size))
+    {
+        status = Status(IPS_ERROR_WRITE, 0, Status::NoRecord, errno);
+    }
+    uint32_t crc;
+    size_t copied = 0;
+    if(status && copyRangeFirst)
+    {
+        bool unsupported;
+        status = copyRange(input, output, tracker, copied, unsupported);
+        if(unsupported)
+        {
+            backend = Backend::Read;
+        }
+    }
+    // The source is mapped through a bounded window.
+    MappedWindow window;
+    if(Backend::Map == backend)
+    {
+        size_t budget = options.memoryBudget;
+        if(budget < (2 * BatchWriter::BufferSize))
+        {
+            budget = 2 * BatchWriter::BufferSize;
+        }
+        if(false == window.open(in, budget))
+        {
+            backend = Backend::Read;
+        }
+    }
+    if(options.verbose)
+    {
+        Info("Source copy: %s", Backend::name(backend));
+    }
+    if(status && (Backend::Map == backend))
+    {
+        status = copyMapped(window, writer, options.checkCrc ? &crc : nullptr, tracker, copied);
+    }
+    else if(status && (Backend::CopyRange != backend))
+    {
+        status = copyBatched(input, writer, (Backend::Direct == backend), options.checkCrc ? &crc : nullptr, tracker, copied);
+    }
+    close(input);
+    window.close();
+    if(status && options.checkCrc && (crc != options.expectedCrc))
+    {
+        if(options.logErrors)
+        {
+            Error("Source CRC32 mismatch for %s: expected %08x, got %08x", in, options.expectedCrc, crc);
+        }
+        writer.close();
+        close(output);
+        remove(out);
+        return Status(IPS_ERROR_PROCESS);
+    }
+    if(!status)
+    {
+        writer.close();
+        close(output);
+        remove(out);
+        if(tracker.cancelled())
+        {
+            if(options.logErrors)
+            {
+                Warning("Cancelled");
+            }
+            return status;
+        }
+        return report(status, (IPS_ERROR_READ == status.result) ? in : out, options.logErrors);
+    }
+    // The source may have changed since it was sized.
+    size_t finalSize = truncated ? reader.truncation() : ((end > copied) ? end : copied);
+    status = applyStream(writer, output, (copied > size) ? copied : size, reader, options.verbose, &tracker);
+    if(status && (ftruncate(output, finalSize) < 0))
+    {
+        status = Status(IPS_ERROR_WRITE, finalSize, Status::NoRecord, errno);
+    }
+    {
+        PhaseTimer timer(Phase::Flush);
+        writer.close();
+        if((0 != close(output)) && status)
+        {
+            status = Status(IPS_ERROR_SAVE, 0, Status::NoRecord, errno);
+        }
+    }
+    if(tracker.cancelled())
+    {
+        if(options.logErrors)
+        {
+            Warning("Cancelled");
+        }
+        remove(out);
+        return Status(IPS_ERROR, status.offset, status.record);
+    }
+    if((IPS_ERROR_READ == status.result) || (IPS_ERROR_INVALID == status.result))
+    {
+        // The patch is truncated or invalid, the output is incomplete.
+        remove(out);
+        return report(status, "(patch)", options.logErrors);
+    }
+    tracker.finish();
+    return report(status, out, options.logErrors);
+}
+
+/**
+ * Apply patch to an input buffer and store the output in memory.
+ * @param [in]  in      Input data.
+ * @param [in]  inSize  Input data size.
+ * @param [in]  patch   IPS patch.
+ * @param [out] output  Output data.
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, IPS::Patch const& patch, std::vector<uint8_t>& output)
+{
+    size_t outputSize = workingSize(inSize, patch.outputSize(), patch.finalSize(inSize));
+
+    // Bytes between the source end and the first record past it are 0.
+    output.assign(outputSize, 0);
+    if(inSize)
+    {
+        memcpy(output.data(), in, inSize);
+    }
+    const uint32_t *offsets = patch.offsets();
+    const uint16_t *sizes = patch.sizes();
+    const uint8_t *rle = patch.rle();
+    const uintptr_t *payloads = patch.payloads();
+    for(size_t i=0; i<patch.count(); i++)
+    {
+        if(rle[i])
+        {
+            memset(output.data() + offsets[i], static_cast<uint8_t>(payloads[i]), sizes[i]);
+        }
+        else
+        {
+            memcpy(output.data() + offsets[i], reinterpret_cast<const uint8_t*>(payloads[i]), sizes[i]);
+        }
+    }
+    output.resize(patch.finalSize(inSize));
+    return Status();
+}
+
+/** The "EOF" marker read as a record offset. **/
+static const size_t EOFOffset = 0x454f46;
+/** Maximum record size. **/
+static const size_t MaxRecordSize = 0xffff;
+
+/**
+ * Add literal records for a span of the target data. Records are at most
+ * 65535 bytes long and never start on the "EOF" marker.
+ * @param [out] patch  IPS patch.
+ * @param [in]  data   Target data, starting at offset @b base.
+ * @param [in]  base   Offset of the target data.
+ * @param [in]  start  Span start.
+ * @param [in]  end    Span end.
+ */
+static void diffLiteral(IPS::Patch& patch, const uint8_t* data, size_t base, size_t start, size_t end)
+{
+    size_t k = start;
+    while(k < end)
+    {
+        size_t len = ((end - k) > MaxRecordSize) ? MaxRecordSize : (end - k);
+        if(((k + len) == EOFOffset) && (k + len < end))
+        {
+            len--;
+        }
+        patch.add(Record(k, len, reinterpret_cast<uintptr_t>(data + (k - base))), false);
+        k += len;
+    }
+}
+
+/**
+ * Add the records of a modified span to the patch. Runs of the same byte
+ * are RLE encoded.
+ * @param [out] patch  IPS patch.
+ * @param [in]  data   Target data, starting at offset @b base.
+ * @param [in]  base   Offset of the target data.
+ * @param [in]  start  Span start.
+ * @param [in]  end    Span end.
+ */
+static void diffSpan(IPS::Patch& patch, const uint8_t* data, size_t base, size_t start, size_t end)
+{
+    // A RLE record (8 bytes) is worth it when it replaces more than its
+    // own size plus the header of the record that follows it.
+    static const size_t rleThreshold = 13;
+
+    size_t literal = start;
+    size_t i = start;
+    while(i < end)
+    {
+        uint8_t value = data[i - base];
+        size_t j = i + 1;
+        while((j < end) && (data[j - base] == value) && ((j - i) < MaxRecordSize))
+        {
+            j++;
+        }
+        size_t first = (EOFOffset == i) ? (i + 1) : i;
+        size_t last  = ((EOFOffset == j) && (j < end)) ? (j - 1) : j;
+        if((first < last) && ((last - first) >= rleThreshold))
+        {
+            diffLiteral(patch, data, base, literal, first);
+            patch.add(Record(first, last - first, value), false);
+            literal = last;
+        }
+        i = j;
+    }
+    diffLiteral(patch, data, base, literal, end);
+}
+
+/** Unchanged spans shorter than a record header are merged. **/
+static const size_t MergeThreshold = 5;
+
+/**
+ * Find the first position where two buffers differ.
+ * @param [in] a    First buffer.
+ * @param [in] b    Second buffer.
+ * @param [in] size Buffers size.
+ * @return Index of the first difference, or @b size if there is none.
+ */
+static size_t findMismatch(const uint8_t* a, const uint8_t* b, size_t size)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for(; (i + 16) <= size; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) ^ 0xffff;
+        if(mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#else
+    for(; (i + 8) <= size; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if(x != y)
+        {
+            break;
+        }
+    }
+#endif
+    while((i < size) && (a[i] == b[i]))
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Find the first position where two buffers hold the same byte.
+ * @param [in] a    First buffer.
+ * @param [in] b    Second buffer.
+ * @param [in] size Buffers size.
+ * @return Index of the first equal byte, or @b size if there is none.
+ */
+static size_t findMatch(const uint8_t* a, const uint8_t* b, size_t size)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for(; (i + 16) <= size; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+        if(mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#else
+    static const uint64_t ones = 0x0101010101010101ULL;
+    static const uint64_t highs = 0x8080808080808080ULL;
+    for(; (i + 8) <= size; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        // Equal bytes are the zero bytes of x ^ y.
+        uint64_t v = x ^ y;
+        if((v - ones) & ~v & highs)
+        {
+            break;
+        }
+    }
+#endif
+    while((i < size) && (a[i] != b[i]))
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Add the records for the differences in a target range.
+ * Changed and unchanged spans are found with vector comparisons.
+ * @param [out] patch  IPS patch.
+ * @param [in]  in     Source data, starting at offset @b base (may be
+ *                     @b nullptr if @b base is past the end of the source).
+ * @param [in]  inSize Source size.
+ * @param [in]  target Target data, starting at offset @b base.
+ * @param [in]  base   Range start.
+ * @param [in]  end    Range end.
+ */
+static void diffRange(IPS::Patch& patch, const uint8_t* in, size_t inSize, const uint8_t* target, size_t base, size_t end)
+{
+    // Bytes past the end of the source always differ.
+    size_t limit = (inSize < base) ? base : ((inSize < end) ? inSize : end);
+
+    size_t i = base;
+    while(i < end)
+    {
+        if(i < limit)
+        {
+            i += findMismatch(in + (i - base), target + (i - base), limit - i);
+            if(i >= end)
+            {
+                break;
+            }
+        }
+        size_t start = i;
+        // End of the changed bytes. Unchanged runs of at most
+        // MergeThreshold bytes between changed ones are kept in the span.
+        size_t last = i + 1;
+        for(;;)
+        {
+            if(last >= limit)
+            {
+                last = end;
+                break;
+            }
+            size_t next = last + findMismatch(in + (last - base), target + (last - base), limit - last);
+            if((next - last) > MergeThreshold)
+            {
+                break;
+            }
+            if(next >= limit)
+            {
+                last = (limit < end) ? end : last;
+                break;
+            }
+            last = next + findMatch(in + (next - base), target + (next - base), limit - next);
+        }
+        if((EOFOffset == start) && (start > base))
+        {
+            start--;
+        }
+        diffSpan(patch, target, base, start, last);
+        i = last;
+    }
+}
+
+/**
+ * Check if a target can be expressed as an IPS patch.
+ * @param [in] targetSize Target size.
+ */
+static bool checkDiff(size_t targetSize)
+{
+    // Records offsets are 24 bits wide.
+    if(targetSize > 0x1000000)
+    {
+        Error("Target is too large (%zu bytes)", targetSize);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Truncation size stored after the footer: the target size if the target
+ * is smaller than the source. A 16MB target needs the 32 bits trailer of
+ * IPS32.
+ * @param [in] inSize     Source size.
+ * @param [in] targetSize Target size.
+ */
+static size_t diffTruncation(size_t inSize, size_t targetSize)
+{
+    return (targetSize < inSize) ? targetSize : IPS::Patch::NoTruncation;
+}
+
+/**
+ * Create an IPS patch from the differences between two buffers.
+ * Record data points to the target buffer.
+ * @param [in]  in         Source data.
+ * @param [in]  inSize     Source data size.
+ * @param [in]  target     Target data.
+ * @param [in]  targetSize Target data size.
+ * @param [out] patch      IPS patch.
+ */
+bool diff(const uint8_t* in, size_t inSize, const uint8_t* target, size_t targetSize, IPS::Patch& patch)
+{
+    if(false == checkDiff(targetSize))
+    {
+        return false;
+    }
+    diffRange(patch, in, inSize, target, 0, targetSize);
+    patch.setTruncation(diffTruncation(inSize, targetSize));
+    return true;
+}
+
+/**
+ * Create an IPS patch file from the differences between two files.
+ * Both files are scanned through windows sharing the memory budget, and
+ * the records of each window are written before the next one is mapped.
+ * Modified spans crossing a window boundary are split in two.
+ * @param [in] in           Source filename.
+ * @param [in] target       Target filename.
+ * @param [in] patchName    IPS patch filename.
+ * @param [in] memoryBudget Maximum size of the files mapped at once.
+ */
+bool diff(const char* in, const char* target, const char* patchName, size_t memoryBudget)
+{
+    IPS::MappedWindow source, dest;
+    if((false == source.open(in, memoryBudget / 2)) || (false == dest.open(target, memoryBudget / 2)))
+    {
+        return false;
+    }
+    size_t inSize = source.size();
+    size_t targetSize = dest.size();
+    if(false == checkDiff(targetSize))
+    {
+        return false;
+    }
+    size_t truncation = diffTruncation(inSize, targetSize);
+    bool large = (IPS::Patch::NoTruncation != truncation) && (truncation > 0xffffff);
+    IPS::IO io;
+    if(!io.create(patchName, large ? Format::IPS32 : Format::IPS))
+    {
+        return false;
+    }
+    size_t chunk = dest.budget();
+    for(size_t base=0; base<targetSize; base+=chunk)
+    {
+        size_t end = ((targetSize - base) > chunk) ? (base + chunk) : targetSize;
+        const uint8_t *t = dest.data(base, end - base);
+        const uint8_t *s = nullptr;
+        if(base < inSize)
+        {
+            s = source.data(base, ((end < inSize) ? end : inSize) - base);
+        }
+        if((nullptr == t) || ((base < inSize) && (nullptr == s)))
+        {
+            io.finish();
+            remove(patchName);
+            return false;
+        }
+        IPS::Patch part;
+        diffRange(part, s, inSize, t, base, end);
+        if(!io.append(part))
+        {
+            remove(patchName);
+            return false;
+        }
+    }
+    return io.finish(truncation);
+}
+
+/**
+ * Rewrite a patch into the smallest equivalent patch for a source file.
+ * The output of the patch is rendered over the ranges written by its
+ * records, one slice at a time, and compared with the source (or with the
+ * zeros past its end) mapped through a window. Bytes already equal to the
+ * source are dropped, records are split around unchanged spans, runs
+ * become RLE records and spans separated by short unchanged runs are
+ * merged. The output size is kept: the truncation size is carried over,
+ * and a record is kept on the last byte of an output grown past the
+ * source.
+ * @param [in] in           Source filename.
+ * @param [in] patch        IPS patch.
+ * @param [in] patchName    Minimized IPS patch filename.
+ * @param [in] memoryBudget Maximum size of the source mapped at once.
+ */
+bool minimize(const char* in, IPS::Patch const& patch, const char* patchName, size_t memoryBudget)
+{
+    IPS::MappedWindow source;
+    if(false == source.open(in, memoryBudget))
+    {
+        return false;
+    }
+    size_t inSize = source.size();
+    size_t finalSize = patch.finalSize(inSize);
+    const uint32_t *offsets = patch.offsets();
+    const uint16_t *sizes = patch.sizes();
+    const uint8_t *rle = patch.rle();
+    const uintptr_t *payloads = patch.payloads();
+    size_t count = patch.count();
+
+    // Offsets only shrink, but the record kept on the last byte of a grown
+    // output may not fit in 24 bits.
+    bool grown = !patch.truncated() && (finalSize > inSize);
+    bool large = (count && (offsets[count - 1] > 0xffffff)) || (grown && (finalSize > 0x1000000)) ||
+                 (patch.truncated() && (patch.truncation() > 0xffffff));
+    IPS::IO io;
+    if(!io.create(patchName, large ? Format::IPS32 : Format::IPS))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> target, reference;
+    size_t chunk = source.budget();
+    size_t record = 0;
+    size_t covered = 0;
+    size_t written = 0;
+    for(size_t i=0; i<count; )
+    {
+        // Range written by overlapping or nearly contiguous records.
+        size_t start = offsets[i];
+        size_t end = start + sizes[i];
+        for(i++; (i<count) && (offsets[i] <= (end + MergeThreshold)); i++)
+        {
+            size_t last = static_cast<size_t>(offsets[i]) + sizes[i];
+            end = (last > end) ? last : end;
+        }
+        // Nothing past the final size is kept.
+        end = (end < finalSize) ? end : finalSize;
+        // Spans never start on the "EOF" marker.
+        if((EOFOffset == start) && start)
+        {
+            start--;
+        }
+        for(size_t base=start; base<end; )
+        {
+            size_t next = ((end - base) > chunk) ? (base + chunk) : end;
+            if((EOFOffset == next) && (next < end))
+            {
+                next--;
+            }
+            size_t size = next - base;
+            if(target.size() < size)
+            {
+                target.resize(size);
+            }
+            // Source data, then zeros past its end.
+            const uint8_t *s = nullptr;
+            size_t n = 0;
+            if(base < inSize)
+            {
+                n = ((next < inSize) ? next : inSize) - base;
+                source.release(base);
+                s = source.data(base, n);
+                if(nullptr == s)
+                {
+                    io.finish();
+                    remove(patchName);
+                    return false;
+                }
+                memcpy(target.data(), s, n);
+            }
+            memset(target.data() + n, 0, size - n);
+            if(n < size)
+            {
+                if(reference.size() < size)
+                {
+                    reference.resize(size);
+                }
+                memcpy(reference.data(), target.data(), size);
+                s = reference.data();
+            }
+
+            // Overlay records, in patch order.
+            for(size_t k=record; (k<count) && (offsets[k] < next); k++)
+            {
+                size_t first = (offsets[k] > base) ? offsets[k] : base;
+                size_t last = static_cast<size_t>(offsets[k]) + sizes[k];
+                last = (last < next) ? last : next;
+                if(first >= last)
+                {
+                    continue;
+                }
+                if(rle[k])
+                {
+                    memset(target.data() + (first - base), static_cast<uint8_t>(payloads[k]), last - first);
+                }
+                else
+                {
+                    memcpy(target.data() + (first - base), reinterpret_cast<const uint8_t*>(payloads[k]) + (first - offsets[k]), last - first);
+                }
+            }
+            while((record < count) && ((static_cast<size_t>(offsets[record]) + sizes[record]) <= next))
+            {
+                record++;
+            }
+
+            // The whole slice is compared, past the end of the source too.
+            IPS::Patch part;
+            diffRange(part, s, next, target.data(), base, next);
+            size_t m = part.count();
+            if(m)
+            {
+                size_t last = static_cast<size_t>(part.offsets()[m - 1]) + part.sizes()[m - 1];
+                covered = (last > covered) ? last : covered;
+            }
+            written += m;
+            if(!io.append(part))
+            {
+                remove(patchName);
+                return false;
+            }
+            base = next;
+        }
+    }
+
+    size_t truncation = patch.truncation();
+    if(grown && (covered < finalSize))
+    {
+        // Keep the output size with a zero byte at its end, or with the
+        // truncation size if that byte is on the "EOF" marker.
+        static const uint8_t zero = 0;
+        if(!large && (EOFOffset == (finalSize - 1)))
+        {
+            truncation = finalSize;
+        }
+        else
+        {
+            IPS::Patch guard;
+            guard.add(Record(finalSize - 1, 1, reinterpret_cast<uintptr_t>(&zero)), false);
+            written++;
+            if(!io.append(guard))
+            {
+                remove(patchName);
+                return false;
+            }
+        }
+    }
+    Info("Minimized %zu records into %zu records", count, written);
+    return io.finish(truncation);
+}
+
+} // namespace IPS
@@ -16,27 +16,189 @@
 #ifndef _IPS_UTILS_H_
 #define _IPS_UTILS_H_
 
+#include <atomic>
+#include <functional>
 #include <string>
+#include <vector>
 #include <cstdio>
+#include "backend.h"
 #include "ips.h"
+#include "mapping.h"
 
 namespace IPS {
+/**
+ * Apply progress.
+ */
+struct Progress
+{
+    size_t bytes;        /**< Bytes written so far (source copy and records). **/
+    size_t totalBytes;   /**< Total number of bytes to write. **/
+    size_t records;      /**< Records applied so far. **/
+    size_t totalRecords; /**< Number of records. **/
+};
+/**
+ * Progress notification callback.
+ */
+typedef std::function<void(Progress const&)> ProgressCallback;
+/**
+ * Apply options.
+ */
+struct ApplyOptions
+{
+    bool verbose;                     /**< Output informations. **/
+    bool checkCrc;                    /**< Check source CRC32. **/
+    uint32_t expectedCrc;             /**< Expected source CRC32. **/
+    ProgressCallback progress;        /**< Progress callback (may be empty). **/
+    unsigned int progressInterval;    /**< Minimum delay in ms between two progress notifications. **/
+    std::atomic<bool> const* cancel;  /**< If not @b nullptr, apply stops as soon as it is set. **/
+    bool logErrors;                   /**< Log failures (they are always reported by the returned status). **/
+    bool batched;                     /**< Batch output writes (io_uring or pwritev) instead of going through stdio. **/
+    bool fused;                       /**< Copy the source and write the records in a single sequential pass. **/
+    size_t memoryBudget;              /**< Maximum size of the source file mapped at once. **/
+    Backend::Value backend;           /**< Source copy backend (ignored in fused mode, @b Stdio if not batched). **/
+    /** Default constructor. **/
+    ApplyOptions();
+};
+/**
+ * Compute the CRC32 (IEEE 802.3) of a memory block.
+ * @param [in] data  Data buffer.
+ * @param [in] len   Data size.
+ * @param [in] crc   CRC of the previous blocks (0 for the first one).
+ * @return Updated CRC.
+ */
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc=0);
+/**
+ * Compute a 64 bits non-cryptographic hash of a memory block.
+ * @param [in] data  Data buffer.
+ * @param [in] len   Data size.
+ * @return Hash value.
+ */
+uint64_t hash64(const uint8_t* data, size_t len);
 /**
  * Create a copy of the source file.
- * @param [in] sourceFilename Source filename.
- * @param [in] destFilename   Destination filename.
+ * @param [in]  sourceFilename Source filename.
+ * @param [in]  destFilename   Destination filename.
+ * @param [out] crc            If not @b nullptr, CRC32 of the source file.
  * @return File descriptor pointing to the beginnig of the destination
  *         file or @b nullptr if something went wrong.
  */
-FILE* copyFile(std::string const& sourceFilename, std::string const& destFilename);
+FILE* copyFile(std::string const& sourceFilename, std::string const& destFilename, uint32_t* crc=nullptr);
 /**
  * Apply patch to input file and write output to another file.
  * @param [in] in      Input filename.
  * @param [in] out     Output filename.
  * @param [in] patch   IPS patch.
  * @param [in] verbose Output informations. 
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose);
+/**
+ * Apply patch to input file and write output to another file, only if
+ * the input file CRC32 matches the expected one.
+ * The CRC is computed while the input is copied. On mismatch no record
+ * is written and the output file is removed.
+ * @param [in] in          Input filename.
+ * @param [in] out         Output filename.
+ * @param [in] patch       IPS patch.
+ * @param [in] verbose     Output informations. 
+ * @param [in] expectedCrc Expected input file CRC32.
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose, uint32_t expectedCrc);
+/**
+ * Apply patch to input file and write output to another file.
+ * If the source CRC32 does not match or if apply is cancelled, the output
+ * file is removed.
+ * @param [in] in      Input filename.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] options Apply options.
+ * @return Apply status.
+ */
+Status apply(const char* in, const char* out, IPS::Patch const& patch, ApplyOptions const& options);
+/**
+ * Apply patch to an input buffer and write output to a file.
+ * @param [in] in      Input data.
+ * @param [in] inSize  Input data size.
+ * @param [in] out     Output filename.
+ * @param [in] patch   IPS patch.
+ * @param [in] verbose Output informations. 
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, const char* out, IPS::Patch const& patch, bool verbose);
+/**
+ * Apply a patch held in memory to an input buffer and write output to a
+ * file, without building a Patch.
+ * Records are decoded and written one at a time, in patch order.
+ * Overlapping records are rejected with @b IPS_ERROR_INVALID. If the
+ * patch turns out to be truncated or invalid, the output file is removed.
+ * @param [in] in        Input data.
+ * @param [in] inSize    Input data size.
+ * @param [in] out       Output filename.
+ * @param [in] patch     IPS patch data (for instance a mapped patch file).
+ * @param [in] patchSize IPS patch size.
+ * @param [in] verbose   Output informations. 
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, const char* out, const uint8_t* patch, size_t patchSize, bool verbose);
+/**
+ * Apply a patch held in memory to an input file and write output to
+ * another file, without building a Patch.
+ * The source is copied with bounded buffers, through a bounded mapping
+ * window or in the kernel, and its CRC32 is checked while it is copied.
+ * @param [in] in        Input filename.
+ * @param [in] out       Output filename.
+ * @param [in] patch     IPS patch data (for instance a mapped patch file).
+ * @param [in] patchSize IPS patch size.
+ * @param [in] options   Apply options. The fused mode applies a Patch
+ *                       decoded from @b patch . Otherwise the writes are
+ *                       always batched and the stdio backend falls back
+ *                       to read.
+ * @return Apply status (@b IPS_ERROR_PROCESS if the source CRC32 does
+ *         not match).
+ */
+Status apply(const char* in, const char* out, const uint8_t* patch, size_t patchSize, ApplyOptions const& options);
+/**
+ * Apply patch to an input buffer and store the output in memory.
+ * @param [in]  in      Input data.
+ * @param [in]  inSize  Input data size.
+ * @param [in]  patch   IPS patch.
+ * @param [out] output  Output data.
+ * @return Apply status.
+ */
+Status apply(const uint8_t* in, size_t inSize, IPS::Patch const& patch, std::vector<uint8_t>& output);
+/**
+ * Create an IPS patch from the differences between two buffers.
+ * Record data points to the target buffer.
+ * @param [in]  in         Source data.
+ * @param [in]  inSize     Source data size.
+ * @param [in]  target     Target data.
+ * @param [in]  targetSize Target data size.
+ * @param [out] patch      IPS patch.
+ */
+bool diff(const uint8_t* in, size_t inSize, const uint8_t* target, size_t targetSize, IPS::Patch& patch);
+/**
+ * Create an IPS patch file from the differences between two files.
+ * The files are scanned through windows, so that at most
+ * @b memoryBudget bytes of them are mapped at once.
+ * @param [in] in           Source filename.
+ * @param [in] target       Target filename.
+ * @param [in] patchName    IPS patch filename.
+ * @param [in] memoryBudget Maximum size of the files mapped at once.
+ */
+bool diff(const char* in, const char* target, const char* patchName, size_t memoryBudget=MappedWindow::DefaultBudget);
+/**
+ * Rewrite a patch into the smallest equivalent patch for a source file:
+ * bytes already equal to the source are dropped, records are split around
+ * unchanged spans and runs become RLE records. The source is compared
+ * through a window, so that at most @b memoryBudget bytes of it are
+ * mapped at once.
+ * @param [in] in           Source filename.
+ * @param [in] patch        IPS patch.
+ * @param [in] patchName    Minimized IPS patch filename.
+ * @param [in] memoryBudget Maximum size of the source mapped at once.
  */
-bool apply(const char* in, const char* out, IPS::Patch const& patch, bool verbose);
+bool minimize(const char* in, IPS::Patch const& patch, const char* patchName, size_t memoryBudget=MappedWindow::DefaultBudget);
 
 } // namespace IPS
 
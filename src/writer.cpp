@@ -0,0 +1,673 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define IPS_HAVE_URING 1
+#endif
+#include "writer.h"
+
+namespace IPS {
+
+/** Maximum size of a single queued write. **/
+static const size_t MaxWriteSize = 1024 * 1024;
+/** Number of io_uring submission queue entries. **/
+static const unsigned RingEntries = 128;
+
+#ifdef IPS_HAVE_URING
+/**
+ * io_uring instance set up with raw system calls.
+ */
+struct BatchWriter::Ring
+{
+    int fd;
+    unsigned entries;
+    bool fixed;             /**< Staging buffers are registered. **/
+    void* sqPtr;
+    size_t sqSize;
+    void* cqPtr;
+    size_t cqSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned queued;        /**< Entries filled but not submitted. **/
+    unsigned inflight;      /**< Entries submitted but not completed. **/
+    std::vector<Request> slots;
+    std::vector<unsigned> freeSlots;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+static int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+}
+static int uringRegister(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+#else
+struct BatchWriter::Ring {};
+#endif
+
+/** Default constructor. **/
+BatchWriter::BatchWriter()
+    : _fd(-1)
+    , _ring(nullptr)
+    , _buffers(nullptr)
+    , _fillBuffer(-1)
+    , _fillUsed(0)
+    , _pending()
+    , _error(0)
+    , _errorOffset(0)
+    , _submissions(0)
+{
+    memset(_refs, 0, sizeof(_refs));
+}
+/** Destructor. Pending writes are flushed. **/
+BatchWriter::~BatchWriter()
+{
+    close();
+    free(_buffers);
+}
+/**
+ * Attach to an output file.
+ * @param [in] fd    Output file descriptor (not owned).
+ * @param [in] uring Try to use io_uring.
+ * @return @b false if the staging buffers could not be allocated.
+ */
+bool BatchWriter::open(int fd, bool uring)
+{
+    close();
+    if(nullptr == _buffers)
+    {
+        void *ptr = nullptr;
+        if(posix_memalign(&ptr, 4096, BufferSize * BufferCount))
+        {
+            return false;
+        }
+        _buffers = static_cast<uint8_t*>(ptr);
+    }
+    memset(_refs, 0, sizeof(_refs));
+    _fillBuffer = -1;
+    _fillUsed = 0;
+    _fd = fd;
+    _error = 0;
+    _errorOffset = 0;
+    _submissions = 0;
+    if(uring)
+    {
+        setupRing();
+    }
+    return true;
+}
+/**
+ * Flush pending writes and release the io_uring instance.
+ * @return @b false if a write failed.
+ */
+bool BatchWriter::close()
+{
+    if(_fd < 0)
+    {
+        return (0 == _error);
+    }
+    bool ret = flush();
+    releaseRing();
+    _fd = -1;
+    return ret;
+}
+/** Check if writes are submitted through io_uring. **/
+bool BatchWriter::uring() const
+{
+    return (nullptr != _ring);
+}
+/**
+ * Queue a write. @b data must stay valid until flush() returns.
+ * @param [in] offset Output offset.
+ * @param [in] data   Data.
+ * @param [in] size   Data size.
+ * @return @b false if a previous write failed.
+ */
+bool BatchWriter::write(uint64_t offset, const uint8_t* data, size_t size)
+{
+    while(size && (0 == _error))
+    {
+        Request request;
+        request.offset = offset;
+        request.data = data;
+        request.size = (size < MaxWriteSize) ? size : MaxWriteSize;
+        request.buffer = -1;
+        queue(request);
+        offset += request.size;
+        data += request.size;
+        size -= request.size;
+    }
+    return (0 == _error);
+}
+/**
+ * Get a free staging buffer of @b BufferSize bytes, waiting for
+ * queued writes to complete if needed.
+ * @return @b nullptr if a previous write failed.
+ */
+uint8_t* BatchWriter::acquire()
+{
+    while(0 == _error)
+    {
+        for(size_t i=0; i<BufferCount; i++)
+        {
+            if(0 == _refs[i])
+            {
+                _refs[i] = 1;
+                return _buffers + (i * BufferSize);
+            }
+        }
+        if(nullptr != _ring)
+        {
+            submitRing(1);
+        }
+        else
+        {
+            flushVector();
+        }
+    }
+    return nullptr;
+}
+/**
+ * Queue the write of a staging buffer returned by acquire().
+ * The buffer is released once written.
+ * @param [in] buffer Staging buffer.
+ * @param [in] offset Output offset.
+ * @param [in] size   Data size.
+ * @return @b false if a previous write failed.
+ */
+bool BatchWriter::commit(uint8_t* buffer, uint64_t offset, size_t size)
+{
+    int index = static_cast<int>((buffer - _buffers) / BufferSize);
+    if((0 != _error) || (0 == size))
+    {
+        release(index);
+        return (0 == _error);
+    }
+    // The caller reference is handed over to the queued write.
+    Request request;
+    request.offset = offset;
+    request.data = buffer;
+    request.size = size;
+    request.buffer = index;
+    queue(request);
+    return (0 == _error);
+}
+/**
+ * Queue the write of a repeated byte. Small fills share staging
+ * buffers.
+ * @param [in] offset Output offset.
+ * @param [in] byte   Byte value.
+ * @param [in] size   Number of bytes.
+ * @return @b false if a previous write failed.
+ */
+bool BatchWriter::fill(uint64_t offset, uint8_t byte, size_t size)
+{
+    while(size && (0 == _error))
+    {
+        size_t count = (size < BufferSize) ? size : BufferSize;
+        if((_fillBuffer < 0) || ((_fillUsed + count) > BufferSize))
+        {
+            if(_fillBuffer >= 0)
+            {
+                release(_fillBuffer);
+                _fillBuffer = -1;
+            }
+            uint8_t *buffer = acquire();
+            if(nullptr == buffer)
+            {
+                break;
+            }
+            _fillBuffer = static_cast<int>((buffer - _buffers) / BufferSize);
+            _fillUsed = 0;
+        }
+        uint8_t *data = _buffers + (_fillBuffer * BufferSize) + _fillUsed;
+        memset(data, byte, count);
+        _fillUsed += count;
+        _refs[_fillBuffer]++;
+
+        Request request;
+        request.offset = offset;
+        request.data = data;
+        request.size = count;
+        request.buffer = _fillBuffer;
+        queue(request);
+        offset += count;
+        size -= count;
+    }
+    return (0 == _error);
+}
+/**
+ * Queue a request on the active backend.
+ */
+void BatchWriter::queue(Request const& request)
+{
+    if(nullptr != _ring)
+    {
+        queueRing(request);
+    }
+    else
+    {
+        _pending.push_back(request);
+    }
+}
+/**
+ * Drop a reference to a staging buffer.
+ */
+void BatchWriter::release(int buffer)
+{
+    if((buffer >= 0) && _refs[buffer])
+    {
+        _refs[buffer]--;
+    }
+}
+/**
+ * Submit pending writes and wait for their completion.
+ * @return @b false if a write failed.
+ */
+bool BatchWriter::flush()
+{
+#ifdef IPS_HAVE_URING
+    if(nullptr != _ring)
+    {
+        while((_ring->queued || _ring->inflight) && submitRing(1))
+        {}
+        return (0 == _error);
+    }
+#endif
+    return flushVector();
+}
+/** errno value of the first failed write (0 if none). **/
+int BatchWriter::error() const
+{
+    return _error;
+}
+/** Output offset of the first failed write. **/
+uint64_t BatchWriter::errorOffset() const
+{
+    return _errorOffset;
+}
+/** Number of write submissions (io_uring_enter or pwritev calls). **/
+size_t BatchWriter::submissions() const
+{
+    return _submissions;
+}
+/** Record the first failure. **/
+void BatchWriter::fail(int error, uint64_t offset)
+{
+    if(0 == _error)
+    {
+        _error = error ? error : EIO;
+        _errorOffset = offset;
+    }
+}
+/**
+ * Write pending requests with pwritev, merging contiguous ones.
+ */
+bool BatchWriter::flushVector()
+{
+    struct iovec iov[IOV_MAX < 1024 ? IOV_MAX : 1024];
+    const size_t maxCount = sizeof(iov) / sizeof(iov[0]);
+    for(size_t i=0; (i<_pending.size()) && (0 == _error); )
+    {
+        uint64_t offset = _pending[i].offset;
+        uint64_t end = offset;
+        size_t count = 0;
+        for(; (i<_pending.size()) && (count<maxCount) && (_pending[i].offset == end); i++, count++)
+        {
+            iov[count].iov_base = const_cast<uint8_t*>(_pending[i].data);
+            iov[count].iov_len = _pending[i].size;
+            end += _pending[i].size;
+        }
+        // Write the group, resuming after partial writes.
+        struct iovec *current = iov;
+        while(count && (0 == _error))
+        {
+            ssize_t n = pwritev(_fd, current, static_cast<int>(count), static_cast<off_t>(offset));
+            _submissions++;
+            if(n < 0)
+            {
+                if(EINTR != errno)
+                {
+                    fail(errno, offset);
+                }
+                continue;
+            }
+            offset += n;
+            while(count && (static_cast<size_t>(n) >= current->iov_len))
+            {
+                n -= current->iov_len;
+                current++;
+                count--;
+            }
+            if(count)
+            {
+                current->iov_base = static_cast<uint8_t*>(current->iov_base) + n;
+                current->iov_len -= n;
+            }
+        }
+    }
+    _pending.clear();
+    // Every staging buffer is free again, the fill buffer included.
+    memset(_refs, 0, sizeof(_refs));
+    _fillBuffer = -1;
+    _fillUsed = 0;
+    return (0 == _error);
+}
+
+#ifdef IPS_HAVE_URING
+/**
+ * Set up the io_uring instance. On failure writes go through pwritev.
+ */
+bool BatchWriter::setupRing()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uringSetup(RingEntries, &params);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    // IORING_OP_WRITE needs a 5.6+ kernel, which also provides probing.
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = static_cast<struct io_uring_probe*>(calloc(1, probeSize));
+    bool supported = (nullptr != probe)
+                  && (uringRegister(fd, IORING_REGISTER_PROBE, probe, 256) >= 0)
+                  && (probe->last_op >= IORING_OP_WRITE)
+                  && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if(false == supported)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    Ring *ring = new Ring;
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if(single)
+    {
+        ring->sqSize = ring->cqSize = (ring->sqSize > ring->cqSize) ? ring->sqSize : ring->cqSize;
+    }
+    ring->sqPtr = mmap(nullptr, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqPtr = single ? ring->sqPtr : mmap(nullptr, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if((MAP_FAILED == ring->sqPtr) || (MAP_FAILED == ring->cqPtr) || (MAP_FAILED == ring->sqes))
+    {
+        if(MAP_FAILED != ring->sqes)
+        {
+            munmap(ring->sqes, ring->sqesSize);
+        }
+        if((MAP_FAILED != ring->cqPtr) && !single)
+        {
+            munmap(ring->cqPtr, ring->cqSize);
+        }
+        if(MAP_FAILED != ring->sqPtr)
+        {
+            munmap(ring->sqPtr, ring->sqSize);
+        }
+        ::close(fd);
+        delete ring;
+        return false;
+    }
+    uint8_t *sq = static_cast<uint8_t*>(ring->sqPtr);
+    uint8_t *cq = static_cast<uint8_t*>(ring->cqPtr);
+    ring->sqHead  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring->sqTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sqMask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->cqHead  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cqTail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cqMask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes    = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring->queued = 0;
+    ring->inflight = 0;
+    ring->slots.resize(ring->entries);
+    ring->freeSlots.reserve(ring->entries);
+    for(unsigned i=0; i<ring->entries; i++)
+    {
+        ring->freeSlots.push_back(ring->entries - 1 - i);
+    }
+
+    // Registered staging buffers save the page pinning on each write.
+    // This may fail under a low RLIMIT_MEMLOCK; plain writes are used then.
+    struct iovec iov[BufferCount];
+    for(size_t i=0; i<BufferCount; i++)
+    {
+        iov[i].iov_base = _buffers + (i * BufferSize);
+        iov[i].iov_len = BufferSize;
+    }
+    ring->fixed = (uringRegister(fd, IORING_REGISTER_BUFFERS, iov, BufferCount) >= 0);
+
+    _ring = ring;
+    return true;
+}
+/**
+ * Release the io_uring instance.
+ */
+void BatchWriter::releaseRing()
+{
+    if(nullptr == _ring)
+    {
+        return;
+    }
+    munmap(_ring->sqes, _ring->sqesSize);
+    if(_ring->cqPtr != _ring->sqPtr)
+    {
+        munmap(_ring->cqPtr, _ring->cqSize);
+    }
+    munmap(_ring->sqPtr, _ring->sqSize);
+    ::close(_ring->fd);
+    delete _ring;
+    _ring = nullptr;
+}
+/**
+ * Add a write to the submission queue.
+ */
+bool BatchWriter::queueRing(Request const& request)
+{
+    // Keep the number of outstanding requests within the ring size so
+    // that completions never overflow. Waiting for half of them keeps
+    // the number of system calls low.
+    while((0 == _error) && _ring->freeSlots.empty())
+    {
+        unsigned wait = _ring->inflight / 2;
+        submitRing(wait ? wait : 1);
+    }
+    if(0 != _error)
+    {
+        release(request.buffer);
+        return false;
+    }
+    unsigned slot = _ring->freeSlots.back();
+    _ring->freeSlots.pop_back();
+    _ring->slots[slot] = request;
+
+    unsigned tail = *_ring->sqTail;
+    unsigned index = tail & *_ring->sqMask;
+    struct io_uring_sqe *sqe = &_ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if((request.buffer >= 0) && _ring->fixed)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = static_cast<uint16_t>(request.buffer);
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_WRITE;
+    }
+    sqe->fd = _fd;
+    sqe->off = request.offset;
+    sqe->addr = reinterpret_cast<uintptr_t>(request.data);
+    sqe->len = static_cast<uint32_t>(request.size);
+    sqe->user_data = slot;
+    _ring->sqArray[index] = index;
+    __atomic_store_n(_ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    _ring->queued++;
+
+    if(_ring->queued == _ring->entries)
+    {
+        submitRing(0);
+    }
+    return (0 == _error);
+}
+/**
+ * Submit queued entries and reap completions.
+ * @param [in] wait Number of completions to wait for.
+ * @return @b false if the submission itself failed.
+ */
+bool BatchWriter::submitRing(unsigned wait)
+{
+    int n;
+    for(;;)
+    {
+        n = uringEnter(_ring->fd, _ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        _submissions++;
+        if((n >= 0) || (EINTR == errno))
+        {
+            if(n >= 0)
+            {
+                break;
+            }
+            continue;
+        }
+        // The completion queue is full: make room and retry.
+        if(((EAGAIN == errno) || (EBUSY == errno)) && reapRing())
+        {
+            continue;
+        }
+        break;
+    }
+    if(n < 0)
+    {
+        fail(errno, 0);
+        return false;
+    }
+    _ring->queued -= n;
+    _ring->inflight += n;
+    reapRing();
+    return true;
+}
+/**
+ * Process completions. Short writes are queued again for the remaining bytes.
+ * @return @b true if at least one completion was processed.
+ */
+bool BatchWriter::reapRing()
+{
+    std::vector<Request> retry;
+    unsigned head = *_ring->cqHead;
+    unsigned tail = __atomic_load_n(_ring->cqTail, __ATOMIC_ACQUIRE);
+    bool reaped = (head != tail);
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &_ring->cqes[head & *_ring->cqMask];
+        unsigned slot = static_cast<unsigned>(cqe->user_data);
+        Request request = _ring->slots[slot];
+        _ring->freeSlots.push_back(slot);
+        _ring->inflight--;
+        if(cqe->res < 0)
+        {
+            fail(-cqe->res, request.offset);
+        }
+        else if(static_cast<size_t>(cqe->res) < request.size)
+        {
+            if(0 == cqe->res)
+            {
+                fail(EIO, request.offset);
+            }
+            else
+            {
+                request.offset += cqe->res;
+                request.data += cqe->res;
+                request.size -= cqe->res;
+                retry.push_back(request);
+                continue;
+            }
+        }
+        release(request.buffer);
+    }
+    __atomic_store_n(_ring->cqHead, head, __ATOMIC_RELEASE);
+    for(size_t i=0; i<retry.size(); i++)
+    {
+        queueRing(retry[i]);
+    }
+    return reaped;
+}
+#else
+bool BatchWriter::setupRing()
+{
+    return false;
+}
+void BatchWriter::releaseRing()
+{}
+bool BatchWriter::queueRing(Request const&)
+{
+    return false;
+}
+bool BatchWriter::submitRing(unsigned)
+{
+    return false;
+}
+bool BatchWriter::reapRing()
+{
+    return false;
+}
+#endif
+
+/** Constructor. **/
+BatchWriter::BatchWriter(BatchWriter const&)
+    : _fd(-1)
+    , _ring(nullptr)
+    , _buffers(nullptr)
+    , _fillBuffer(-1)
+    , _fillUsed(0)
+    , _pending()
+    , _error(0)
+    , _errorOffset(0)
+    , _submissions(0)
+{}
+/** Copy operator. **/
+BatchWriter& BatchWriter::operator= (BatchWriter const&)
+{
+    return *this;
+}
+
+} // namespace IPS
@@ -0,0 +1,149 @@
+/*
+ * IPS Patcher
+ *
+ * Copyright (c) 2014, Vincent Cruz, All rights reserved.
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+#ifndef _IPS_WRITER_H_
+#define _IPS_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace IPS {
+
+/**
+ * Batched positional writes.
+ * Writes are queued and submitted together through io_uring when the
+ * kernel provides it, or grouped into pwritev calls otherwise. Queued
+ * writes may complete in any order, so writes to overlapping ranges
+ * must be separated by a call to flush().
+ */
+class BatchWriter
+{
+    public:
+        /** Size of a staging buffer. **/
+        static const size_t BufferSize = 256 * 1024;
+        /** Number of staging buffers. **/
+        static const size_t BufferCount = 8;
+
+    public:
+        /** Default constructor. **/
+        BatchWriter();
+        /** Destructor. Pending writes are flushed. **/
+        ~BatchWriter();
+        /**
+         * Attach to an output file.
+         * @param [in] fd    Output file descriptor (not owned).
+         * @param [in] uring Try to use io_uring.
+         * @return @b false if the staging buffers could not be allocated.
+         */
+        bool open(int fd, bool uring=true);
+        /**
+         * Flush pending writes and release the io_uring instance.
+         * @return @b false if a write failed.
+         */
+        bool close();
+        /** Check if writes are submitted through io_uring. **/
+        bool uring() const;
+        /**
+         * Queue a write. @b data must stay valid until flush() returns.
+         * @param [in] offset Output offset.
+         * @param [in] data   Data.
+         * @param [in] size   Data size.
+         * @return @b false if a previous write failed.
+         */
+        bool write(uint64_t offset, const uint8_t* data, size_t size);
+        /**
+         * Get a free staging buffer of @b BufferSize bytes, waiting for
+         * queued writes to complete if needed.
+         * @return @b nullptr if a previous write failed.
+         */
+        uint8_t* acquire();
+        /**
+         * Queue the write of a staging buffer returned by acquire().
+         * The buffer is released once written.
+         * @param [in] buffer Staging buffer.
+         * @param [in] offset Output offset.
+         * @param [in] size   Data size.
+         * @return @b false if a previous write failed.
+         */
+        bool commit(uint8_t* buffer, uint64_t offset, size_t size);
+        /**
+         * Queue the write of a repeated byte. Small fills share staging
+         * buffers.
+         * @param [in] offset Output offset.
+         * @param [in] byte   Byte value.
+         * @param [in] size   Number of bytes.
+         * @return @b false if a previous write failed.
+         */
+        bool fill(uint64_t offset, uint8_t byte, size_t size);
+        /**
+         * Submit pending writes and wait for their completion.
+         * @return @b false if a write failed.
+         */
+        bool flush();
+        /** errno value of the first failed write (0 if none). **/
+        int error() const;
+        /** Output offset of the first failed write. **/
+        uint64_t errorOffset() const;
+        /** Number of write submissions (io_uring_enter or pwritev calls). **/
+        size_t submissions() const;
+
+    private:
+        /** Queued write. **/
+        struct Request
+        {
+            uint64_t offset;
+            const uint8_t* data;
+            size_t size;
+            int buffer;   /**< Staging buffer index or -1. **/
+        };
+        /** io_uring state. **/
+        struct Ring;
+
+        bool setupRing();
+        void releaseRing();
+        bool queueRing(Request const& request);
+        bool submitRing(unsigned wait);
+        bool reapRing();
+        bool flushVector();
+        void queue(Request const& request);
+        void release(int buffer);
+        void fail(int error, uint64_t offset);
+
+    private:
+        BatchWriter(BatchWriter const&);
+        BatchWriter& operator= (BatchWriter const&);
+
+    private:
+        int _fd;
+        Ring* _ring;
+        /** Staging buffers storage. **/
+        uint8_t* _buffers;
+        /** Number of users (caller or queued writes) of each staging buffer. **/
+        unsigned _refs[BufferCount];
+        /** Staging buffer holding fill data (-1 if none). **/
+        int _fillBuffer;
+        /** Bytes used in the fill buffer. **/
+        size_t _fillUsed;
+        /** Writes waiting for pwritev. **/
+        std::vector<Request> _pending;
+        int _error;
+        uint64_t _errorOffset;
+        size_t _submissions;
+};
+
+} // namespace IPS
+
+#endif /* _IPS_WRITER_H_ */